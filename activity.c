@@ -0,0 +1,247 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "activity.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct {
+  Activity* activity;
+  int failed;
+} Decoder;
+
+// Grows an aligned column from count to capacity elements, in the arena
+// if there is one (the old column then stays there until the reset).
+static int GrowColumn(Arena* arena, void** column, size_t element_size,
+                      size_t count, size_t capacity) {
+  void* grown;
+  if (arena != NULL) {
+    grown = ArenaAlloc(arena, capacity * element_size);
+    if (grown == NULL) {
+      return -1;
+    }
+  } else if (posix_memalign(&grown, COLUMN_ALIGNMENT,
+                            capacity * element_size)) {
+    return -1;
+  }
+  if (*column != NULL) {
+    memcpy(grown, *column, count * element_size);
+    if (arena == NULL) {
+      free(*column);
+    }
+  }
+  *column = grown;
+  return 0;
+}
+
+#define GROW(a, column, count, capacity) \
+  GrowColumn((a)->arena, (void**)&(column), sizeof(*(column)), count, \
+             capacity)
+
+static int GrowGPS(Activity* a, size_t capacity) {
+  if (GROW(a, a->time, a->gps_count, capacity) ||
+      GROW(a, a->latitude, a->gps_count, capacity) ||
+      GROW(a, a->longitude, a->gps_count, capacity) ||
+      GROW(a, a->speed, a->gps_count, capacity) ||
+      GROW(a, a->heading, a->gps_count, capacity) ||
+      GROW(a, a->inc_distance, a->gps_count, capacity) ||
+      GROW(a, a->cum_distance, a->gps_count, capacity) ||
+      GROW(a, a->calories, a->gps_count, capacity) ||
+      GROW(a, a->cycles, a->gps_count, capacity)) {
+    return -1;
+  }
+  a->gps_capacity = capacity;
+  return 0;
+}
+
+static int ReserveGPS(Activity* a) {
+  if (a->gps_count < a->gps_capacity) {
+    return 0;
+  }
+  return GrowGPS(a, a->gps_capacity ? 2 * a->gps_capacity : 1024);
+}
+
+static int GrowHeartRate(Activity* a, size_t capacity) {
+  if (GROW(a, a->heart_time, a->heart_count, capacity) ||
+      GROW(a, a->heart_rate, a->heart_count, capacity)) {
+    return -1;
+  }
+  a->heart_capacity = capacity;
+  return 0;
+}
+
+static int ReserveHeartRate(Activity* a) {
+  if (a->heart_count < a->heart_capacity) {
+    return 0;
+  }
+  return GrowHeartRate(a, a->heart_capacity ? 2 * a->heart_capacity : 1024);
+}
+
+static int GrowLap(Activity* a, size_t capacity) {
+  if (GROW(a, a->lap_time, a->lap_count, capacity) ||
+      GROW(a, a->lap_number, a->lap_count, capacity) ||
+      GROW(a, a->lap_activity, a->lap_count, capacity)) {
+    return -1;
+  }
+  a->lap_capacity = capacity;
+  return 0;
+}
+
+static int ReserveLap(Activity* a) {
+  if (a->lap_count < a->lap_capacity) {
+    return 0;
+  }
+  return GrowLap(a, a->lap_capacity ? 2 * a->lap_capacity : 16);
+}
+
+static void OnHeader(void* context, const Header* header) {
+  Decoder* d = context;
+  d->activity->header = *header;
+  d->activity->has_header = 1;
+}
+
+static void OnSummary(void* context, const Summary* summary) {
+  Decoder* d = context;
+  d->activity->summary = *summary;
+  d->activity->has_summary = 1;
+}
+
+static void OnCorrupt(void* context, size_t offset, size_t size) {
+  Decoder* d = context;
+  d->activity->corrupt_bytes += size;
+}
+
+static void OnGPS(void* context, const GPSSample* gps) {
+  Decoder* d = context;
+  Activity* a = d->activity;
+  if (gps->time == 0xffffffff) {
+    return;
+  }
+  if (ReserveGPS(a)) {
+    d->failed = 1;
+    return;
+  }
+  size_t i = a->gps_count++;
+  a->time[i] = gps->time;
+  a->latitude[i] = gps->latitude;
+  a->longitude[i] = gps->longitude;
+  a->speed[i] = gps->speed;
+  a->heading[i] = gps->heading;
+  a->inc_distance[i] = gps->inc_distance;
+  a->cum_distance[i] = gps->cum_distance;
+  a->calories[i] = gps->calories;
+  a->cycles[i] = gps->cycles;
+}
+
+static void OnHeartRate(void* context, const HeartRateSample* heart) {
+  Decoder* d = context;
+  Activity* a = d->activity;
+  if (ReserveHeartRate(a)) {
+    d->failed = 1;
+    return;
+  }
+  size_t i = a->heart_count++;
+  a->heart_time[i] = heart->time;
+  a->heart_rate[i] = heart->heart_rate;
+}
+
+static void OnLap(void* context, const Lap* lap) {
+  Decoder* d = context;
+  Activity* a = d->activity;
+  if (ReserveLap(a)) {
+    d->failed = 1;
+    return;
+  }
+  size_t i = a->lap_count++;
+  a->lap_time[i] = lap->time;
+  a->lap_number[i] = lap->lap;
+  a->lap_activity[i] = lap->activity;
+}
+
+int ReserveActivity(Activity* a, size_t gps, size_t heart, size_t laps) {
+  if ((gps > a->gps_capacity && GrowGPS(a, gps)) ||
+      (heart > a->heart_capacity && GrowHeartRate(a, heart)) ||
+      (laps > a->lap_capacity && GrowLap(a, laps))) {
+    return -1;
+  }
+  return 0;
+}
+
+// Bytes taken in an arena by the columns of that many samples.
+static size_t ColumnsSize(const Activity* a, size_t gps, size_t heart,
+                          size_t laps) {
+  size_t row = sizeof(*a->time) + sizeof(*a->latitude) +
+      sizeof(*a->longitude) + sizeof(*a->speed) + sizeof(*a->heading) +
+      sizeof(*a->inc_distance) + sizeof(*a->cum_distance) +
+      sizeof(*a->calories) + sizeof(*a->cycles);
+  size_t heart_row = sizeof(*a->heart_time) + sizeof(*a->heart_rate);
+  size_t lap_row = sizeof(*a->lap_time) + sizeof(*a->lap_number) +
+      sizeof(*a->lap_activity);
+  // Plus the padding of the 14 columns.
+  return gps * row + heart * heart_row + laps * lap_row +
+      14 * ARENA_ALIGNMENT;
+}
+
+int ReserveActivityInArena(Activity* a, size_t gps, size_t heart,
+                           size_t laps) {
+  if (a->arena != NULL &&
+      ReserveArena(a->arena, ColumnsSize(a, gps, heart, laps))) {
+    return -1;
+  }
+  return ReserveActivity(a, gps, heart, laps);
+}
+
+int DecodeActivity(const uint8_t* data, size_t size, Activity* activity) {
+  return DecodeActivityInArena(data, size, NULL, activity);
+}
+
+int DecodeActivityInArena(const uint8_t* data, size_t size, Arena* arena,
+                          Activity* activity) {
+  memset(activity, 0, sizeof(*activity));
+  activity->arena = arena;
+  // A file of that size can't hold more records of each kind, so the
+  // columns never grow.
+  if (arena != NULL &&
+      ReserveActivityInArena(activity, size / (1 + RecordSize(0x22)),
+                             size / (1 + RecordSize(0x25)),
+                             size / (1 + RecordSize(0x21)))) {
+    return -1;
+  }
+  Decoder decoder = { activity, 0 };
+  TTBinVisitor visitor = {
+    .context = &decoder,
+    .header = OnHeader,
+    .lap = OnLap,
+    .gps = OnGPS,
+    .heart_rate = OnHeartRate,
+    .summary = OnSummary,
+    .corrupt = OnCorrupt,
+  };
+  if (ParseTTBin(data, size, &visitor) < 0 || decoder.failed) {
+    return -1;
+  }
+  return 0;
+}
+
+void FreeActivity(Activity* a) {
+  if (a->arena != NULL) {
+    // Released with the arena.
+    memset(a, 0, sizeof(*a));
+    return;
+  }
+  free(a->time);
+  free(a->latitude);
+  free(a->longitude);
+  free(a->speed);
+  free(a->heading);
+  free(a->inc_distance);
+  free(a->cum_distance);
+  free(a->calories);
+  free(a->cycles);
+  free(a->heart_time);
+  free(a->heart_rate);
+  free(a->lap_time);
+  free(a->lap_number);
+  free(a->lap_activity);
+  memset(a, 0, sizeof(*a));
+}
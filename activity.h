@@ -0,0 +1,105 @@
+#ifndef ACTIVITY_H
+#define ACTIVITY_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "arena.h"
+#include "ttbin.h"
+
+// Alignment of every column, one cache line.
+#define COLUMN_ALIGNMENT 64
+
+// Structure of arrays view of an activity. Each field gets its own
+// contiguous, aligned array so that scans over one field (zones, pace,
+// resampling...) only touch that field.
+typedef struct {
+  Header header;
+  int has_header;
+  Summary summary;
+  int has_summary;
+  Arena* arena;  // Holds the columns, NULL = heap.
+  size_t corrupt_bytes;  // Skipped by the decoder, 0 for a sound file.
+
+  // GPS samples (0x22), samples without a GPS lock are left out.
+  size_t gps_count;
+  size_t gps_capacity;
+  uint32_t* time;       // seconds since 1970
+  int32_t* latitude;    // in 1e-7 degrees
+  int32_t* longitude;   // in 1e-7 degrees
+  uint16_t* speed;      // 100 * m/s
+  uint16_t* heading;    // degrees * 100
+  float* inc_distance;  // meters since the previous sample
+  float* cum_distance;  // meters
+  uint16_t* calories;
+  uint8_t* cycles;
+
+  // Heart rate samples (0x25), on their own timeline.
+  size_t heart_count;
+  size_t heart_capacity;
+  uint32_t* heart_time;
+  uint8_t* heart_rate;  // 0 = no reading
+
+  // Laps (0x21).
+  size_t lap_count;
+  size_t lap_capacity;
+  uint32_t* lap_time;
+  uint8_t* lap_number;
+  uint8_t* lap_activity;
+} Activity;
+
+// Decodes a .ttbin file held in memory into columns. Damaged parts of the
+// file are skipped (see TTBinVisitor.corrupt) and counted.
+// Returns 0 on success, -1 on allocation failure; the activity must be
+// released with FreeActivity() in both cases.
+int DecodeActivity(const uint8_t* data, size_t size, Activity* activity);
+
+// Same with the columns in the arena, sized once from the file size.
+// FreeActivity() then leaves them to ResetArena().
+int DecodeActivityInArena(const uint8_t* data, size_t size, Arena* arena,
+                          Activity* activity);
+
+void FreeActivity(Activity* activity);
+
+// Makes room for at least that many samples in the columns, so that they
+// can be filled directly. Returns -1 on allocation failure.
+int ReserveActivity(Activity* activity, size_t gps, size_t heart,
+                    size_t laps);
+
+// Same, but also reserves the whole space in the arena of the activity
+// first so the columns are allocated in one go.
+int ReserveActivityInArena(Activity* activity, size_t gps, size_t heart,
+                           size_t laps);
+
+// Scale factors of the fixed point columns.
+#define DEGREES_SCALE 1e-7  // latitude, longitude
+#define SPEED_SCALE 0.01    // speed, to m/s
+#define HEADING_SCALE 0.01  // heading, to degrees
+
+// Batch conversions of fixed point columns: out[i] = in[i] * scale for
+// n values. Use AVX2 or NEON when available. Note that a float only keeps
+// about 7 digits, ~20 cm for coordinates.
+void ConvertFixed32(const int32_t* in, double* out, size_t n, double scale);
+void ConvertFixed32f(const int32_t* in, float* out, size_t n, float scale);
+void ConvertFixed16(const uint16_t* in, double* out, size_t n, double scale);
+void ConvertFixed16f(const uint16_t* in, float* out, size_t n, float scale);
+
+#define SCAN_MAX_THRESHOLDS 8
+
+// Result of a column scan, added to by the scans.
+typedef struct {
+  uint64_t sum;
+  uint32_t max;
+  size_t zeros;
+  size_t at_least[SCAN_MAX_THRESHOLDS];  // values >= thresholds[i]
+} ColumnScan;
+
+// Single pass over n values giving the sum, max, number of zeros and the
+// number of values reaching each of the count thresholds (count at most
+// SCAN_MAX_THRESHOLDS). Same SIMD dispatch as the conversions above.
+void ScanColumn8(const uint8_t* in, size_t n, const uint8_t* thresholds,
+                 int count, ColumnScan* scan);
+void ScanColumn16(const uint16_t* in, size_t n, const uint16_t* thresholds,
+                  int count, ColumnScan* scan);
+
+#endif  // ACTIVITY_H
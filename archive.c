@@ -0,0 +1,256 @@
+#include "archive.h"
+
+#include <string.h>
+
+#include "instrument.h"
+
+static const char kMagic[4] = { 'T', 'T', 'A', '1' };
+
+typedef enum {
+  COLUMN_U8,
+  COLUMN_U16,
+  COLUMN_U32,  // Also the float columns, on their bits.
+  COLUMN_I32,
+} ColumnType;
+
+static int64_t LoadValue(const void* column, ColumnType type, size_t i) {
+  switch (type) {
+    case COLUMN_U8: return ((const uint8_t*)column)[i];
+    case COLUMN_U16: return ((const uint16_t*)column)[i];
+    case COLUMN_U32: return ((const uint32_t*)column)[i];
+    default: return ((const int32_t*)column)[i];
+  }
+}
+
+static void StoreValue(void* column, ColumnType type, size_t i,
+                       int64_t value) {
+  switch (type) {
+    case COLUMN_U8: ((uint8_t*)column)[i] = value; break;
+    case COLUMN_U16: ((uint16_t*)column)[i] = value; break;
+    case COLUMN_U32: ((uint32_t*)column)[i] = value; break;
+    default: ((int32_t*)column)[i] = value; break;
+  }
+}
+
+static uint64_t ZigZag(int64_t value) {
+  return ((uint64_t)value << 1) ^ (uint64_t)(value >> 63);
+}
+
+static int64_t UnZigZag(uint64_t value) {
+  return (int64_t)(value >> 1) ^ -(int64_t)(value & 1);
+}
+
+static size_t PutVarint(uint8_t* out, uint64_t value) {
+  size_t size = 0;
+  while (value >= 0x80) {
+    out[size++] = (value & 0x7f) | 0x80;
+    value >>= 7;
+  }
+  out[size++] = value;
+  return size;
+}
+
+// Encodes a column block by block. Deltas of 32 bit values need at most
+// 34 bits once zigzag mapped.
+static int WriteColumn(FILE* out, const void* column, ColumnType type,
+                       size_t count) {
+  uint8_t block[16 + ARCHIVE_BLOCK * 5];
+  uint64_t codes[ARCHIVE_BLOCK];
+  int64_t previous = 0;
+  for (size_t start = 0; start < count; start += ARCHIVE_BLOCK) {
+    size_t n = count - start < ARCHIVE_BLOCK ? count - start : ARCHIVE_BLOCK;
+    uint64_t min = UINT64_MAX;
+    uint64_t max = 0;
+    for (size_t i = 0; i < n; ++i) {
+      int64_t value = LoadValue(column, type, start + i);
+      codes[i] = ZigZag(value - previous);
+      previous = value;
+      if (codes[i] < min) min = codes[i];
+      if (codes[i] > max) max = codes[i];
+    }
+    int width = 0;
+    while (width < 64 && ((max - min) >> width) != 0) {
+      ++width;
+    }
+
+    size_t size = PutVarint(block, min);
+    block[size++] = width;
+    uint64_t bits = 0;
+    int bit_count = 0;
+    for (size_t i = 0; i < n; ++i) {
+      bits |= (codes[i] - min) << bit_count;
+      bit_count += width;
+      while (bit_count >= 8) {
+        block[size++] = bits;
+        bits >>= 8;
+        bit_count -= 8;
+      }
+    }
+    if (bit_count > 0) {
+      block[size++] = bits;
+    }
+    STATS_BEGIN(outer, PHASE_WRITE);
+    size_t written = fwrite(block, 1, size, out);
+    STATS_END(outer);
+    if (written != size) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+typedef struct {
+  const uint8_t* data;
+  size_t size;
+  size_t offset;
+} Reader;
+
+static int GetVarint(Reader* r, uint64_t* value) {
+  *value = 0;
+  for (int shift = 0; shift < 64; shift += 7) {
+    if (r->offset >= r->size) {
+      return -1;
+    }
+    uint8_t byte = r->data[r->offset++];
+    *value |= (uint64_t)(byte & 0x7f) << shift;
+    if ((byte & 0x80) == 0) {
+      return 0;
+    }
+  }
+  return -1;
+}
+
+static int ReadColumn(Reader* r, void* column, ColumnType type,
+                      size_t count) {
+  int64_t previous = 0;
+  for (size_t start = 0; start < count; start += ARCHIVE_BLOCK) {
+    size_t n = count - start < ARCHIVE_BLOCK ? count - start : ARCHIVE_BLOCK;
+    uint64_t min;
+    if (GetVarint(r, &min) < 0 || r->offset >= r->size) {
+      return -1;
+    }
+    int width = r->data[r->offset++];
+    size_t bytes = (n * width + 7) / 8;
+    if (width > 34 || r->size - r->offset < bytes) {
+      return -1;
+    }
+    // Fixed width for the whole block: no test in the unpacking loop but
+    // the refill.
+    const uint8_t* packed = r->data + r->offset;
+    uint64_t mask = ((uint64_t)1 << width) - 1;
+    uint64_t bits = 0;
+    int bit_count = 0;
+    for (size_t i = 0; i < n; ++i) {
+      while (bit_count < width) {
+        bits |= (uint64_t)*packed++ << bit_count;
+        bit_count += 8;
+      }
+      previous += UnZigZag((bits & mask) + min);
+      bits >>= width;
+      bit_count -= width;
+      StoreValue(column, type, start + i, previous);
+    }
+    r->offset += bytes;
+  }
+  return 0;
+}
+
+int IsArchive(const uint8_t* data, size_t size) {
+  return size >= sizeof(kMagic) && memcmp(data, kMagic, sizeof(kMagic)) == 0;
+}
+
+int WriteArchive(const Activity* a, FILE* out) {
+  Header header;
+  Summary summary;
+  memset(&header, 0, sizeof(header));
+  memset(&summary, 0, sizeof(summary));
+  if (a->has_header) header = a->header;
+  if (a->has_summary) summary = a->summary;
+  uint8_t flags = (a->has_header ? 1 : 0) | (a->has_summary ? 2 : 0);
+
+  uint8_t counts[30];
+  size_t size = PutVarint(counts, a->gps_count);
+  size += PutVarint(counts + size, a->heart_count);
+  size += PutVarint(counts + size, a->lap_count);
+  if (fwrite(kMagic, 1, sizeof(kMagic), out) != sizeof(kMagic) ||
+      fputc(flags, out) == EOF ||
+      fwrite(&header, 1, sizeof(header), out) != sizeof(header) ||
+      fwrite(&summary, 1, sizeof(summary), out) != sizeof(summary) ||
+      fwrite(counts, 1, size, out) != size) {
+    return -1;
+  }
+
+  size_t n = a->gps_count;
+  if (WriteColumn(out, a->time, COLUMN_U32, n) ||
+      WriteColumn(out, a->latitude, COLUMN_I32, n) ||
+      WriteColumn(out, a->longitude, COLUMN_I32, n) ||
+      WriteColumn(out, a->speed, COLUMN_U16, n) ||
+      WriteColumn(out, a->heading, COLUMN_U16, n) ||
+      WriteColumn(out, a->inc_distance, COLUMN_U32, n) ||
+      WriteColumn(out, a->cum_distance, COLUMN_U32, n) ||
+      WriteColumn(out, a->calories, COLUMN_U16, n) ||
+      WriteColumn(out, a->cycles, COLUMN_U8, n) ||
+      WriteColumn(out, a->heart_time, COLUMN_U32, a->heart_count) ||
+      WriteColumn(out, a->heart_rate, COLUMN_U8, a->heart_count) ||
+      WriteColumn(out, a->lap_time, COLUMN_U32, a->lap_count) ||
+      WriteColumn(out, a->lap_number, COLUMN_U8, a->lap_count) ||
+      WriteColumn(out, a->lap_activity, COLUMN_U8, a->lap_count)) {
+    return -1;
+  }
+  STATS_BEGIN(outer, PHASE_WRITE);
+  int result = fflush(out) == 0 ? 0 : -1;
+  STATS_END(outer);
+  return result;
+}
+
+int ReadArchive(const uint8_t* data, size_t size, Activity* a) {
+  return ReadArchiveInArena(data, size, NULL, a);
+}
+
+int ReadArchiveInArena(const uint8_t* data, size_t size, Arena* arena,
+                       Activity* a) {
+  memset(a, 0, sizeof(*a));
+  a->arena = arena;
+  size_t fixed = sizeof(kMagic) + 1 + sizeof(Header) + sizeof(Summary);
+  if (!IsArchive(data, size) || size < fixed) {
+    return -1;
+  }
+  uint8_t flags = data[sizeof(kMagic)];
+  memcpy(&a->header, data + sizeof(kMagic) + 1, sizeof(Header));
+  memcpy(&a->summary, data + sizeof(kMagic) + 1 + sizeof(Header),
+         sizeof(Summary));
+  a->has_header = (flags & 1) != 0;
+  a->has_summary = (flags & 2) != 0;
+
+  Reader r = { data, size, fixed };
+  uint64_t gps, heart, laps;
+  if (GetVarint(&r, &gps) || GetVarint(&r, &heart) || GetVarint(&r, &laps)) {
+    return -1;
+  }
+  // A block takes at least two bytes, a bound against corrupt counts.
+  size_t most = size / 2 * ARCHIVE_BLOCK;
+  if (gps > most || heart > most || laps > most ||
+      ReserveActivityInArena(a, gps, heart, laps)) {
+    return -1;
+  }
+  a->gps_count = gps;
+  a->heart_count = heart;
+  a->lap_count = laps;
+  if (ReadColumn(&r, a->time, COLUMN_U32, gps) ||
+      ReadColumn(&r, a->latitude, COLUMN_I32, gps) ||
+      ReadColumn(&r, a->longitude, COLUMN_I32, gps) ||
+      ReadColumn(&r, a->speed, COLUMN_U16, gps) ||
+      ReadColumn(&r, a->heading, COLUMN_U16, gps) ||
+      ReadColumn(&r, a->inc_distance, COLUMN_U32, gps) ||
+      ReadColumn(&r, a->cum_distance, COLUMN_U32, gps) ||
+      ReadColumn(&r, a->calories, COLUMN_U16, gps) ||
+      ReadColumn(&r, a->cycles, COLUMN_U8, gps) ||
+      ReadColumn(&r, a->heart_time, COLUMN_U32, heart) ||
+      ReadColumn(&r, a->heart_rate, COLUMN_U8, heart) ||
+      ReadColumn(&r, a->lap_time, COLUMN_U32, laps) ||
+      ReadColumn(&r, a->lap_number, COLUMN_U8, laps) ||
+      ReadColumn(&r, a->lap_activity, COLUMN_U8, laps)) {
+    return -1;
+  }
+  return 0;
+}
@@ -0,0 +1,45 @@
+#ifndef ARCHIVE_H
+#define ARCHIVE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "activity.h"
+
+// Compact column oriented archive of an activity, for long term storage
+// and bulk scans. Lossless.
+//
+// Layout, little endian:
+//   "TTA1"
+//   uint8_t flags            1 = has header, 2 = has summary
+//   Header, Summary          raw records (zeros when absent)
+//   varint gps_count, heart_count, lap_count
+//   the columns, in the order of Activity: time, latitude, longitude,
+//   speed, heading, inc_distance, cum_distance, calories, cycles,
+//   heart_time, heart_rate, lap_time, lap_number, lap_activity.
+//
+// Each column is cut in blocks of ARCHIVE_BLOCK values. The values are
+// delta encoded (floats on their bit patterns), zigzag mapped, and stored
+// with frame of reference bit packing:
+//   varint min, uint8_t width, then (value - min) on width bits each,
+//   least significant bits first, padded to a byte.
+// So a time column with one sample per second costs two bytes per block.
+#define ARCHIVE_BLOCK 128
+
+// Returns non zero if the data starts like an archive.
+int IsArchive(const uint8_t* data, size_t size);
+
+// Returns 0 on success, -1 on write error.
+int WriteArchive(const Activity* activity, FILE* out);
+
+// Decodes an archive held in memory. Returns 0 on success, -1 on corrupt
+// data or allocation failure; the activity must be released with
+// FreeActivity() in both cases.
+int ReadArchive(const uint8_t* data, size_t size, Activity* activity);
+
+// Same with the columns in the arena, see DecodeActivityInArena().
+int ReadArchiveInArena(const uint8_t* data, size_t size, Arena* arena,
+                       Activity* activity);
+
+#endif  // ARCHIVE_H
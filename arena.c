@@ -0,0 +1,117 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "arena.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+
+// Header of an overflow block, the data follows.
+typedef struct Overflow {
+  struct Overflow* next;
+  size_t size;
+  size_t used;
+  char padding[ARENA_ALIGNMENT - 2 * sizeof(size_t) - sizeof(void*)];
+} Overflow;
+
+static size_t Align(size_t size) {
+  return (size + ARENA_ALIGNMENT - 1) & ~(size_t)(ARENA_ALIGNMENT - 1);
+}
+
+void InitArena(Arena* arena) {
+  arena->base = NULL;
+  arena->size = 0;
+  arena->used = 0;
+  arena->overflow = NULL;
+  arena->overflow_size = 0;
+  arena->allocations = 0;
+}
+
+static void FreeOverflow(Arena* arena) {
+  Overflow* block = arena->overflow;
+  while (block != NULL) {
+    Overflow* next = block->next;
+    free(block);
+    block = next;
+  }
+  arena->overflow = NULL;
+}
+
+void FreeArena(Arena* arena) {
+  FreeOverflow(arena);
+  free(arena->base);
+  InitArena(arena);
+}
+
+static int AddOverflow(Arena* arena, size_t size) {
+  void* memory;
+  if (posix_memalign(&memory, ARENA_ALIGNMENT, sizeof(Overflow) + size)) {
+    return -1;
+  }
+  ++arena->allocations;
+  Overflow* block = memory;
+  block->next = arena->overflow;
+  block->size = size;
+  block->used = 0;
+  arena->overflow = block;
+  arena->overflow_size += size;
+  return 0;
+}
+
+int ReserveArena(Arena* arena, size_t size) {
+  size = Align(size);
+  if (arena->overflow == NULL && arena->size - arena->used >= size) {
+    return 0;
+  }
+  Overflow* block = arena->overflow;
+  if (block != NULL && block->size - block->used >= size) {
+    return 0;
+  }
+  if (arena->used == 0 && arena->overflow == NULL) {
+    // Nothing to keep, replace the arena.
+    void* memory;
+    if (posix_memalign(&memory, ARENA_ALIGNMENT, size)) {
+      return -1;
+    }
+    ++arena->allocations;
+    free(arena->base);
+    arena->base = memory;
+    arena->size = size;
+    return 0;
+  }
+  return AddOverflow(arena, size);
+}
+
+void* ArenaAlloc(Arena* arena, size_t size) {
+  size = Align(size);
+  if (arena->overflow == NULL && arena->size - arena->used >= size) {
+    void* memory = arena->base + arena->used;
+    arena->used += size;
+    return memory;
+  }
+  Overflow* block = arena->overflow;
+  if (block == NULL || block->size - block->used < size) {
+    // Double the total each time.
+    size_t grown = arena->size + arena->overflow_size;
+    if (AddOverflow(arena, grown > size ? grown : size)) {
+      return NULL;
+    }
+    block = arena->overflow;
+  }
+  void* memory = (char*)(block + 1) + block->used;
+  block->used += size;
+  return memory;
+}
+
+void ResetArena(Arena* arena) {
+  arena->used = 0;
+  if (arena->overflow != NULL) {
+    // Grow to the high water mark so the overflow isn't needed next time.
+    size_t size = arena->size + arena->overflow_size;
+    FreeOverflow(arena);
+    arena->overflow_size = 0;
+    free(arena->base);
+    arena->base = NULL;
+    arena->size = 0;
+    ReserveArena(arena, size);
+  }
+}
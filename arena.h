@@ -0,0 +1,38 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+
+// Alignment of the allocations, one cache line.
+#define ARENA_ALIGNMENT 64
+
+// Bump allocator for the data of one file at a time. Nothing is freed on
+// its own: ResetArena() drops everything at once and keeps the memory for
+// the next file. When a file needs more than the arena holds, the extra
+// comes from overflow blocks, which are folded into the arena on the next
+// reset, so once the largest file has been seen there are no more heap
+// allocations.
+typedef struct {
+  char* base;
+  size_t size;
+  size_t used;
+  void* overflow;        // List of the overflow blocks.
+  size_t overflow_size;  // Sum of their sizes.
+  size_t allocations;    // Heap allocations so far.
+} Arena;
+
+void InitArena(Arena* arena);
+void FreeArena(Arena* arena);
+
+// Makes sure the next allocations of up to size bytes in total (padding
+// included) won't touch the heap. Returns -1 on allocation failure.
+int ReserveArena(Arena* arena, size_t size);
+
+// Returns size bytes aligned on ARENA_ALIGNMENT, NULL on allocation
+// failure.
+void* ArenaAlloc(Arena* arena, size_t size);
+
+// Releases all the allocations.
+void ResetArena(Arena* arena);
+
+#endif  // ARENA_H
@@ -0,0 +1,387 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "batch.h"
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "instrument.h"
+
+typedef struct {
+  char* path;
+  off_t size;
+} Task;
+
+typedef struct {
+  Task* tasks;
+  size_t count;
+  size_t capacity;
+} TaskList;
+
+// Pending tasks of one worker: it pops from the head, thieves take from
+// the tail.
+typedef struct {
+  pthread_mutex_t lock;
+  size_t* items;
+  size_t head;
+  size_t tail;
+} WorkQueue;
+
+typedef struct {
+  const BatchOptions* options;
+  TaskList* list;
+  WorkQueue* queues;
+  int threads;
+  pthread_mutex_t output_lock;
+  int failures;
+  // Read ahead, up to prefetch files past the started ones.
+  pthread_mutex_t prefetch_lock;
+  pthread_cond_t prefetch_cond;
+  size_t prefetch;
+  size_t started;  // Tasks taken by the workers.
+  int stopped;     // The workers are done.
+} Batch;
+
+typedef struct {
+  Batch* batch;
+  int index;
+  Arena arena;
+} Worker;
+
+static int AddTask(TaskList* list, const char* path, off_t size) {
+  if (list->count == list->capacity) {
+    size_t capacity = list->capacity ? 2 * list->capacity : 256;
+    Task* grown = realloc(list->tasks, capacity * sizeof(Task));
+    if (grown == NULL) {
+      return -1;
+    }
+    list->tasks = grown;
+    list->capacity = capacity;
+  }
+  char* copy = strdup(path);
+  if (copy == NULL) {
+    return -1;
+  }
+  list->tasks[list->count].path = copy;
+  list->tasks[list->count].size = size;
+  ++list->count;
+  return 0;
+}
+
+static int HasExtension(const char* name, const char* extension) {
+  size_t length = strlen(name);
+  size_t extension_length = strlen(extension);
+  return length > extension_length &&
+         strcmp(name + length - extension_length, extension) == 0;
+}
+
+// Adds a file, or all the .ttbin files under a directory.
+static int AddPath(TaskList* list, const char* path, int explicit) {
+  struct stat st;
+  if (stat(path, &st) != 0) {
+    perror(path);
+    return -1;
+  }
+  if (!S_ISDIR(st.st_mode)) {
+    if (explicit || HasExtension(path, ".ttbin")) {
+      return AddTask(list, path, st.st_size);
+    }
+    return 0;
+  }
+  DIR* dir = opendir(path);
+  if (dir == NULL) {
+    perror(path);
+    return -1;
+  }
+  int result = 0;
+  struct dirent* entry;
+  while ((entry = readdir(dir)) != NULL) {
+    if (entry->d_name[0] == '.') {
+      continue;
+    }
+    size_t length = strlen(path) + strlen(entry->d_name) + 2;
+    char* child = malloc(length);
+    if (child == NULL) {
+      result = -1;
+      break;
+    }
+    snprintf(child, length, "%s/%s", path, entry->d_name);
+    if (AddPath(list, child, 0) < 0) {
+      result = -1;
+    }
+    free(child);
+  }
+  closedir(dir);
+  return result;
+}
+
+static int BiggestFirst(const void* a, const void* b) {
+  off_t size_a = ((const Task*)a)->size;
+  off_t size_b = ((const Task*)b)->size;
+  return size_a < size_b ? 1 : size_a > size_b ? -1 : 0;
+}
+
+static int PopOwn(WorkQueue* queue, size_t* item) {
+  int found = 0;
+  pthread_mutex_lock(&queue->lock);
+  if (queue->head < queue->tail) {
+    *item = queue->items[queue->head++];
+    found = 1;
+  }
+  pthread_mutex_unlock(&queue->lock);
+  return found;
+}
+
+static int Steal(WorkQueue* queue, size_t* item) {
+  int found = 0;
+  pthread_mutex_lock(&queue->lock);
+  if (queue->head < queue->tail) {
+    *item = queue->items[--queue->tail];
+    found = 1;
+  }
+  pthread_mutex_unlock(&queue->lock);
+  return found;
+}
+
+static int TakeTask(Batch* batch, int index, size_t* item) {
+  if (PopOwn(&batch->queues[index], item)) {
+    return 1;
+  }
+  for (int i = 1; i < batch->threads; ++i) {
+    if (Steal(&batch->queues[(index + i) % batch->threads], item)) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+static int NextTask(Batch* batch, int index, size_t* item) {
+  if (!TakeTask(batch, index, item)) {
+    return 0;
+  }
+  pthread_mutex_lock(&batch->prefetch_lock);
+  ++batch->started;
+  pthread_cond_signal(&batch->prefetch_cond);
+  pthread_mutex_unlock(&batch->prefetch_lock);
+  return 1;
+}
+
+// The workers take the files about in the order they were dealt, so that
+// order is read ahead. The reads are left to the kernel, as many in flight
+// as there are files in the window, and land in the page cache where the
+// workers map them.
+static void* PrefetchMain(void* argument) {
+  Batch* batch = argument;
+  for (size_t i = 0; i < batch->list->count; ++i) {
+    pthread_mutex_lock(&batch->prefetch_lock);
+    while (!batch->stopped && i >= batch->started + batch->prefetch) {
+      pthread_cond_wait(&batch->prefetch_cond, &batch->prefetch_lock);
+    }
+    int stopped = batch->stopped;
+    pthread_mutex_unlock(&batch->prefetch_lock);
+    if (stopped) {
+      break;
+    }
+    int fd = open(batch->list->tasks[i].path, O_RDONLY);
+    if (fd >= 0) {
+      posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+      close(fd);
+    }
+  }
+  return NULL;
+}
+
+static const char* BaseName(const char* path) {
+  const char* slash = strrchr(path, '/');
+  return slash ? slash + 1 : path;
+}
+
+static int RunTask(Batch* batch, const Task* task, Arena* arena) {
+  const BatchOptions* options = batch->options;
+  if (options->output_dir != NULL) {
+    const char* name = BaseName(task->path);
+    size_t length = strlen(options->output_dir) + strlen(name) +
+                    strlen(options->extension) + 2;
+    char* output = malloc(length);
+    if (output == NULL) {
+      return -1;
+    }
+    snprintf(output, length, "%s/%s%s", options->output_dir, name,
+             options->extension);
+    FILE* out = fopen(output, "w");
+    if (out == NULL) {
+      perror(output);
+      free(output);
+      return -1;
+    }
+    int result = options->job(task->path, out, options->context, arena);
+    if (fclose(out) != 0) {
+      result = -1;
+    }
+    free(output);
+    return result;
+  }
+
+  // Merged stream: the output of a file is built in memory and written
+  // in one go so that files don't interleave.
+  char* data = NULL;
+  size_t size = 0;
+  FILE* out = open_memstream(&data, &size);
+  if (out == NULL) {
+    return -1;
+  }
+  int result = options->job(task->path, out, options->context, arena);
+  fclose(out);
+  if (result == 0) {
+    pthread_mutex_lock(&batch->output_lock);
+    STATS_BEGIN(outer, PHASE_WRITE);
+    if (fwrite(data, 1, size, stdout) != size) {
+      result = -1;
+    }
+    STATS_END(outer);
+    pthread_mutex_unlock(&batch->output_lock);
+  }
+  free(data);
+  return result;
+}
+
+static void* WorkerMain(void* argument) {
+  Worker* worker = argument;
+  Batch* batch = worker->batch;
+  int failures = 0;
+  size_t item;
+  while (NextTask(batch, worker->index, &item)) {
+    const Task* task = &batch->list->tasks[item];
+    if (RunTask(batch, task, &worker->arena) < 0) {
+      fprintf(stderr, "Failed: %s\n", task->path);
+      ++failures;
+    }
+    ResetArena(&worker->arena);
+  }
+  FreeArena(&worker->arena);
+  if (batch->options->finish != NULL) {
+    batch->options->finish(batch->options->context);
+  }
+  STATS_MERGE();
+  pthread_mutex_lock(&batch->output_lock);
+  batch->failures += failures;
+  pthread_mutex_unlock(&batch->output_lock);
+  return NULL;
+}
+
+int RunBatch(char** paths, int count, const BatchOptions* options) {
+  TaskList list = { NULL, 0, 0 };
+  int failures = 0;
+  for (int i = 0; i < count; ++i) {
+    if (AddPath(&list, paths[i], 1) < 0) {
+      ++failures;
+    }
+  }
+  qsort(list.tasks, list.count, sizeof(Task), BiggestFirst);
+
+  int threads = options->threads;
+  if (threads <= 0) {
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    threads = cores > 0 ? cores : 1;
+  }
+  if ((size_t)threads > list.count) {
+    threads = list.count > 0 ? list.count : 1;
+  }
+
+  Batch batch;
+  batch.options = options;
+  batch.list = &list;
+  batch.threads = threads;
+  batch.failures = 0;
+  pthread_mutex_init(&batch.output_lock, NULL);
+  pthread_mutex_init(&batch.prefetch_lock, NULL);
+  pthread_cond_init(&batch.prefetch_cond, NULL);
+  batch.prefetch = options->prefetch == 0 ? BATCH_PREFETCH :
+                   options->prefetch < 0 ? 0 : options->prefetch;
+  batch.started = 0;
+  batch.stopped = 0;
+  batch.queues = calloc(threads, sizeof(WorkQueue));
+  size_t* items = malloc((list.count + 1) * sizeof(size_t));
+  Worker* workers = malloc(threads * sizeof(Worker));
+  pthread_t* ids = malloc(threads * sizeof(pthread_t));
+  if (batch.queues == NULL || items == NULL || workers == NULL ||
+      ids == NULL) {
+    free(batch.queues);
+    free(items);
+    free(workers);
+    free(ids);
+    failures += list.count;
+    goto cleanup;
+  }
+
+  // Deal the files round robin, biggest first, so every worker starts
+  // with a similar share; stealing balances what's left.
+  size_t per_queue = (list.count + threads - 1) / threads;
+  for (int i = 0; i < threads; ++i) {
+    WorkQueue* queue = &batch.queues[i];
+    pthread_mutex_init(&queue->lock, NULL);
+    queue->items = items + i * per_queue;
+    queue->head = 0;
+    queue->tail = 0;
+  }
+  for (size_t i = 0; i < list.count; ++i) {
+    WorkQueue* queue = &batch.queues[i % threads];
+    queue->items[queue->tail++] = i;
+  }
+
+  pthread_t prefetcher;
+  int prefetching = batch.prefetch > 0 &&
+      pthread_create(&prefetcher, NULL, PrefetchMain, &batch) == 0;
+
+  int started = 0;
+  for (; started < threads; ++started) {
+    workers[started].batch = &batch;
+    workers[started].index = started;
+    InitArena(&workers[started].arena);
+    if (pthread_create(&ids[started], NULL, WorkerMain,
+                       &workers[started]) != 0) {
+      break;
+    }
+  }
+  if (started == 0) {
+    // No thread at all, do the work here.
+    workers[0].batch = &batch;
+    workers[0].index = 0;
+    InitArena(&workers[0].arena);
+    WorkerMain(&workers[0]);
+  }
+  for (int i = 0; i < started; ++i) {
+    pthread_join(ids[i], NULL);
+  }
+  failures += batch.failures;
+  if (prefetching) {
+    pthread_mutex_lock(&batch.prefetch_lock);
+    batch.stopped = 1;
+    pthread_cond_signal(&batch.prefetch_cond);
+    pthread_mutex_unlock(&batch.prefetch_lock);
+    pthread_join(prefetcher, NULL);
+  }
+
+  for (int i = 0; i < threads; ++i) {
+    pthread_mutex_destroy(&batch.queues[i].lock);
+  }
+  free(batch.queues);
+  free(items);
+  free(workers);
+  free(ids);
+
+cleanup:
+  pthread_mutex_destroy(&batch.output_lock);
+  pthread_mutex_destroy(&batch.prefetch_lock);
+  pthread_cond_destroy(&batch.prefetch_cond);
+  for (size_t i = 0; i < list.count; ++i) {
+    free(list.tasks[i].path);
+  }
+  free(list.tasks);
+  return failures;
+}
@@ -0,0 +1,40 @@
+#ifndef BATCH_H
+#define BATCH_H
+
+#include <stdio.h>
+
+#include "arena.h"
+
+// Work done on one file, writes its output to out. The arena belongs to
+// the worker thread and is reset after each file.
+// Returns 0 on success, -1 on failure.
+typedef int (*BatchJob)(const char* filename, FILE* out, void* context,
+                        Arena* arena);
+
+#define BATCH_PREFETCH 16
+
+typedef struct {
+  BatchJob job;
+  void* context;
+  int threads;             // 0 = one per core.
+  // Files read ahead of the workers, 0 = BATCH_PREFETCH, negative = none.
+  int prefetch;
+  // Directory receiving one output file per input, named after it with
+  // the extension below. NULL = all the outputs merged on stdout, one
+  // whole file at a time.
+  const char* output_dir;
+  const char* extension;   // For example ".csv".
+  // Called with the context by each thread after its last file, to hand
+  // over what it gathered on the side. Can be NULL.
+  void (*finish)(void* context);
+} BatchOptions;
+
+// Runs the job on every path, directories are searched recursively for
+// .ttbin files. The files are spread over a pool of threads, biggest
+// first, and idle threads steal the pending files of the others. Another
+// thread asks the kernel to read the next files, in the order the workers
+// take them, so that the disk is busy while the workers decode.
+// Returns the number of files that failed.
+int RunBatch(char** paths, int count, const BatchOptions* options);
+
+#endif  // BATCH_H
@@ -0,0 +1,262 @@
+// Decode throughput benchmark on synthetic files.
+// Usage: bench [sizes in MB...], 1 16 256 1024 by default.
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "ttbin.h"
+
+typedef struct {
+  uint64_t records;
+  uint64_t checksum;  // So that the fields are really read.
+} Counter;
+
+static void CountHeader(void* c, const Header* r) {
+  ((Counter*)c)->records++;
+}
+static void CountRecordLengths(void* c, const RecordLengths* r) {
+  ((Counter*)c)->records++;
+}
+static void CountLap(void* c, const Lap* r) {
+  ((Counter*)c)->records++;
+  ((Counter*)c)->checksum += r->lap;
+}
+static void CountGPS(void* c, const GPSSample* r) {
+  ((Counter*)c)->records++;
+  ((Counter*)c)->checksum += r->latitude + r->speed;
+}
+static void CountGPSSpan(void* c, const GPSSample* r, size_t n) {
+  uint64_t checksum = 0;
+  for (size_t i = 0; i < n; ++i) {
+    checksum += r[i].latitude + r[i].speed;
+  }
+  ((Counter*)c)->records += n;
+  ((Counter*)c)->checksum += checksum;
+}
+static void CountR23(void* c, const R23* r) {
+  ((Counter*)c)->records++;
+}
+static void CountHeartRate(void* c, const HeartRateSample* r) {
+  ((Counter*)c)->records++;
+  ((Counter*)c)->checksum += r->heart_rate;
+}
+static void CountHeartRateSpan(void* c, const HeartRateSample* r, size_t n) {
+  uint64_t checksum = 0;
+  for (size_t i = 0; i < n; ++i) {
+    checksum += r[i].heart_rate;
+  }
+  ((Counter*)c)->records += n;
+  ((Counter*)c)->checksum += checksum;
+}
+static void CountSummary(void* c, const Summary* r) {
+  ((Counter*)c)->records++;
+}
+static void CountR35(void* c, const UnknownAndTime* r) {
+  ((Counter*)c)->records++;
+}
+static void CountRaw(void* c, uint8_t tag, const uint8_t* data, int size) {
+  ((Counter*)c)->records++;
+}
+
+static void Write(FILE* f, uint8_t tag, const void* record, size_t size) {
+  fputc(tag, f);
+  fwrite(record, 1, size, f);
+}
+
+// Writes about size bytes of activity: a record every second of GPS,
+// heart rate, 0x23 and 0x37, a 0x26 every minute, a 0x35 and a lap every
+// thousand seconds.
+static int Generate(const char* path, size_t size) {
+  FILE* f = fopen(path, "wb");
+  if (f == NULL) {
+    return -1;
+  }
+  uint32_t start = 1402479790;
+  Header header = { 0 };
+  header.file_format = 7;
+  header.version[1] = 1;
+  header.version[2] = 7;
+  header.version[3] = 25;
+  header.timestamp = start;
+  Write(f, 0x20, &header, sizeof(header));
+  Lap lap = { 0, 1, start };
+  Write(f, 0x21, &lap, sizeof(lap));
+
+  GPS gps = { 373700413, -1220653299, 15630, 514, start, 0, 0, 0, 0 };
+  HeartRate heart = { 142, 0, start };
+  R23 r23 = { 0x01bf, 0x01e7, 5 };
+  uint8_t r26[6] = { 0 };
+  UnknownAndTime r35 = { { 0, 0 }, start };
+  uint8_t r37 = 1;
+  size_t written = 1 + sizeof(header) + 1 + sizeof(lap);
+  uint32_t second = 0;
+  while (written < size) {
+    gps.latitude += (int32_t)(second % 17) - 8;
+    gps.longitude += (int32_t)(second % 13) - 6;
+    gps.speed = 400 + second % 200;
+    gps.time = start + second;
+    gps.inc_distance = gps.speed * 0.01f;
+    gps.cum_distance += gps.inc_distance;
+    gps.calories = second / 6;
+    heart.heart_rate = 120 + second % 60;
+    heart.time = start + second;
+    Write(f, 0x22, &gps, sizeof(gps));
+    Write(f, 0x23, &r23, sizeof(r23));
+    Write(f, 0x25, &heart, sizeof(heart));
+    Write(f, 0x37, &r37, sizeof(r37));
+    written += 4 + sizeof(gps) + sizeof(r23) + sizeof(heart) + sizeof(r37);
+    if (second % 60 == 59) {
+      Write(f, 0x26, r26, sizeof(r26));
+      written += 1 + sizeof(r26);
+    }
+    if (second % 1000 == 999) {
+      r35.time = start + second;
+      Write(f, 0x35, &r35, sizeof(r35));
+      lap.lap++;
+      lap.time = start + second;
+      Write(f, 0x21, &lap, sizeof(lap));
+      written += 2 + sizeof(r35) + sizeof(lap);
+    }
+    ++second;
+  }
+  Summary summary = { 1, (uint32_t)gps.cum_distance, second - 1,
+                      gps.calories };
+  Write(f, 0x27, &summary, sizeof(summary));
+  return fclose(f);
+}
+
+static double Now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static const TTBinVisitor kCounter = {
+  .header = CountHeader,
+  .record_lengths = CountRecordLengths,
+  .lap = CountLap,
+  .gps = CountGPS,
+  .r23 = CountR23,
+  .heart_rate = CountHeartRate,
+  .summary = CountSummary,
+  .r35 = CountR35,
+  .raw = CountRaw,
+};
+
+// The ways to decode. Return -1 on failure.
+static int DecodeStdio(const char* path, const TTBinVisitor* visitor) {
+  FILE* f = fopen(path, "rb");
+  if (f == NULL) {
+    return -1;
+  }
+  int result = ParseTTBinFile(f, visitor);
+  fclose(f);
+  return result;
+}
+
+static int DecodeLibrary(const char* path, const TTBinVisitor* visitor) {
+  FILE* f = fopen(path, "rb");
+  if (f == NULL) {
+    return -1;
+  }
+  fseek(f, 0, SEEK_END);
+  long size = ftell(f);
+  fseek(f, 0, SEEK_SET);
+  uint8_t* data = malloc(size);
+  int result = -1;
+  if (data != NULL && fread(data, 1, size, f) == (size_t)size) {
+    result = ParseTTBin(data, size, visitor);
+  }
+  free(data);
+  fclose(f);
+  return result;
+}
+
+static int DecodeMapped(const char* path, const TTBinVisitor* visitor) {
+  InputFile input;
+  if (OpenInputFile(path, &input) < 0) {
+    return -1;
+  }
+  int result = ParseTTBin(input.data, input.size, visitor);
+  CloseInputFile(&input);
+  return result;
+}
+
+// Mapped, with the GPS and heart rate records by spans.
+static int DecodeSpans(const char* path, const TTBinVisitor* visitor) {
+  TTBinVisitor spans = *visitor;
+  spans.gps = NULL;
+  spans.gps_span = CountGPSSpan;
+  spans.heart_rate = NULL;
+  spans.heart_rate_span = CountHeartRateSpan;
+  return DecodeMapped(path, &spans);
+}
+
+typedef struct {
+  const char* name;
+  int (*decode)(const char* path, const TTBinVisitor* visitor);
+} DecodePath;
+
+static const DecodePath kPaths[] = {
+  { "stdio", DecodeStdio },
+  { "library", DecodeLibrary },
+  { "mmap", DecodeMapped },
+  { "spans", DecodeSpans },
+};
+
+#define REPEATS 3
+
+int main(int argc, char** argv) {
+  static const char* kDefaultSizes[] = { "1", "16", "256", "1024" };
+  const char** sizes = kDefaultSizes;
+  int count = sizeof(kDefaultSizes) / sizeof(kDefaultSizes[0]);
+  if (argc > 1) {
+    sizes = (const char**)argv + 1;
+    count = argc - 1;
+  }
+  const char* dir = getenv("TMPDIR") ? getenv("TMPDIR") : "/tmp";
+  char path[4096];
+  snprintf(path, sizeof(path), "%s/bench-%ld.ttbin", dir, (long)getpid());
+
+  printf("%8s %-8s %12s %14s %10s\n", "size", "path", "records",
+         "records/s", "MB/s");
+  for (int i = 0; i < count; ++i) {
+    size_t megabytes = strtoul(sizes[i], NULL, 10);
+    if (megabytes == 0 || Generate(path, megabytes << 20) != 0) {
+      fprintf(stderr, "Failed to generate %s MB in %s\n", sizes[i], path);
+      unlink(path);
+      return -1;
+    }
+    for (size_t p = 0; p < sizeof(kPaths) / sizeof(kPaths[0]); ++p) {
+      // Best of a few runs, the first one also warms the page cache.
+      double best = 0;
+      Counter counter;
+      for (int run = 0; run < REPEATS; ++run) {
+        memset(&counter, 0, sizeof(counter));
+        TTBinVisitor visitor = kCounter;
+        visitor.context = &counter;
+        double start = Now();
+        if (kPaths[p].decode(path, &visitor) < 0) {
+          fprintf(stderr, "Failed to decode with %s\n", kPaths[p].name);
+          unlink(path);
+          return -1;
+        }
+        double elapsed = Now() - start;
+        if (run == 0 || elapsed < best) {
+          best = elapsed;
+        }
+      }
+      printf("%6zuMB %-8s %12llu %14.0f %10.1f\n", megabytes, kPaths[p].name,
+             (unsigned long long)counter.records, counter.records / best,
+             megabytes / best);
+    }
+    unlink(path);
+  }
+  return 0;
+}
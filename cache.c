@@ -0,0 +1,237 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "cache.h"
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "archive.h"
+#include "fields.h"
+#include "ttbin.h"
+
+static const uint64_t kPrime1 = 0x9E3779B185EBCA87ull;
+static const uint64_t kPrime2 = 0xC2B2AE3D27D4EB4Full;
+static const uint64_t kPrime3 = 0x165667B19E3779F9ull;
+static const uint64_t kPrime4 = 0x85EBCA77C2B2AE63ull;
+static const uint64_t kPrime5 = 0x27D4EB2F165667C5ull;
+
+static uint64_t Rotate(uint64_t x, int bits) {
+  return (x << bits) | (x >> (64 - bits));
+}
+
+static uint64_t Round(uint64_t acc, uint64_t input) {
+  return Rotate(acc + input * kPrime2, 31) * kPrime1;
+}
+
+static uint64_t MergeRound(uint64_t acc, uint64_t value) {
+  return (acc ^ Round(0, value)) * kPrime1 + kPrime4;
+}
+
+uint64_t XXH64(const void* data, size_t size, uint64_t seed) {
+  const uint8_t* p = data;
+  const uint8_t* end = p + size;
+  uint64_t h;
+  if (size >= 32) {
+    uint64_t v1 = seed + kPrime1 + kPrime2;
+    uint64_t v2 = seed + kPrime2;
+    uint64_t v3 = seed;
+    uint64_t v4 = seed - kPrime1;
+    for (; end - p >= 32; p += 32) {
+      v1 = Round(v1, Load64(p));
+      v2 = Round(v2, Load64(p + 8));
+      v3 = Round(v3, Load64(p + 16));
+      v4 = Round(v4, Load64(p + 24));
+    }
+    h = Rotate(v1, 1) + Rotate(v2, 7) + Rotate(v3, 12) + Rotate(v4, 18);
+    h = MergeRound(h, v1);
+    h = MergeRound(h, v2);
+    h = MergeRound(h, v3);
+    h = MergeRound(h, v4);
+  } else {
+    h = seed + kPrime5;
+  }
+  h += size;
+  for (; end - p >= 8; p += 8) {
+    h = Rotate(h ^ Round(0, Load64(p)), 27) * kPrime1 + kPrime4;
+  }
+  if (end - p >= 4) {
+    h = Rotate(h ^ Load32(p) * kPrime1, 23) * kPrime2 + kPrime3;
+    p += 4;
+  }
+  for (; p < end; ++p) {
+    h = Rotate(h ^ *p * kPrime5, 11) * kPrime1;
+  }
+  h ^= h >> 33;
+  h *= kPrime2;
+  h ^= h >> 29;
+  h *= kPrime3;
+  h ^= h >> 32;
+  return h;
+}
+
+// Entries are named <16 hex digits>.tta, the files being written are
+// hidden until renamed.
+#define ENTRY_NAME_SIZE 20
+
+static int EntryPath(const DecodeCache* cache, uint64_t key, char* path,
+                     size_t size) {
+  int length = snprintf(path, size, "%s/%016llx.tta", cache->dir,
+                        (unsigned long long)key);
+  return length > 0 && (size_t)length < size ? 0 : -1;
+}
+
+int LoadCachedActivity(const DecodeCache* cache, uint64_t key, Arena* arena,
+                       Activity* activity) {
+  memset(activity, 0, sizeof(*activity));
+  char path[4096];
+  InputFile input;
+  if (EntryPath(cache, key, path, sizeof(path)) < 0 ||
+      OpenInputFile(path, &input) < 0) {
+    return -1;
+  }
+  int result = ReadArchiveInArena(input.data, input.size, arena, activity);
+  CloseInputFile(&input);
+  if (result == 0) {
+    // Most recently used.
+    utimensat(AT_FDCWD, path, NULL, 0);
+  }
+  return result;
+}
+
+typedef struct {
+  char name[ENTRY_NAME_SIZE + 1];
+  off_t size;
+  struct timespec mtime;
+} Entry;
+
+static int IsEntry(const char* name) {
+  if (strlen(name) != ENTRY_NAME_SIZE || strcmp(name + 16, ".tta") != 0) {
+    return 0;
+  }
+  return strspn(name, "0123456789abcdef") == 16;
+}
+
+static int OldestFirst(const void* a, const void* b) {
+  const Entry* x = a;
+  const Entry* y = b;
+  if (x->mtime.tv_sec != y->mtime.tv_sec) {
+    return x->mtime.tv_sec < y->mtime.tv_sec ? -1 : 1;
+  }
+  return x->mtime.tv_nsec < y->mtime.tv_nsec ? -1 :
+         x->mtime.tv_nsec > y->mtime.tv_nsec;
+}
+
+// What the directory is left at by an eviction, below max_size so that
+// the next scan only comes after an eighth of it was stored again.
+#define CACHE_LOW_SIZE(max_size) ((max_size) - (max_size) / 8)
+
+// Size of the directory estimated by the process between the scans, so
+// that a store costs no scan. Shared by the caches of the process, there
+// is one in practice. Entries stored by other processes sharing the
+// directory are only seen at the next scan.
+static struct {
+  uint64_t size;  // Bytes, at the last scan plus the entries stored since.
+  int scanned;    // Since the process started.
+  int scanning;   // By a thread, the others don't wait for it.
+} usage;
+
+// Removes the least recently used entries, down to CACHE_LOW_SIZE, when
+// the directory is over max_size. Returns the bytes left.
+static uint64_t Evict(const DecodeCache* cache) {
+  DIR* dir = opendir(cache->dir);
+  if (dir == NULL) {
+    return 0;
+  }
+  Entry* entries = NULL;
+  size_t count = 0;
+  size_t capacity = 0;
+  uint64_t total = 0;
+  struct dirent* e;
+  while ((e = readdir(dir)) != NULL) {
+    struct stat st;
+    if (!IsEntry(e->d_name) ||
+        fstatat(dirfd(dir), e->d_name, &st, 0) != 0) {
+      continue;
+    }
+    if (count == capacity) {
+      size_t grown = capacity ? 2 * capacity : 256;
+      Entry* more = realloc(entries, grown * sizeof(Entry));
+      if (more == NULL) {
+        break;
+      }
+      entries = more;
+      capacity = grown;
+    }
+    Entry* entry = &entries[count++];
+    strcpy(entry->name, e->d_name);
+    entry->size = st.st_size;
+    entry->mtime = st.st_mtim;
+    total += st.st_size;
+  }
+  if (total > cache->max_size) {
+    qsort(entries, count, sizeof(Entry), OldestFirst);
+    uint64_t low = CACHE_LOW_SIZE(cache->max_size);
+    for (size_t i = 0; i < count && total > low; ++i) {
+      // Another process may have removed it already.
+      unlinkat(dirfd(dir), entries[i].name, 0);
+      total -= entries[i].size;
+    }
+  }
+  free(entries);
+  closedir(dir);
+  return total;
+}
+
+// Adds size to the estimate and scans the directory once it goes over
+// max_size, or on the first store of the process.
+static void Account(const DecodeCache* cache, uint64_t size) {
+  uint64_t estimate = __atomic_add_fetch(&usage.size, size, __ATOMIC_RELAXED);
+  if ((estimate <= cache->max_size &&
+       __atomic_load_n(&usage.scanned, __ATOMIC_ACQUIRE)) ||
+      __atomic_exchange_n(&usage.scanning, 1, __ATOMIC_ACQUIRE)) {
+    return;
+  }
+  __atomic_store_n(&usage.size, Evict(cache), __ATOMIC_RELAXED);
+  __atomic_store_n(&usage.scanned, 1, __ATOMIC_RELEASE);
+  __atomic_store_n(&usage.scanning, 0, __ATOMIC_RELEASE);
+}
+
+int StoreCachedActivity(const DecodeCache* cache, uint64_t key,
+                        const Activity* activity) {
+  char path[4096];
+  char temp[4096];
+  if (EntryPath(cache, key, path, sizeof(path)) < 0 ||
+      snprintf(temp, sizeof(temp), "%s/.%016llx.XXXXXX", cache->dir,
+               (unsigned long long)key) >= (int)sizeof(temp)) {
+    return -1;
+  }
+  // Written aside and renamed, readers never see half an entry.
+  int fd = mkstemp(temp);
+  if (fd < 0) {
+    return -1;
+  }
+  FILE* out = fdopen(fd, "w");
+  if (out == NULL) {
+    close(fd);
+    unlink(temp);
+    return -1;
+  }
+  int result = WriteArchive(activity, out);
+  long size = ftell(out);
+  if (fclose(out) != 0) {
+    result = -1;
+  }
+  if (result < 0 || rename(temp, path) != 0) {
+    unlink(temp);
+    return -1;
+  }
+  if (cache->max_size > 0) {
+    Account(cache, size > 0 ? size : 0);
+  }
+  return 0;
+}
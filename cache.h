@@ -0,0 +1,40 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "activity.h"
+#include "arena.h"
+
+// Directory of decoded activities, stored as archives (see archive.h)
+// named after the XXH64 of the file bytes, so the same file synced twice
+// or exported in several formats is only parsed once. When the directory
+// grows past max_size the least recently used entries go, down to 7/8 of
+// it: hits touch the modification time of their entry. The directory is
+// only scanned for that on the first store of a process and then once its
+// stores took it past max_size again.
+typedef struct {
+  const char* dir;
+  uint64_t max_size;  // Bytes, 0 = unbounded.
+} DecodeCache;
+
+// Default max_size.
+#define CACHE_DEFAULT_SIZE (256 << 20)
+
+// XXH64 of the data, as the reference implementation.
+uint64_t XXH64(const void* data, size_t size, uint64_t seed);
+
+// Reads the entry of key into activity (in the arena if not NULL).
+// Returns -1 when there is no usable entry, the activity must be released
+// with FreeActivity() in both cases.
+int LoadCachedActivity(const DecodeCache* cache, uint64_t key, Arena* arena,
+                       Activity* activity);
+
+// Stores the activity under key, then evicts the oldest entries when the
+// directory is past max_size. Safe between threads and processes sharing
+// the directory. Returns -1 on failure, the cache is only an optimization.
+int StoreCachedActivity(const DecodeCache* cache, uint64_t key,
+                        const Activity* activity);
+
+#endif  // CACHE_H
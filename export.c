@@ -0,0 +1,894 @@
+#include "export.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "instrument.h"
+#include "timefmt.h"
+
+// The output is formatted by hand into one large buffer, flushed when
+// nearly full, rather than through printf for every field.
+#define OUT_BUFFER_SIZE (1 << 20)
+// Room needed by the longest row.
+#define OUT_ROW_SIZE 256
+
+typedef struct {
+  FILE* out;  // NULL only counts the bytes.
+  char* data;
+  size_t size;
+  uint64_t written;  // Flushed so far.
+  int fit_crc;       // Computes crc over the flushed bytes.
+  uint16_t crc;
+  int failed;
+} OutBuffer;
+
+static int InitOutBuffer(OutBuffer* b, FILE* out) {
+  b->out = out;
+  b->data = malloc(OUT_BUFFER_SIZE);
+  b->size = 0;
+  b->written = 0;
+  b->fit_crc = 0;
+  b->crc = 0;
+  b->failed = b->data == NULL;
+  return b->failed ? -1 : 0;
+}
+
+// CRC-16 of the FIT format, a nibble at a time.
+static uint16_t FITCRC(uint16_t crc, const uint8_t* data, size_t size) {
+  static const uint16_t kTable[16] = {
+    0x0000, 0xCC01, 0xD801, 0x1400, 0xF001, 0x3C00, 0x2800, 0xE401,
+    0xA001, 0x6C00, 0x7800, 0xB401, 0x5000, 0x9C01, 0x8801, 0x4400
+  };
+  for (size_t i = 0; i < size; ++i) {
+    crc = (crc >> 4) ^ kTable[crc & 0xF] ^ kTable[data[i] & 0xF];
+    crc = (crc >> 4) ^ kTable[crc & 0xF] ^ kTable[data[i] >> 4];
+  }
+  return crc;
+}
+
+static void Flush(OutBuffer* b) {
+  if (b->fit_crc) {
+    b->crc = FITCRC(b->crc, (const uint8_t*)b->data, b->size);
+  }
+  if (b->out != NULL && b->size > 0) {
+    STATS_BEGIN(outer, PHASE_WRITE);
+    if (fwrite(b->data, 1, b->size, b->out) != b->size) {
+      b->failed = 1;
+    }
+    STATS_END(outer);
+  }
+  b->written += b->size;
+  b->size = 0;
+}
+
+// Makes sure a whole row fits.
+static void Reserve(OutBuffer* b) {
+  if (OUT_BUFFER_SIZE - b->size < OUT_ROW_SIZE) {
+    Flush(b);
+  }
+}
+
+static int CloseOutBuffer(OutBuffer* b) {
+  Flush(b);
+  free(b->data);
+  b->data = NULL;
+  if (b->out != NULL) {
+    STATS_BEGIN(outer, PHASE_WRITE);
+    if (fflush(b->out) != 0) {
+      b->failed = 1;
+    }
+    STATS_END(outer);
+  }
+  return b->failed ? -1 : 0;
+}
+
+static void AppendChar(OutBuffer* b, char c) {
+  b->data[b->size++] = c;
+}
+
+static void AppendString(OutBuffer* b, const char* s) {
+  size_t length = strlen(s);
+  memcpy(b->data + b->size, s, length);
+  b->size += length;
+}
+
+static void AppendUInt(OutBuffer* b, uint64_t value) {
+  char digits[20];
+  int count = 0;
+  do {
+    digits[count++] = '0' + value % 10;
+    value /= 10;
+  } while (value > 0);
+  while (count > 0) {
+    b->data[b->size++] = digits[--count];
+  }
+}
+
+// Appends value / 10^decimals with exactly decimals digits after the point.
+static void AppendFixed(OutBuffer* b, int64_t value, int decimals) {
+  static const uint32_t kPowers[] = {
+    1, 10, 100, 1000, 10000, 100000, 1000000, 10000000
+  };
+  uint64_t magnitude = value;
+  if (value < 0) {
+    AppendChar(b, '-');
+    magnitude = -(uint64_t)value;
+  }
+  AppendUInt(b, magnitude / kPowers[decimals]);
+  if (decimals == 0) {
+    return;
+  }
+  AppendChar(b, '.');
+  uint32_t fraction = magnitude % kPowers[decimals];
+  for (int i = decimals - 1; i >= 0; --i) {
+    b->data[b->size + i] = '0' + fraction % 10;
+    fraction /= 10;
+  }
+  b->size += decimals;
+}
+
+// Rounds a float to the nearest multiple of 10^-decimals, as an integer.
+static int64_t RoundFixed(float value, int scale) {
+  double scaled = (double)value * scale;
+  return (int64_t)(scaled < 0 ? scaled - 0.5 : scaled + 0.5);
+}
+
+// Coordinates in 1e-7 degrees rounded to 1e-6.
+static int64_t RoundCoordinate(int32_t value) {
+  return value < 0 ? (value - 5) / 10 : (value + 5) / 10;
+}
+
+static void AppendCSVHeader(OutBuffer* b) {
+  AppendString(b, "time,activityType,lapNumber,distance,speed,calories,"
+                  "lat,long,elevation,heartRate,cycles\r\n");
+}
+
+static void AppendCSVRow(OutBuffer* b, const CSVRow* row) {
+  Reserve(b);
+  AppendUInt(b, row->time);
+  AppendChar(b, ',');
+  AppendUInt(b, row->activity_type);
+  AppendChar(b, ',');
+  AppendUInt(b, row->lap_number);
+  AppendChar(b, ',');
+  AppendFixed(b, RoundFixed(row->inc_distance, 100), 2);
+  AppendChar(b, ',');
+  AppendFixed(b, row->speed, 2);
+  AppendChar(b, ',');
+  AppendUInt(b, row->calories);
+  AppendChar(b, ',');
+  AppendFixed(b, RoundCoordinate(row->latitude), 6);
+  AppendChar(b, ',');
+  AppendFixed(b, RoundCoordinate(row->longitude), 6);
+  AppendString(b, ",,");
+  if (row->heart_rate != 0) {
+    AppendUInt(b, row->heart_rate);
+  }
+  AppendChar(b, ',');
+  AppendUInt(b, row->cycles);
+  AppendString(b, "\r\n");
+}
+
+int WriteCSV(const Activity* a, const JoinOptions* join, FILE* out) {
+  OutBuffer b;
+  if (InitOutBuffer(&b, out) < 0) {
+    return -1;
+  }
+  AppendCSVHeader(&b);
+
+  uint8_t* heart_rate = malloc(a->gps_count + 1);
+  if (heart_rate == NULL) {
+    CloseOutBuffer(&b);
+    return -1;
+  }
+  JoinHeartRate(a, join, heart_rate);
+
+  // The GPS times are UTC, the lap ones are local.
+  int32_t offset = a->has_header ? a->header.local_time_offset : 0;
+  uint32_t activity_type = a->has_summary ? a->summary.activity_type : 0;
+  size_t lap = 0;
+  int lap_number = 1;
+  for (size_t i = 0; i < a->gps_count; ++i) {
+    uint32_t local = a->time[i] + offset;
+    // Both timelines are monotonic, so the join is a linear merge. A
+    // sample taken during the second of a lap mark is still in the
+    // previous lap.
+    while (lap < a->lap_count && a->lap_time[lap] < local) {
+      lap_number = a->lap_number[lap] > 0 ? a->lap_number[lap] : 1;
+      activity_type = a->lap_activity[lap];
+      ++lap;
+    }
+
+    CSVRow row = {
+      a->time[i] - a->time[0], activity_type, lap_number,
+      a->inc_distance[i], a->speed[i], a->calories[i], a->latitude[i],
+      a->longitude[i], heart_rate[i], a->cycles[i]
+    };
+    AppendCSVRow(&b, &row);
+  }
+  free(heart_rate);
+  return CloseOutBuffer(&b);
+}
+
+struct CSVWriter {
+  OutBuffer b;
+};
+
+CSVWriter* OpenCSVWriter(FILE* out) {
+  CSVWriter* w = malloc(sizeof(CSVWriter));
+  if (w == NULL) {
+    return NULL;
+  }
+  if (InitOutBuffer(&w->b, out) < 0) {
+    free(w);
+    return NULL;
+  }
+  AppendCSVHeader(&w->b);
+  return w;
+}
+
+void WriteCSVRows(CSVWriter* w, const CSVRow* rows, size_t count) {
+  for (size_t i = 0; i < count; ++i) {
+    AppendCSVRow(&w->b, &rows[i]);
+  }
+}
+
+int CloseCSVWriter(CSVWriter* w) {
+  int result = CloseOutBuffer(&w->b);
+  free(w);
+  return result;
+}
+
+// Totals of a lap or of the whole activity, in GPS time (UTC).
+typedef struct {
+  uint32_t start_time;
+  uint32_t end_time;
+  float start_distance;  // Cumulative distance before the first sample.
+  float distance;        // At the last sample.
+  uint32_t start_calories;
+  uint32_t calories;
+  uint16_t max_speed;
+  uint32_t heart_sum;
+  uint32_t heart_count;
+  uint8_t max_heart_rate;
+} Totals;
+
+// State shared by the streaming writers, first member of each of them so
+// that the Track* callbacks below can be used as is. A lap starts with the
+// first GPS sample after a lap record, laps without samples are dropped.
+typedef struct {
+  int32_t offset;  // Local time offset, the heart and lap times are local.
+  uint32_t activity_type;
+  int heart_rate;  // Last reading, -1 if none yet.
+  int lap_mark;    // A lap record came after the last GPS sample.
+  size_t laps;     // Laps started so far.
+  Totals lap;
+  Totals total;
+  TimeFormatter formatter;
+  char time[TIME_BUFFER_SIZE];
+} Track;
+
+static void InitTrack(Track* t) {
+  memset(t, 0, sizeof(*t));
+  t->heart_rate = -1;
+  InitTimeFormatter(&t->formatter, 0);
+}
+
+static void StartTotals(Totals* totals, const GPSSample* gps,
+                        const Totals* last) {
+  memset(totals, 0, sizeof(*totals));
+  totals->start_time = gps->time;
+  totals->start_distance = last->distance;
+  totals->start_calories = last->calories;
+}
+
+// Whether the sample starts a lap, the previous one (if laps > 0) being
+// then complete.
+static int StartsLap(const Track* t) {
+  return t->lap_mark || t->laps == 0;
+}
+
+static void StartLap(Track* t, const GPSSample* gps) {
+  if (t->laps == 0) {
+    StartTotals(&t->total, gps, &t->total);
+  }
+  StartTotals(&t->lap, gps, &t->total);
+  t->lap_mark = 0;
+  ++t->laps;
+}
+
+static void AddSample(Totals* totals, const GPSSample* gps) {
+  totals->end_time = gps->time;
+  totals->distance = gps->cum_distance;
+  totals->calories = gps->calories;
+  if (gps->speed > totals->max_speed) {
+    totals->max_speed = gps->speed;
+  }
+}
+
+static void AddHeartRate(Totals* totals, uint8_t heart_rate) {
+  totals->heart_sum += heart_rate;
+  ++totals->heart_count;
+  if (heart_rate > totals->max_heart_rate) {
+    totals->max_heart_rate = heart_rate;
+  }
+}
+
+static void TrackHeader(void* context, const Header* header) {
+  Track* t = context;
+  t->offset = header->local_time_offset;
+}
+
+static void TrackLap(void* context, const Lap* lap) {
+  Track* t = context;
+  t->lap_mark = 1;
+  t->activity_type = lap->activity;
+}
+
+static void TrackHeartRate(void* context, const HeartRateSample* heart) {
+  Track* t = context;
+  if (heart->heart_rate == 0) {
+    return;
+  }
+  t->heart_rate = heart->heart_rate;
+  if (t->laps > 0) {
+    AddHeartRate(&t->lap, heart->heart_rate);
+    AddHeartRate(&t->total, heart->heart_rate);
+  }
+}
+
+static void TrackSummary(void* context, const Summary* summary) {
+  Track* t = context;
+  t->activity_type = summary->activity_type;
+}
+
+// Damaged parts are skipped, as DecodeActivity() does.
+static void TrackCorrupt(void* context, size_t offset, size_t size) {
+}
+
+static const TTBinVisitor kTrack = {
+  .header = TrackHeader,
+  .lap = TrackLap,
+  .heart_rate = TrackHeartRate,
+  .summary = TrackSummary,
+  .corrupt = TrackCorrupt,
+};
+
+// Appends a GPS time as "YYYY-MM-DDTHH:MM:SSZ".
+static void AppendTime(OutBuffer* b, Track* t, uint32_t time) {
+  const char* text = FormatTime(&t->formatter, time, t->time);
+  memcpy(b->data + b->size, text, 10);
+  b->data[b->size + 10] = 'T';
+  memcpy(b->data + b->size + 11, text + 11, 8);
+  b->data[b->size + 19] = 'Z';
+  b->size += 20;
+}
+
+static void AppendDistance(OutBuffer* b, float meters) {
+  AppendFixed(b, RoundFixed(meters, 100), 2);
+}
+
+static int ParseTrack(const uint8_t* data, size_t size, Track* track,
+                      void (*gps)(void* context, const GPSSample* gps)) {
+  if (size == 0 || data[0] != 0x20) {
+    // No header.
+    return -1;
+  }
+  TTBinVisitor visitor = kTrack;
+  visitor.context = track;
+  visitor.gps = gps;
+  return ParseTTBin(data, size, &visitor);
+}
+
+typedef struct {
+  Track track;
+  OutBuffer b;
+} GPXWriter;
+
+static void GPXPoint(void* context, const GPSSample* gps) {
+  GPXWriter* w = context;
+  OutBuffer* b = &w->b;
+  if (gps->time == 0xffffffff) {
+    return;
+  }
+  Reserve(b);
+  AppendString(b, "   <trkpt lat=\"");
+  AppendFixed(b, gps->latitude, 7);
+  AppendString(b, "\" lon=\"");
+  AppendFixed(b, gps->longitude, 7);
+  AppendString(b, "\"><time>");
+  AppendTime(b, &w->track, gps->time);
+  AppendString(b, "</time>");
+  if (w->track.heart_rate >= 0) {
+    AppendString(b, "<extensions><gpxtpx:TrackPointExtension><gpxtpx:hr>");
+    AppendUInt(b, w->track.heart_rate);
+    AppendString(b, "</gpxtpx:hr></gpxtpx:TrackPointExtension>"
+                    "</extensions>");
+  }
+  AppendString(b, "</trkpt>\n");
+}
+
+int WriteGPX(const uint8_t* data, size_t size, FILE* out) {
+  GPXWriter w;
+  InitTrack(&w.track);
+  if (InitOutBuffer(&w.b, out) < 0) {
+    return -1;
+  }
+  AppendString(&w.b,
+      "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+      "<gpx version=\"1.1\" creator=\"ttbin\" "
+      "xmlns=\"http://www.topografix.com/GPX/1/1\" "
+      "xmlns:gpxtpx="
+      "\"http://www.garmin.com/xmlschemas/TrackPointExtension/v1\">\n"
+      " <trk>\n  <trkseg>\n");
+  int result = ParseTrack(data, size, &w.track, GPXPoint);
+  Reserve(&w.b);
+  AppendString(&w.b, "  </trkseg>\n </trk>\n</gpx>\n");
+  if (CloseOutBuffer(&w.b) < 0) {
+    result = -1;
+  }
+  return result;
+}
+
+// The lap totals come first in TCX, so a first pass gathers them.
+typedef struct {
+  Track track;
+  OutBuffer b;
+  Totals* laps;  // One per lap, filled by the first pass.
+  size_t lap_capacity;
+  int failed;
+} TCXWriter;
+
+static void TCXCountPoint(void* context, const GPSSample* gps) {
+  TCXWriter* w = context;
+  Track* t = &w->track;
+  if (gps->time == 0xffffffff) {
+    return;
+  }
+  if (StartsLap(t)) {
+    if (t->laps > 0) {
+      w->laps[t->laps - 1] = t->lap;
+    }
+    if (t->laps == w->lap_capacity) {
+      size_t capacity = w->lap_capacity ? 2 * w->lap_capacity : 16;
+      Totals* grown = realloc(w->laps, capacity * sizeof(Totals));
+      if (grown == NULL) {
+        w->failed = 1;
+        return;
+      }
+      w->laps = grown;
+      w->lap_capacity = capacity;
+    }
+    StartLap(t, gps);
+  }
+  AddSample(&t->lap, gps);
+  AddSample(&t->total, gps);
+}
+
+static const char* TCXSport(uint32_t activity_type) {
+  switch (activity_type) {
+    case 0:
+    case 7:
+      return "Running";
+    case 1:
+      return "Biking";
+    default:
+      return "Other";
+  }
+}
+
+static void TCXEndLap(TCXWriter* w) {
+  Reserve(&w->b);
+  AppendString(&w->b, "    </Track>\n   </Lap>\n");
+}
+
+static void TCXStartLap(TCXWriter* w, const Totals* lap) {
+  OutBuffer* b = &w->b;
+  Reserve(b);
+  AppendString(b, "   <Lap StartTime=\"");
+  AppendTime(b, &w->track, lap->start_time);
+  AppendString(b, "\">\n    <TotalTimeSeconds>");
+  AppendUInt(b, lap->end_time - lap->start_time);
+  AppendString(b, "</TotalTimeSeconds>\n    <DistanceMeters>");
+  AppendDistance(b, lap->distance - lap->start_distance);
+  AppendString(b, "</DistanceMeters>\n    <MaximumSpeed>");
+  AppendFixed(b, lap->max_speed, 2);
+  AppendString(b, "</MaximumSpeed>\n    <Calories>");
+  AppendUInt(b, lap->calories - lap->start_calories);
+  AppendString(b, "</Calories>\n");
+  if (lap->heart_count > 0) {
+    AppendString(b, "    <AverageHeartRateBpm><Value>");
+    AppendUInt(b, (lap->heart_sum + lap->heart_count / 2) /
+                  lap->heart_count);
+    AppendString(b, "</Value></AverageHeartRateBpm>\n"
+                    "    <MaximumHeartRateBpm><Value>");
+    AppendUInt(b, lap->max_heart_rate);
+    AppendString(b, "</Value></MaximumHeartRateBpm>\n");
+  }
+  AppendString(b, "    <Intensity>Active</Intensity>\n"
+                  "    <TriggerMethod>Manual</TriggerMethod>\n"
+                  "    <Track>\n");
+}
+
+static void TCXPoint(void* context, const GPSSample* gps) {
+  TCXWriter* w = context;
+  Track* t = &w->track;
+  OutBuffer* b = &w->b;
+  if (gps->time == 0xffffffff) {
+    return;
+  }
+  if (StartsLap(t)) {
+    if (t->laps > 0) {
+      TCXEndLap(w);
+    }
+    StartLap(t, gps);
+    TCXStartLap(w, &w->laps[t->laps - 1]);
+  }
+  Reserve(b);
+  AppendString(b, "     <Trackpoint><Time>");
+  AppendTime(b, t, gps->time);
+  AppendString(b, "</Time><Position><LatitudeDegrees>");
+  AppendFixed(b, gps->latitude, 7);
+  AppendString(b, "</LatitudeDegrees><LongitudeDegrees>");
+  AppendFixed(b, gps->longitude, 7);
+  AppendString(b, "</LongitudeDegrees></Position><DistanceMeters>");
+  AppendDistance(b, gps->cum_distance);
+  AppendString(b, "</DistanceMeters>");
+  if (t->heart_rate >= 0) {
+    AppendString(b, "<HeartRateBpm><Value>");
+    AppendUInt(b, t->heart_rate);
+    AppendString(b, "</Value></HeartRateBpm>");
+  }
+  AppendString(b, "</Trackpoint>\n");
+}
+
+int WriteTCX(const uint8_t* data, size_t size, FILE* out) {
+  TCXWriter w;
+  memset(&w, 0, sizeof(w));
+  InitTrack(&w.track);
+  int result = ParseTrack(data, size, &w.track, TCXCountPoint);
+  if (result < 0 || w.failed) {
+    free(w.laps);
+    return -1;
+  }
+  if (w.track.laps > 0) {
+    w.laps[w.track.laps - 1] = w.track.lap;
+  }
+  uint32_t activity_type = w.track.activity_type;
+  uint32_t start = w.track.total.start_time;
+
+  InitTrack(&w.track);
+  if (InitOutBuffer(&w.b, out) < 0) {
+    free(w.laps);
+    return -1;
+  }
+  OutBuffer* b = &w.b;
+  AppendString(b,
+      "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+      "<TrainingCenterDatabase xmlns="
+      "\"http://www.garmin.com/xmlschemas/TrainingCenterDatabase/v2\">\n"
+      " <Activities>\n  <Activity Sport=\"");
+  AppendString(b, TCXSport(activity_type));
+  AppendString(b, "\">\n   <Id>");
+  AppendTime(b, &w.track, start);
+  AppendString(b, "</Id>\n");
+  result = ParseTrack(data, size, &w.track, TCXPoint);
+  if (w.track.laps > 0) {
+    TCXEndLap(&w);
+  }
+  Reserve(b);
+  AppendString(b, "  </Activity>\n </Activities>\n"
+                  "</TrainingCenterDatabase>\n");
+  if (CloseOutBuffer(b) < 0) {
+    result = -1;
+  }
+  free(w.laps);
+  return result;
+}
+
+// FIT: all the messages are written twice, once only to count the bytes
+// for the header, once for real.
+#define FIT_EPOCH 631065600  // 1989-12-31 00:00:00 UTC
+#define FIT_MANUFACTURER_TOMTOM 71
+
+// Base types.
+#define FIT_ENUM 0x00
+#define FIT_UINT8 0x02
+#define FIT_UINT16 0x84
+#define FIT_SINT32 0x85
+#define FIT_UINT32 0x86
+
+// Local message types, one per global message.
+enum {
+  FIT_FILE_ID,
+  FIT_EVENT,
+  FIT_RECORD,
+  FIT_LAP,
+  FIT_SESSION,
+  FIT_ACTIVITY,
+};
+
+typedef struct {
+  uint8_t number;
+  uint8_t size;
+  uint8_t type;
+} FITField;
+
+typedef struct {
+  uint16_t global;
+  uint8_t count;
+  FITField fields[16];
+} FITMessage;
+
+static const FITMessage kFITMessages[] = {
+  [FIT_FILE_ID] = { 0, 3, {
+    { 0, 1, FIT_ENUM },     // type
+    { 1, 2, FIT_UINT16 },   // manufacturer
+    { 4, 4, FIT_UINT32 },   // time_created
+  } },
+  [FIT_EVENT] = { 21, 4, {
+    { 253, 4, FIT_UINT32 },  // timestamp
+    { 0, 1, FIT_ENUM },      // event
+    { 1, 1, FIT_ENUM },      // event_type
+    { 3, 4, FIT_UINT32 },    // data
+  } },
+  [FIT_RECORD] = { 20, 6, {
+    { 253, 4, FIT_UINT32 },  // timestamp
+    { 0, 4, FIT_SINT32 },    // position_lat, semicircles
+    { 1, 4, FIT_SINT32 },    // position_long
+    { 5, 4, FIT_UINT32 },    // distance, cm
+    { 6, 2, FIT_UINT16 },    // speed, mm/s
+    { 3, 1, FIT_UINT8 },     // heart_rate
+  } },
+  [FIT_LAP] = { 19, 12, {
+    { 254, 2, FIT_UINT16 },  // message_index
+    { 253, 4, FIT_UINT32 },  // timestamp
+    { 0, 1, FIT_ENUM },      // event
+    { 1, 1, FIT_ENUM },      // event_type
+    { 2, 4, FIT_UINT32 },    // start_time
+    { 7, 4, FIT_UINT32 },    // total_elapsed_time, ms
+    { 8, 4, FIT_UINT32 },    // total_timer_time, ms
+    { 9, 4, FIT_UINT32 },    // total_distance, cm
+    { 11, 2, FIT_UINT16 },   // total_calories
+    { 14, 2, FIT_UINT16 },   // max_speed, mm/s
+    { 15, 1, FIT_UINT8 },    // avg_heart_rate
+    { 16, 1, FIT_UINT8 },    // max_heart_rate
+  } },
+  [FIT_SESSION] = { 18, 16, {
+    { 254, 2, FIT_UINT16 },  // message_index
+    { 253, 4, FIT_UINT32 },  // timestamp
+    { 0, 1, FIT_ENUM },      // event
+    { 1, 1, FIT_ENUM },      // event_type
+    { 2, 4, FIT_UINT32 },    // start_time
+    { 5, 1, FIT_ENUM },      // sport
+    { 6, 1, FIT_ENUM },      // sub_sport
+    { 7, 4, FIT_UINT32 },    // total_elapsed_time, ms
+    { 8, 4, FIT_UINT32 },    // total_timer_time, ms
+    { 9, 4, FIT_UINT32 },    // total_distance, cm
+    { 11, 2, FIT_UINT16 },   // total_calories
+    { 15, 2, FIT_UINT16 },   // max_speed, mm/s
+    { 16, 1, FIT_UINT8 },    // avg_heart_rate
+    { 17, 1, FIT_UINT8 },    // max_heart_rate
+    { 25, 2, FIT_UINT16 },   // first_lap_index
+    { 26, 2, FIT_UINT16 },   // num_laps
+  } },
+  [FIT_ACTIVITY] = { 34, 6, {
+    { 253, 4, FIT_UINT32 },  // timestamp
+    { 0, 4, FIT_UINT32 },    // total_timer_time, ms
+    { 1, 2, FIT_UINT16 },    // num_sessions
+    { 2, 1, FIT_ENUM },      // type
+    { 3, 1, FIT_ENUM },      // event
+    { 4, 1, FIT_ENUM },      // event_type
+  } },
+};
+
+typedef struct {
+  Track track;
+  OutBuffer b;
+  int defined[6];  // Definition message written.
+} FITWriter;
+
+static void AppendLE(OutBuffer* b, uint32_t value, int size) {
+  for (int i = 0; i < size; ++i) {
+    b->data[b->size++] = value >> (8 * i);
+  }
+}
+
+// Starts a data message, with its definition the first time.
+static void StartFIT(FITWriter* w, int type) {
+  OutBuffer* b = &w->b;
+  Reserve(b);
+  if (!w->defined[type]) {
+    const FITMessage* m = &kFITMessages[type];
+    AppendChar(b, 0x40 | type);
+    AppendChar(b, 0);  // Reserved
+    AppendChar(b, 0);  // Little endian
+    AppendLE(b, m->global, 2);
+    AppendChar(b, m->count);
+    for (int i = 0; i < m->count; ++i) {
+      AppendChar(b, m->fields[i].number);
+      AppendChar(b, m->fields[i].size);
+      AppendChar(b, m->fields[i].type);
+    }
+    w->defined[type] = 1;
+  }
+  AppendChar(b, type);
+}
+
+static uint32_t FITTime(uint32_t time) {
+  return time - FIT_EPOCH;
+}
+
+// 1e-7 degrees to 2^31 / 180 degrees.
+static int32_t Semicircles(int32_t value) {
+  int64_t scaled = (int64_t)value * 2147483648LL;
+  return (scaled < 0 ? scaled - 900000000 : scaled + 900000000) /
+         1800000000;
+}
+
+static void FITSport(uint32_t activity_type, int* sport, int* sub_sport) {
+  *sub_sport = 0;
+  switch (activity_type) {
+    case 0: *sport = 1; break;  // running
+    case 1: *sport = 2; break;  // cycling
+    case 2: *sport = 5; break;  // swimming
+    case 7: *sport = 1; *sub_sport = 1; break;  // treadmill
+    default: *sport = 0; break;  // generic
+  }
+}
+
+static void FITEvent(FITWriter* w, uint32_t time, int event_type) {
+  StartFIT(w, FIT_EVENT);
+  AppendLE(&w->b, FITTime(time), 4);
+  AppendChar(&w->b, 0);  // timer
+  AppendChar(&w->b, event_type);
+  AppendLE(&w->b, 0, 4);
+}
+
+// Fields shared by the lap and session messages, after start_time.
+static void AppendFITTotals(OutBuffer* b, const Totals* totals) {
+  uint32_t elapsed = (totals->end_time - totals->start_time) * 1000;
+  AppendLE(b, elapsed, 4);
+  AppendLE(b, elapsed, 4);
+  AppendLE(b, RoundFixed(totals->distance - totals->start_distance, 100),
+           4);
+  AppendLE(b, totals->calories - totals->start_calories, 2);
+  AppendLE(b, totals->max_speed * 10, 2);
+}
+
+static void AppendFITHeart(OutBuffer* b, const Totals* totals) {
+  if (totals->heart_count > 0) {
+    AppendLE(b, (totals->heart_sum + totals->heart_count / 2) /
+                totals->heart_count, 1);
+    AppendLE(b, totals->max_heart_rate, 1);
+  } else {
+    AppendLE(b, 0xFF, 1);  // Invalid
+    AppendLE(b, 0xFF, 1);
+  }
+}
+
+static void FITLap(FITWriter* w) {
+  const Totals* lap = &w->track.lap;
+  OutBuffer* b = &w->b;
+  StartFIT(w, FIT_LAP);
+  AppendLE(b, w->track.laps - 1, 2);
+  AppendLE(b, FITTime(lap->end_time), 4);
+  AppendChar(b, 9);  // lap
+  AppendChar(b, 1);  // stop
+  AppendLE(b, FITTime(lap->start_time), 4);
+  AppendFITTotals(b, lap);
+  AppendFITHeart(b, lap);
+}
+
+static void FITPoint(void* context, const GPSSample* gps) {
+  FITWriter* w = context;
+  Track* t = &w->track;
+  OutBuffer* b = &w->b;
+  if (gps->time == 0xffffffff) {
+    return;
+  }
+  if (StartsLap(t)) {
+    if (t->laps > 0) {
+      FITLap(w);
+    } else {
+      FITEvent(w, gps->time, 0);  // start
+    }
+    StartLap(t, gps);
+  }
+  AddSample(&t->lap, gps);
+  AddSample(&t->total, gps);
+  StartFIT(w, FIT_RECORD);
+  AppendLE(b, FITTime(gps->time), 4);
+  AppendLE(b, Semicircles(gps->latitude), 4);
+  AppendLE(b, Semicircles(gps->longitude), 4);
+  AppendLE(b, RoundFixed(gps->cum_distance, 100), 4);
+  AppendLE(b, gps->speed * 10, 2);
+  AppendLE(b, t->heart_rate >= 0 ? t->heart_rate : 0xFF, 1);
+}
+
+static void FITHeader(void* context, const Header* header) {
+  FITWriter* w = context;
+  TrackHeader(&w->track, header);
+  if (w->defined[FIT_FILE_ID]) {
+    return;
+  }
+  StartFIT(w, FIT_FILE_ID);
+  AppendChar(&w->b, 4);  // activity
+  AppendLE(&w->b, FIT_MANUFACTURER_TOMTOM, 2);
+  // The header time is local.
+  AppendLE(&w->b, FITTime(header->timestamp - header->local_time_offset), 4);
+}
+
+// Writes the messages, only counting them if the buffer has no output.
+static int WriteFITMessages(const uint8_t* data, size_t size, FITWriter* w) {
+  InitTrack(&w->track);
+  memset(w->defined, 0, sizeof(w->defined));
+  TTBinVisitor visitor = kTrack;
+  visitor.context = w;
+  visitor.header = FITHeader;
+  visitor.gps = FITPoint;
+  if (ParseTTBin(data, size, &visitor) < 0 || !w->defined[FIT_FILE_ID]) {
+    return -1;
+  }
+  Track* t = &w->track;
+  if (t->laps == 0) {
+    return 0;
+  }
+  OutBuffer* b = &w->b;
+  FITLap(w);
+  FITEvent(w, t->total.end_time, 4);  // stop all
+  int sport, sub_sport;
+  FITSport(t->activity_type, &sport, &sub_sport);
+  StartFIT(w, FIT_SESSION);
+  AppendLE(b, 0, 2);
+  AppendLE(b, FITTime(t->total.end_time), 4);
+  AppendChar(b, 8);  // session
+  AppendChar(b, 1);  // stop
+  AppendLE(b, FITTime(t->total.start_time), 4);
+  AppendChar(b, sport);
+  AppendChar(b, sub_sport);
+  AppendFITTotals(b, &t->total);
+  AppendFITHeart(b, &t->total);
+  AppendLE(b, 0, 2);
+  AppendLE(b, t->laps, 2);
+  StartFIT(w, FIT_ACTIVITY);
+  AppendLE(b, FITTime(t->total.end_time), 4);
+  AppendLE(b, (t->total.end_time - t->total.start_time) * 1000, 4);
+  AppendLE(b, 1, 2);
+  AppendChar(b, 0);   // manual
+  AppendChar(b, 26);  // activity
+  AppendChar(b, 1);   // stop
+  return 0;
+}
+
+int WriteFIT(const uint8_t* data, size_t size, FILE* out) {
+  FITWriter w;
+  if (InitOutBuffer(&w.b, NULL) < 0) {
+    return -1;
+  }
+  int result = WriteFITMessages(data, size, &w);
+  Flush(&w.b);
+  uint64_t data_size = w.b.written;
+  CloseOutBuffer(&w.b);
+  if (result < 0 || data_size > 0xffffffff ||
+      InitOutBuffer(&w.b, out) < 0) {
+    return -1;
+  }
+
+  OutBuffer* b = &w.b;
+  AppendChar(b, 14);  // Header size
+  AppendChar(b, 0x10);  // Protocol 1.0
+  AppendLE(b, 2093, 2);  // Profile 20.93
+  AppendLE(b, data_size, 4);
+  AppendString(b, ".FIT");
+  AppendLE(b, FITCRC(0, (const uint8_t*)b->data, 12), 2);
+  b->fit_crc = 1;
+  result = WriteFITMessages(data, size, &w);
+  Flush(b);
+  b->fit_crc = 0;
+  AppendLE(b, b->crc, 2);
+  if (CloseOutBuffer(b) < 0 || b->written != 14 + data_size + 2) {
+    result = -1;
+  }
+  return result;
+}
@@ -0,0 +1,58 @@
+#ifndef EXPORT_H
+#define EXPORT_H
+
+#include <stdio.h>
+
+#include "activity.h"
+#include "join.h"
+
+// Writes the activity in the Tomtom CSV format:
+// time,activityType,lapNumber,distance,speed,calories,lat,long,elevation,
+// heartRate,cycles
+// time is relative to the first GPS sample, distance is the distance since
+// the previous sample and heartRate the reading joined to the GPS sample,
+// the last one at or before it for Tomtom (empty if none). The elevation
+// isn't decoded yet and left empty. Lines end with CRLF like the Tomtom
+// files.
+// Returns 0 on success, -1 on write or allocation error.
+int WriteCSV(const Activity* activity, const JoinOptions* join, FILE* out);
+
+// One line of the CSV, for the writers that don't hold an Activity.
+typedef struct {
+  uint32_t time;  // Since the first sample.
+  uint32_t activity_type;
+  int lap_number;
+  float inc_distance;
+  uint16_t speed;
+  uint16_t calories;
+  int32_t latitude;
+  int32_t longitude;
+  uint8_t heart_rate;  // 0 = none.
+  uint8_t cycles;
+} CSVRow;
+
+// The same CSV a row at a time. OpenCSVWriter() writes the header line
+// and returns NULL on allocation failure; CloseCSVWriter() returns -1 if
+// any write failed.
+typedef struct CSVWriter CSVWriter;
+CSVWriter* OpenCSVWriter(FILE* out);
+void WriteCSVRows(CSVWriter* writer, const CSVRow* rows, size_t count);
+int CloseCSVWriter(CSVWriter* writer);
+
+// Streaming writers working on the records of a .ttbin file held in memory
+// rather than on an Activity, so that the memory used doesn't depend on
+// the length of the activity (bar a few bytes per lap for TCX). A lap
+// starts with the first GPS sample after a lap record and each point gets
+// the last heart rate reading before it. Times are UTC.
+// Return 0 on success, -1 on write error or if the data isn't a .ttbin
+// file.
+typedef int (*TrackWriter)(const uint8_t* data, size_t size, FILE* out);
+int WriteGPX(const uint8_t* data, size_t size, FILE* out);
+// Two passes, the first one gathers the lap totals that TCX puts first.
+int WriteTCX(const uint8_t* data, size_t size, FILE* out);
+// FIT activity file: file_id, timer events, records, laps, session and
+// activity messages. The header holds the size of the data, which a first
+// pass counts without writing.
+int WriteFIT(const uint8_t* data, size_t size, FILE* out);
+
+#endif  // EXPORT_H
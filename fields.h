@@ -0,0 +1,49 @@
+#ifndef FIELDS_H
+#define FIELDS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+// Loads of the little endian fields of the records, at any alignment.
+// A memcpy of a constant size is a single load on x86 and AArch64 and
+// what the target can do best elsewhere, unlike the packed struct fields
+// which become byte loads on strict alignment targets. The swap is only
+// compiled on big endian hosts.
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#define TTBIN_BIG_ENDIAN 1
+#else
+#define TTBIN_BIG_ENDIAN 0
+#endif
+
+static inline uint16_t Load16(const uint8_t* p) {
+  uint16_t v;
+  memcpy(&v, p, sizeof(v));
+  return TTBIN_BIG_ENDIAN ? __builtin_bswap16(v) : v;
+}
+
+static inline uint32_t Load32(const uint8_t* p) {
+  uint32_t v;
+  memcpy(&v, p, sizeof(v));
+  return TTBIN_BIG_ENDIAN ? __builtin_bswap32(v) : v;
+}
+
+static inline uint64_t Load64(const uint8_t* p) {
+  uint64_t v;
+  memcpy(&v, p, sizeof(v));
+  return TTBIN_BIG_ENDIAN ? __builtin_bswap64(v) : v;
+}
+
+static inline float LoadFloat(const uint8_t* p) {
+  uint32_t bits = Load32(p);
+  float v;
+  memcpy(&v, &bits, sizeof(v));
+  return v;
+}
+
+// Field of a record at its offset in the layout of type.
+#define LOAD16(p, type, field) Load16((p) + offsetof(type, field))
+#define LOAD32(p, type, field) Load32((p) + offsetof(type, field))
+#define LOADFLOAT(p, type, field) LoadFloat((p) + offsetof(type, field))
+
+#endif  // FIELDS_H
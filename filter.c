@@ -0,0 +1,232 @@
+#include "filter.h"
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "fields.h"
+
+// Slack on value * scale, which is off by an ulp or so from the decimal
+// written (0.29 * 100 is 28.999...).
+#define BOUND_EPSILON 1e-6
+
+// Narrows [*min, *max] to the integers v of the records (the resolution is
+// 1 / scale) for which "v op value * scale" holds, op being "<", ">=",
+// ..., limit the largest value. Returns the text after the number, NULL
+// on error.
+static const char* ParseBound(const char* text, double scale, double limit,
+                              double* min, double* max) {
+  char op[3] = { 0 };
+  size_t length = strspn(text, "<>=");
+  if (length == 0 || length > 2) {
+    return NULL;
+  }
+  memcpy(op, text, length);
+  char* end;
+  double value = strtod(text + length, &end) * scale;
+  if (end == text + length) {
+    return NULL;
+  }
+  double low = 0;
+  double high = limit;
+  if (strcmp(op, ">") == 0) {
+    low = floor(value + BOUND_EPSILON) + 1;
+  } else if (strcmp(op, ">=") == 0) {
+    low = ceil(value - BOUND_EPSILON);
+  } else if (strcmp(op, "<") == 0) {
+    high = ceil(value - BOUND_EPSILON) - 1;
+  } else if (strcmp(op, "<=") == 0) {
+    high = floor(value + BOUND_EPSILON);
+  } else if (strcmp(op, "=") == 0) {
+    if (fabs(value - round(value)) < BOUND_EPSILON) {
+      low = round(value);
+      high = low;
+    } else {
+      // No record holds a value between two steps.
+      low = 1;
+      high = 0;
+    }
+  } else {
+    return NULL;
+  }
+  *min = fmax(*min, low);
+  *max = fmin(*max, high);
+  return end;
+}
+
+// Bounds meant to select nothing are kept empty once clamped.
+static void SetBounds(double min, double max, double limit, uint32_t* low,
+                      uint32_t* high) {
+  if (min > max || max < 0 || min > limit) {
+    *low = 1;
+    *high = 0;
+    return;
+  }
+  *low = min < 0 ? 0 : min;
+  *high = max > limit ? limit : max;
+}
+
+int ParseFilter(const char* expression, TTBinFilter* filter) {
+  memset(filter, 0, sizeof(*filter));
+  filter->last_time = 0xffffffff;
+  filter->lap = -1;
+  double speed[2] = { 0, 0xffff };
+  double heart_rate[2] = { 0, 0xff };
+  const char* p = expression;
+  while (*p != '\0') {
+    char* end;
+    if (strncmp(p, "time=", 5) == 0) {
+      filter->first_time = strtoul(p + 5, &end, 10);
+      if (end == p + 5) {
+        return -1;
+      }
+      p = end;
+      if (*p == ':' && p[1] != ',' && p[1] != '\0') {
+        ++p;
+        filter->last_time = strtoul(p, &end, 10);
+        if (end == p || filter->last_time < filter->first_time) {
+          return -1;
+        }
+        p = end;
+      } else if (*p == ':') {
+        ++p;
+      }
+    } else if (strncmp(p, "lap=", 4) == 0) {
+      long lap = strtol(p + 4, &end, 10);
+      if (end == p + 4 || lap < 0 || lap > 255) {
+        return -1;
+      }
+      filter->lap = lap;
+      p = end;
+    } else if (strncmp(p, "speed", 5) == 0) {
+      filter->has_speed = 1;
+      p = ParseBound(p + 5, 100, 0xffff, &speed[0], &speed[1]);
+    } else if (strncmp(p, "hr", 2) == 0) {
+      filter->has_heart_rate = 1;
+      p = ParseBound(p + 2, 1, 0xff, &heart_rate[0], &heart_rate[1]);
+    } else {
+      return -1;
+    }
+    if (p == NULL || (*p != ',' && *p != '\0')) {
+      return -1;
+    }
+    if (*p == ',') {
+      ++p;
+    }
+  }
+  if (filter->has_speed && filter->has_heart_rate) {
+    // No record has both, nothing would ever match.
+    return -1;
+  }
+  uint32_t low;
+  uint32_t high;
+  SetBounds(speed[0], speed[1], 0xffff, &low, &high);
+  filter->min_speed = low;
+  filter->max_speed = high;
+  SetBounds(heart_rate[0], heart_rate[1], 0xff, &low, &high);
+  filter->min_heart_rate = low;
+  filter->max_heart_rate = high;
+  return 0;
+}
+
+// Walks the blocks in order with what the bounds of the next one need.
+typedef struct {
+  const TTBinIndex* index;
+  const TTBinFilter* filter;
+  uint32_t reached;  // Last time with a lock before the block, 0 if none.
+  size_t lap;        // First lap record at or after the block.
+  int lap_number;    // Of the lap record before the block, -1 if none.
+} Planner;
+
+static int Overlaps(uint32_t min, uint32_t max, uint32_t low,
+                    uint32_t high) {
+  return min <= max && min <= high && max >= low;
+}
+
+// Whether some record of block i may pass the filter.
+static int BlockMatches(Planner* p, size_t i) {
+  const TTBinIndex* index = p->index;
+  const TTBinFilter* f = p->filter;
+  const IndexBlock* block = &index->blocks[i];
+  uint64_t end = i + 1 < index->block_count ?
+      index->blocks[i + 1].offset : index->file_size;
+
+  // The records being in time order, those of the block are between the
+  // last sample before it and the first one after it.
+  uint32_t lower = p->reached;
+  uint32_t upper = i + 1 < index->block_count ?
+      index->blocks[i + 1].first_time : 0xffffffff;
+  if (block->last_time != 0xffffffff) {
+    p->reached = block->last_time;
+  }
+
+  // The lap at the start of the block and those starting in it.
+  while (p->lap < index->lap_count &&
+         index->laps[p->lap].offset < block->offset) {
+    p->lap_number = index->laps[p->lap++].lap;
+  }
+  int in_lap = f->lap < 0 || p->lap_number == f->lap;
+  for (size_t k = p->lap;
+       !in_lap && k < index->lap_count && index->laps[k].offset < end; ++k) {
+    in_lap = index->laps[k].lap == f->lap;
+  }
+  if (!in_lap || lower > f->last_time || upper < f->first_time) {
+    return 0;
+  }
+  int gps = !f->has_heart_rate &&
+      Overlaps(block->min_speed, block->max_speed,
+               f->has_speed ? f->min_speed : 0,
+               f->has_speed ? f->max_speed : 0xffff);
+  int heart = !f->has_speed &&
+      Overlaps(block->min_heart_rate, block->max_heart_rate,
+               f->has_heart_rate ? f->min_heart_rate : 0,
+               f->has_heart_rate ? f->max_heart_rate : 0xff);
+  return gps || heart;
+}
+
+static uint32_t AddSeconds(uint32_t time, uint32_t seconds) {
+  return seconds >= 0xffffffff - time ? 0xfffffffe : time + seconds;
+}
+
+int FilterTTBin(const uint8_t* data, const TTBinIndex* index,
+                const TTBinFilter* filter, const TTBinVisitor* visitor) {
+  TTBinFilter f = *filter;
+  uint32_t start = IndexStartTime(index);
+  f.first_time = AddSeconds(start, filter->first_time);
+  if (filter->last_time != 0xffffffff) {
+    f.last_time = AddSeconds(start, filter->last_time);
+  }
+  if (index->file_size >= 1 + sizeof(Header) && data[0] == 0x20) {
+    f.local_time_offset = LOAD32(data + 1, Header, local_time_offset);
+  }
+
+  TTBinRange range = {
+    0, index->file_size, index->file_format, 0, &index->lengths, &f, -1
+  };
+  size_t count = index->block_count;
+  if (count > 0) {
+    range.end = index->blocks[0].offset;
+  }
+  int result = ParseTTBinRange(data, &range, visitor);
+
+  Planner planner = { index, &f, 0, 0, -1 };
+  size_t run = count;  // First block of the run kept, count if none.
+  for (size_t i = 0; i <= count; ++i) {
+    int keep = i < count && BlockMatches(&planner, i);
+    if (keep && run == count) {
+      run = i;
+      // The lap of the first record of the run.
+      range.lap = planner.lap_number;
+    }
+    if (!keep && run < count) {
+      range.begin = index->blocks[run].offset;
+      range.end = i < count ? index->blocks[i].offset : index->file_size;
+      range.cum_distance = index->blocks[run].cum_distance;
+      if (ParseTTBinRange(data, &range, visitor) < 0) {
+        result = -1;
+      }
+      run = count;
+    }
+  }
+  return result;
+}
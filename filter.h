@@ -0,0 +1,33 @@
+#ifndef FILTER_H
+#define FILTER_H
+
+#include <stdint.h>
+
+#include "index.h"
+#include "ttbin.h"
+
+// Filter expressions, predicates separated by commas, all to be met:
+//   time=600:900  seconds after the first GPS sample, as -t ("600" for
+//                 the rest of the file)
+//   lap=2         records from lap record 2 to the next one
+//   speed>3.5     m/s, also >=, <, <= and =, on the exact values of the
+//                 records (0.01 m/s): speed<3.504 keeps 3.50 m/s and
+//                 speed=3.504 matches nothing
+//   hr>0          heart rate readings in BPM, same operators: hr<140.4
+//                 keeps 140 BPM, hr>139.6 keeps it too
+// See TTBinFilter for the records they apply to: speed only matches GPS
+// samples and hr heart rate records, so they can't be combined. Returns -1
+// on a syntax error or when both are given.
+int ParseFilter(const char* expression, TTBinFilter* filter);
+
+// Parses the records of the file held in data that pass the filter, its
+// times being relative to the first GPS sample. The index blocks whose
+// bounds can't match are skipped without being read, so the cost follows
+// the size of the result rather than of the file. The records before the
+// first block (header, length table...) are always parsed.
+// Returns 0 on success, -1 if a range ends with a truncated record, as
+// ParseTTBinRange().
+int FilterTTBin(const uint8_t* data, const TTBinIndex* index,
+                const TTBinFilter* filter, const TTBinVisitor* visitor);
+
+#endif  // FILTER_H
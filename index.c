@@ -0,0 +1,353 @@
+#include "index.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cache.h"
+
+// Version 2 added the speed and heart rate bounds of the blocks, version 3
+// the hash of the file, version 4 made it the hash of its two ends.
+static const char kMagic[4] = { 'T', 'T', 'I', '4' };
+
+// Bytes hashed at each end of the file: the header, the length table and
+// the first block at the start, the last block and the summary at the end.
+#define INDEX_HASH_SPAN (64u << 10)
+
+typedef struct {
+  TTBinIndex* index;
+  size_t block_capacity;
+  size_t lap_capacity;
+  uint64_t ordinal;
+  uint64_t offset;  // Of the current record.
+  size_t samples;   // GPS samples in the last block.
+  float cum_distance;
+  int failed;
+} Builder;
+
+static int Grow(void** array, size_t element_size, size_t* capacity) {
+  size_t grown_capacity = *capacity ? 2 * *capacity : 64;
+  void* grown = realloc(*array, grown_capacity * element_size);
+  if (grown == NULL) {
+    return -1;
+  }
+  *array = grown;
+  *capacity = grown_capacity;
+  return 0;
+}
+
+static void OnRecord(void* context, uint8_t tag, size_t offset) {
+  Builder* b = context;
+  b->offset = offset;
+  ++b->ordinal;
+}
+
+static void OnHeader(void* context, const Header* header) {
+  Builder* b = context;
+  b->index->file_format = header->file_format;
+}
+
+static void OnRecordLengths(void* context, const RecordLengths* lengths) {
+  Builder* b = context;
+  ReadRecordLengths(&b->index->lengths, lengths);
+}
+
+static void OnGPS(void* context, const GPSSample* gps) {
+  Builder* b = context;
+  TTBinIndex* index = b->index;
+  if (index->block_count == 0 || b->samples == INDEX_BLOCK_SAMPLES) {
+    if (index->block_count == b->block_capacity &&
+        Grow((void**)&index->blocks, sizeof(IndexBlock),
+             &b->block_capacity)) {
+      b->failed = 1;
+      return;
+    }
+    IndexBlock* block = &index->blocks[index->block_count++];
+    block->offset = b->offset;
+    block->ordinal = b->ordinal - 1;
+    block->first_time = 0xffffffff;
+    block->last_time = 0xffffffff;
+    block->cum_distance = b->cum_distance;
+    block->min_speed = 0xffff;
+    block->max_speed = 0;
+    block->min_heart_rate = 0xff;
+    block->max_heart_rate = 0;
+    b->samples = 0;
+  }
+  IndexBlock* block = &index->blocks[index->block_count - 1];
+  ++b->samples;
+  b->cum_distance = gps->cum_distance;
+  if (gps->time != 0xffffffff) {
+    if (block->first_time == 0xffffffff) {
+      block->first_time = gps->time;
+    }
+    block->last_time = gps->time;
+    if (gps->speed < block->min_speed) {
+      block->min_speed = gps->speed;
+    }
+    if (gps->speed > block->max_speed) {
+      block->max_speed = gps->speed;
+    }
+  }
+}
+
+// Readings before the first block are left out, the filters always parse
+// the records before it.
+static void OnHeartRate(void* context, const HeartRateSample* heart) {
+  Builder* b = context;
+  TTBinIndex* index = b->index;
+  if (index->block_count == 0) {
+    return;
+  }
+  IndexBlock* block = &index->blocks[index->block_count - 1];
+  if (heart->heart_rate < block->min_heart_rate) {
+    block->min_heart_rate = heart->heart_rate;
+  }
+  if (heart->heart_rate > block->max_heart_rate) {
+    block->max_heart_rate = heart->heart_rate;
+  }
+}
+
+static void OnLap(void* context, const Lap* lap) {
+  Builder* b = context;
+  TTBinIndex* index = b->index;
+  if (index->lap_count == b->lap_capacity &&
+      Grow((void**)&index->laps, sizeof(IndexLap), &b->lap_capacity)) {
+    b->failed = 1;
+    return;
+  }
+  index->lap_slot[lap->lap] = index->lap_count;
+  IndexLap* entry = &index->laps[index->lap_count++];
+  entry->offset = b->offset;
+  entry->ordinal = b->ordinal - 1;
+  entry->time = lap->time;
+  entry->cum_distance = b->cum_distance;
+  entry->lap = lap->lap;
+}
+
+// Damaged data is skipped, the blocks start at the records found after.
+static void OnCorrupt(void* context, size_t offset, size_t size) {
+}
+
+// Hash of the ends of the file, so that loading the sidecar costs the same
+// whatever the size of the file.
+static uint64_t HashEnds(const uint8_t* data, size_t size) {
+  if (size <= 2 * INDEX_HASH_SPAN) {
+    return XXH64(data, size, 0);
+  }
+  uint64_t hash = XXH64(data, INDEX_HASH_SPAN, size);
+  return XXH64(data + size - INDEX_HASH_SPAN, INDEX_HASH_SPAN, hash);
+}
+
+static void InitIndex(TTBinIndex* index) {
+  memset(index, 0, sizeof(*index));
+  InitRecordLengths(&index->lengths);
+  for (int i = 0; i < 256; ++i) {
+    index->lap_slot[i] = -1;
+  }
+}
+
+int BuildIndex(const uint8_t* data, size_t size, TTBinIndex* index) {
+  InitIndex(index);
+  index->file_size = size;
+  index->file_hash = HashEnds(data, size);
+  Builder builder;
+  memset(&builder, 0, sizeof(builder));
+  builder.index = index;
+  TTBinVisitor visitor = {
+    .context = &builder,
+    .header = OnHeader,
+    .record_lengths = OnRecordLengths,
+    .lap = OnLap,
+    .gps = OnGPS,
+    .heart_rate = OnHeartRate,
+    .record = OnRecord,
+    .corrupt = OnCorrupt,
+  };
+  if (ParseTTBin(data, size, &visitor) < 0 || builder.failed) {
+    return -1;
+  }
+  return 0;
+}
+
+void FreeIndex(TTBinIndex* index) {
+  free(index->blocks);
+  free(index->laps);
+  InitIndex(index);
+}
+
+int SaveIndex(const TTBinIndex* index, const char* path) {
+  FILE* f = fopen(path, "wb");
+  if (f == NULL) {
+    return -1;
+  }
+  uint64_t counts[2] = { index->block_count, index->lap_count };
+  int ok = fwrite(kMagic, sizeof(kMagic), 1, f) == 1 &&
+           fwrite(&index->file_size, sizeof(index->file_size), 1, f) == 1 &&
+           fwrite(&index->file_hash, sizeof(index->file_hash), 1, f) == 1 &&
+           fwrite(&index->file_format, 1, 1, f) == 1 &&
+           fwrite(&index->lengths, sizeof(index->lengths), 1, f) == 1 &&
+           fwrite(counts, sizeof(counts), 1, f) == 1 &&
+           fwrite(index->blocks, sizeof(IndexBlock), index->block_count,
+                  f) == index->block_count &&
+           fwrite(index->laps, sizeof(IndexLap), index->lap_count,
+                  f) == index->lap_count;
+  if (fclose(f) != 0) {
+    ok = 0;
+  }
+  return ok ? 0 : -1;
+}
+
+int LoadIndex(const char* path, const uint8_t* data, size_t file_size,
+              TTBinIndex* index) {
+  InitIndex(index);
+  FILE* f = fopen(path, "rb");
+  if (f == NULL) {
+    return -1;
+  }
+  char magic[4];
+  uint64_t counts[2];
+  int ok = fread(magic, sizeof(magic), 1, f) == 1 &&
+           memcmp(magic, kMagic, sizeof(kMagic)) == 0 &&
+           fread(&index->file_size, sizeof(index->file_size), 1, f) == 1 &&
+           index->file_size == file_size &&
+           fread(&index->file_hash, sizeof(index->file_hash), 1, f) == 1 &&
+           index->file_hash == HashEnds(data, file_size) &&
+           fread(&index->file_format, 1, 1, f) == 1 &&
+           fread(&index->lengths, sizeof(index->lengths), 1, f) == 1 &&
+           fread(counts, sizeof(counts), 1, f) == 1 &&
+           // A GPS record is at least 28 bytes, a lap 7.
+           counts[0] <= file_size / 28 / INDEX_BLOCK_SAMPLES + 1 &&
+           counts[1] <= file_size / 7;
+  if (ok) {
+    index->block_count = counts[0];
+    index->lap_count = counts[1];
+    index->blocks = malloc(counts[0] * sizeof(IndexBlock) + 1);
+    index->laps = malloc(counts[1] * sizeof(IndexLap) + 1);
+    ok = index->blocks != NULL && index->laps != NULL &&
+         fread(index->blocks, sizeof(IndexBlock), counts[0],
+               f) == counts[0] &&
+         fread(index->laps, sizeof(IndexLap), counts[1], f) == counts[1];
+  }
+  fclose(f);
+  for (size_t i = 0; ok && i < index->lap_count; ++i) {
+    if (index->laps[i].offset >= file_size) {
+      ok = 0;
+    }
+    index->lap_slot[index->laps[i].lap] = i;
+  }
+  for (size_t i = 0; ok && i < index->block_count; ++i) {
+    if (index->blocks[i].offset >= file_size) {
+      ok = 0;
+    }
+  }
+  if (!ok) {
+    FreeIndex(index);
+    return -1;
+  }
+  return 0;
+}
+
+// Last time reached by a block, blocks without any lock take the time of
+// the one before.
+static uint32_t ReachedTime(const TTBinIndex* index, size_t i) {
+  while (index->blocks[i].last_time == 0xffffffff && i > 0) {
+    --i;
+  }
+  return index->blocks[i].last_time == 0xffffffff ?
+      0 : index->blocks[i].last_time;
+}
+
+uint32_t IndexStartTime(const TTBinIndex* index) {
+  // The first blocks have no lock while the watch gets a fix.
+  for (size_t i = 0; i < index->block_count; ++i) {
+    if (index->blocks[i].first_time != 0xffffffff) {
+      return index->blocks[i].first_time;
+    }
+  }
+  return 0;
+}
+
+size_t FindIndexBlock(const TTBinIndex* index, uint32_t time) {
+  size_t count = index->block_count;
+  if (count == 0) {
+    return 0;
+  }
+  // Guess from a sample per second, then step towards the answer.
+  uint32_t start = IndexStartTime(index);
+  size_t i = 0;
+  if (start != 0 && time > start) {
+    i = (time - start) / INDEX_BLOCK_SAMPLES;
+    if (i >= count) {
+      i = count - 1;
+    }
+  }
+  for (int steps = 0; steps < 4; ++steps) {
+    if (ReachedTime(index, i) < time) {
+      if (++i == count) {
+        return count;
+      }
+    } else if (i > 0 && ReachedTime(index, i - 1) >= time) {
+      --i;
+    } else {
+      return i;
+    }
+  }
+  // Gaps in the recording, binary search.
+  size_t low = 0;
+  size_t high = count;
+  while (low < high) {
+    size_t middle = low + (high - low) / 2;
+    if (ReachedTime(index, middle) < time) {
+      low = middle + 1;
+    } else {
+      high = middle;
+    }
+  }
+  return low;
+}
+
+static void InitRange(const TTBinIndex* index, TTBinRange* range) {
+  range->begin = 0;
+  range->end = index->file_size;
+  range->file_format = index->file_format;
+  range->cum_distance = 0;
+  range->lengths = &index->lengths;
+  range->filter = NULL;
+  range->lap = -1;
+}
+
+int IndexTimeRange(const TTBinIndex* index, uint32_t first, uint32_t last,
+                   TTBinRange* range) {
+  size_t begin = FindIndexBlock(index, first);
+  if (begin == index->block_count || first > last) {
+    return -1;
+  }
+  size_t end = last == 0xffffffff ? index->block_count :
+      FindIndexBlock(index, last + 1);
+  if (end < index->block_count && index->blocks[end].first_time <= last) {
+    // The last sample is in that block.
+    ++end;
+  }
+  InitRange(index, range);
+  range->begin = index->blocks[begin].offset;
+  range->cum_distance = index->blocks[begin].cum_distance;
+  if (end < index->block_count) {
+    range->end = index->blocks[end].offset;
+  }
+  return 0;
+}
+
+int IndexLapRange(const TTBinIndex* index, uint8_t lap, TTBinRange* range) {
+  int32_t slot = index->lap_slot[lap];
+  if (slot < 0) {
+    return -1;
+  }
+  InitRange(index, range);
+  range->begin = index->laps[slot].offset;
+  if ((size_t)slot + 1 < index->lap_count) {
+    range->end = index->laps[slot + 1].offset;
+  }
+  range->cum_distance = index->laps[slot].cum_distance;
+  return 0;
+}
@@ -0,0 +1,83 @@
+#ifndef INDEX_H
+#define INDEX_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "ttbin.h"
+
+// Number of GPS samples per index block.
+#define INDEX_BLOCK_SAMPLES 64
+
+// A run of INDEX_BLOCK_SAMPLES GPS samples, starting at a GPS record and
+// going up to the next block, with the bounds of its values for the
+// filters to skip it (min > max when there is no value).
+typedef struct {
+  uint64_t offset;      // Of the tag of the first GPS record.
+  uint64_t ordinal;     // Record number of that record in the file.
+  uint32_t first_time;  // GPS time of the first and last samples with
+  uint32_t last_time;   // a lock, 0xffffffff if none.
+  float cum_distance;   // Parser distance before the block (format 5).
+  uint16_t min_speed;   // Of the samples with a lock.
+  uint16_t max_speed;
+  uint8_t min_heart_rate;  // Of the heart rate records, zeros included.
+  uint8_t max_heart_rate;
+} IndexBlock;
+
+// A lap record.
+typedef struct {
+  uint64_t offset;
+  uint64_t ordinal;
+  uint32_t time;
+  float cum_distance;  // Parser distance at the lap record (format 5).
+  uint8_t lap;
+} IndexLap;
+
+// Record index of one file, built in one pass. Lap N goes from its lap
+// record to the next one.
+typedef struct {
+  uint64_t file_size;
+  uint64_t file_hash;  // XXH64 of its ends, to tell a stale sidecar.
+  uint8_t file_format;
+  RecordLengthTable lengths;
+  size_t block_count;
+  IndexBlock* blocks;
+  size_t lap_count;
+  IndexLap* laps;
+  int32_t lap_slot[256];  // Position in laps of each lap number, or -1.
+} TTBinIndex;
+
+// Damaged data is skipped as by the decoder, so that the blocks start at
+// records. Returns 0 on success, -1 on allocation failure; the index must
+// be released with FreeIndex() in both cases.
+int BuildIndex(const uint8_t* data, size_t size, TTBinIndex* index);
+void FreeIndex(TTBinIndex* index);
+
+// Sidecar file, "<file>.idx" by convention. LoadIndex() fails if the
+// sidecar doesn't match the size and hash of the file held in data (stale
+// index), a file repaired in place often keeps its size. Only the ends of
+// the file are hashed, so that loading doesn't read the whole file.
+int SaveIndex(const TTBinIndex* index, const char* path);
+int LoadIndex(const char* path, const uint8_t* data, size_t size,
+              TTBinIndex* index);
+
+// GPS time of the first sample with a lock, the origin of the relative
+// times of -t and of the filters. 0 if there is none.
+uint32_t IndexStartTime(const TTBinIndex* index);
+
+// Returns the first block whose samples reach time, block_count if none.
+// Samples are 1 s apart in practice, so the block is guessed from the
+// time and found in a step or two.
+size_t FindIndexBlock(const TTBinIndex* index, uint32_t time);
+
+// Range covering the GPS samples from first to last (GPS time). The range
+// is made of whole blocks, so it can hold a few samples on each side.
+// Returns -1 if no sample is in the window.
+int IndexTimeRange(const TTBinIndex* index, uint32_t first, uint32_t last,
+                   TTBinRange* range);
+
+// Range of a lap, from its lap record to the next one. Returns -1 if the
+// file has no such lap.
+int IndexLapRange(const TTBinIndex* index, uint8_t lap, TTBinRange* range);
+
+#endif  // INDEX_H
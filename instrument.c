@@ -0,0 +1,144 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "instrument.h"
+
+#ifdef TTBIN_STATS
+
+#include <pthread.h>
+#include <string.h>
+#include <time.h>
+
+__thread DecodeStats thread_stats = { .phase = PHASE_NONE, .version = -1 };
+
+static DecodeStats totals;
+static pthread_mutex_t totals_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static const char* const kPhaseNames[PHASE_COUNT] = {
+  "io", "decode", "format", "write"
+};
+
+static uint64_t Now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void Charge(DecodeStats* s, uint64_t now) {
+  if (s->phase != PHASE_NONE) {
+    uint64_t elapsed = now - s->mark;
+    s->phase_ns[s->phase] += elapsed;
+    if (s->phase == PHASE_DECODE && s->version >= 0) {
+      s->versions[s->version].decode_ns += elapsed;
+    }
+  }
+  s->mark = now;
+}
+
+Phase StatsBegin(Phase phase) {
+  DecodeStats* s = &thread_stats;
+  Phase outer = s->phase;
+  Charge(s, Now());
+  s->phase = phase;
+  return outer;
+}
+
+void StatsEnd(Phase outer) {
+  DecodeStats* s = &thread_stats;
+  Charge(s, Now());
+  s->phase = outer;
+}
+
+// Entry of version in s, the last one takes the versions that don't fit.
+static int FindVersion(DecodeStats* s, const uint8_t version[4]) {
+  for (int i = 0; i < s->version_count; ++i) {
+    if (memcmp(s->versions[i].version, version, 4) == 0) {
+      return i;
+    }
+  }
+  if (s->version_count >= STATS_VERSIONS - 1) {
+    // Left at 0.0.0.0.
+    s->version_count = STATS_VERSIONS;
+    return STATS_VERSIONS - 1;
+  }
+  memcpy(s->versions[s->version_count].version, version, 4);
+  return s->version_count++;
+}
+
+void StatsFile(void) {
+  DecodeStats* s = &thread_stats;
+  // The time so far goes to the previous file, if any.
+  Charge(s, Now());
+  s->version = -1;
+  ++s->files;
+}
+
+void StatsVersion(const uint8_t version[4]) {
+  DecodeStats* s = &thread_stats;
+  // Only the first header counts, some writers parse the file twice.
+  if (s->version < 0) {
+    Charge(s, Now());
+    s->version = FindVersion(s, version);
+    ++s->versions[s->version].files;
+  }
+}
+
+void MergeThreadStats(void) {
+  DecodeStats* s = &thread_stats;
+  Charge(s, Now());
+  pthread_mutex_lock(&totals_lock);
+  for (int tag = 0; tag < 256; ++tag) {
+    totals.records[tag] += s->records[tag];
+    totals.bytes[tag] += s->bytes[tag];
+  }
+  totals.unknown_tags += s->unknown_tags;
+  totals.corrupt_bytes += s->corrupt_bytes;
+  totals.files += s->files;
+  for (int i = 0; i < PHASE_COUNT; ++i) {
+    totals.phase_ns[i] += s->phase_ns[i];
+  }
+  for (int i = 0; i < s->version_count; ++i) {
+    int entry = FindVersion(&totals, s->versions[i].version);
+    totals.versions[entry].files += s->versions[i].files;
+    totals.versions[entry].decode_ns += s->versions[i].decode_ns;
+  }
+  pthread_mutex_unlock(&totals_lock);
+
+  Phase phase = s->phase;
+  uint64_t mark = s->mark;
+  memset(s, 0, sizeof(*s));
+  s->phase = phase;
+  s->mark = mark;
+  s->version = -1;
+}
+
+void WriteDecodeStats(FILE* out) {
+  MergeThreadStats();
+  pthread_mutex_lock(&totals_lock);
+  fprintf(out, "ttbin_stats files %llu\n",
+          (unsigned long long)totals.files);
+  fprintf(out, "ttbin_stats unknown_tags %llu\n",
+          (unsigned long long)totals.unknown_tags);
+  fprintf(out, "ttbin_stats corrupt_bytes %llu\n",
+          (unsigned long long)totals.corrupt_bytes);
+  for (int tag = 0; tag < 256; ++tag) {
+    if (totals.records[tag] > 0) {
+      fprintf(out, "ttbin_stats tag 0x%02x records %llu bytes %llu\n", tag,
+              (unsigned long long)totals.records[tag],
+              (unsigned long long)totals.bytes[tag]);
+    }
+  }
+  for (int i = 0; i < PHASE_COUNT; ++i) {
+    fprintf(out, "ttbin_stats phase %s ns %llu\n", kPhaseNames[i],
+            (unsigned long long)totals.phase_ns[i]);
+  }
+  for (int i = 0; i < totals.version_count; ++i) {
+    const VersionStats* v = &totals.versions[i];
+    fprintf(out, "ttbin_stats version %d.%d.%d.%d files %llu "
+            "decode_ns %llu\n",
+            v->version[0], v->version[1], v->version[2], v->version[3],
+            (unsigned long long)v->files, (unsigned long long)v->decode_ns);
+  }
+  pthread_mutex_unlock(&totals_lock);
+}
+
+#endif  // TTBIN_STATS
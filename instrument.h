@@ -0,0 +1,94 @@
+#ifndef INSTRUMENT_H
+#define INSTRUMENT_H
+
+// Decode counters and phase timing, compiled in with -DTTBIN_STATS only.
+// Without it every macro below expands to nothing.
+//
+// Each thread counts on its own, without atomics, and merges into the
+// process totals with MergeThreadStats() when it's done. The phases nest:
+// a decode started while formatting (the streaming writers parse as they
+// go) is charged to decode only, so the phase times add up to the time
+// spent in the library.
+
+#include <stdint.h>
+#include <stdio.h>
+
+typedef enum {
+  PHASE_NONE = -1,
+  PHASE_IO,      // Opening, mapping or reading the input.
+  PHASE_DECODE,  // Parsing, includes the dump callbacks.
+  PHASE_FORMAT,  // Building the exported output.
+  PHASE_WRITE,   // Handing the output to stdio.
+  PHASE_COUNT
+} Phase;
+
+// Number of distinct firmware versions tracked, the others are lumped
+// together under 0.0.0.0.
+#define STATS_VERSIONS 16
+
+typedef struct {
+  uint8_t version[4];
+  uint64_t files;
+  uint64_t decode_ns;
+} VersionStats;
+
+typedef struct {
+  uint64_t records[256];
+  uint64_t bytes[256];  // Tags included.
+  uint64_t unknown_tags;
+  uint64_t corrupt_bytes;
+  uint64_t files;
+  uint64_t phase_ns[PHASE_COUNT];
+  VersionStats versions[STATS_VERSIONS];
+  int version_count;
+  // Of the thread only.
+  Phase phase;    // Being timed.
+  uint64_t mark;  // When it was last charged.
+  int version;    // Entry of the file being decoded, -1 before its header.
+} DecodeStats;
+
+#ifdef TTBIN_STATS
+
+extern __thread DecodeStats thread_stats;
+
+// Charges the time since the last change to the current phase and
+// switches to phase. Returns the phase to restore with StatsEnd().
+Phase StatsBegin(Phase phase);
+void StatsEnd(Phase outer);
+
+// Starts a new input file, its header still to come.
+void StatsFile(void);
+// Charges the decoding of the current file to this firmware version.
+void StatsVersion(const uint8_t version[4]);
+
+// Adds the counts of the calling thread to the totals and clears them.
+void MergeThreadStats(void);
+
+// Writes the totals as "key value" lines, one tag, phase and version per
+// line, all starting with "ttbin_stats". Merges the calling thread first.
+void WriteDecodeStats(FILE* out);
+
+#define STATS_RECORD(tag, length) \
+  (++thread_stats.records[tag], thread_stats.bytes[tag] += 1 + (length))
+#define STATS_UNKNOWN_TAG() (++thread_stats.unknown_tags)
+#define STATS_CORRUPT(size) (thread_stats.corrupt_bytes += (size))
+#define STATS_FILE() StatsFile()
+#define STATS_HEADER(header) StatsVersion((header)->version)
+#define STATS_BEGIN(outer, phase) Phase outer = StatsBegin(phase)
+#define STATS_END(outer) StatsEnd(outer)
+#define STATS_MERGE() MergeThreadStats()
+
+#else
+
+#define STATS_RECORD(tag, length) ((void)0)
+#define STATS_UNKNOWN_TAG() ((void)0)
+#define STATS_CORRUPT(size) ((void)0)
+#define STATS_FILE() ((void)0)
+#define STATS_HEADER(header) ((void)0)
+#define STATS_BEGIN(outer, phase) ((void)0)
+#define STATS_END(outer) ((void)0)
+#define STATS_MERGE() ((void)0)
+
+#endif  // TTBIN_STATS
+
+#endif  // INSTRUMENT_H
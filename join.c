@@ -0,0 +1,71 @@
+#include "join.h"
+
+// Within max_gap seconds, 0 allowing any gap.
+static int Near(uint32_t gap, uint32_t max_gap) {
+  return max_gap == 0 || gap <= max_gap;
+}
+
+uint8_t JoinReadings(const JoinOptions* options, uint32_t before,
+                     uint8_t last, int next, uint32_t span) {
+  uint32_t max_gap = options->max_gap;
+  switch (options->policy) {
+    case JOIN_HOLD:
+      return Near(before, max_gap) ? last : 0;
+    case JOIN_NULL:
+      return before == 0 ? last : 0;
+    case JOIN_INTERPOLATE:
+      if (before == 0) {
+        return last;
+      }
+      if (next >= 0) {
+        if (!Near(span, max_gap)) {
+          return 0;
+        }
+        int from = last;
+        return from + ((next - from) * (int64_t)before * 2 +
+                       (next > from ? span : -(int64_t)span)) /
+                      (2 * (int64_t)span);
+      }
+      // No reading after, hold the last one.
+      return Near(before, max_gap) ? last : 0;
+  }
+  return 0;
+}
+
+void JoinHeartRate(const Activity* a, const JoinOptions* options,
+                   uint8_t* heart_rate) {
+  int32_t offset = a->has_header ? a->header.local_time_offset : 0;
+  size_t heart = 0;           // First reading after the sample.
+  size_t last = (size_t)-1;   // Last non zero reading at or before it.
+  size_t next = 0;            // First non zero reading after it.
+  for (size_t i = 0; i < a->gps_count; ++i) {
+    uint32_t local = a->time[i] + offset;
+    while (heart < a->heart_count && a->heart_time[heart] <= local) {
+      if (a->heart_rate[heart] != 0) {
+        last = heart;
+      }
+      ++heart;
+    }
+    heart_rate[i] = 0;
+    if (last == (size_t)-1) {
+      continue;
+    }
+    uint32_t before = local - a->heart_time[last];
+    int to = -1;
+    uint32_t span = 0;
+    if (options->policy == JOIN_INTERPOLATE && before > 0) {
+      if (next < heart) {
+        next = heart;
+      }
+      while (next < a->heart_count && a->heart_rate[next] == 0) {
+        ++next;
+      }
+      if (next < a->heart_count) {
+        to = a->heart_rate[next];
+        span = a->heart_time[next] - a->heart_time[last];
+      }
+    }
+    heart_rate[i] = JoinReadings(options, before, a->heart_rate[last], to,
+                                 span);
+  }
+}
@@ -0,0 +1,35 @@
+#ifndef JOIN_H
+#define JOIN_H
+
+#include <stdint.h>
+
+#include "activity.h"
+
+// Alignment of the heart rate readings on the GPS samples. Both timelines
+// are monotonic, so this is one linear merge.
+
+typedef enum {
+  JOIN_HOLD,         // Last reading at or before the sample.
+  JOIN_INTERPOLATE,  // Linear between the readings around the sample.
+  JOIN_NULL,         // Only a reading of the same second.
+} JoinPolicy;
+
+typedef struct {
+  JoinPolicy policy;
+  uint32_t max_gap;  // Seconds, readings further away are ignored. 0 = any.
+} JoinOptions;
+
+// Writes the heart rate of each GPS sample to heart_rate (gps_count
+// values), 0 when there is none. Zero BPM readings are no readings. The
+// GPS times are moved to local time first, like the heart rate ones.
+void JoinHeartRate(const Activity* activity, const JoinOptions* options,
+                   uint8_t* heart_rate);
+
+// The join of one sample, before seconds after the last non zero reading
+// (last BPM), for streaming joins. next is the BPM of the first non zero
+// reading after the sample, span seconds after the last one, or -1 if
+// there is none; only JOIN_INTERPOLATE looks at them, when before > 0.
+uint8_t JoinReadings(const JoinOptions* options, uint32_t before,
+                     uint8_t last, int next, uint32_t span);
+
+#endif  // JOIN_H
@@ -0,0 +1,391 @@
+// Batch conversions and scans of the fixed point columns of an Activity,
+// with AVX2 and NEON versions picked at run time / compile time and a
+// scalar fallback. All of them give the same results as the scalar loops.
+
+#include "activity.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define HAVE_AVX2_KERNELS 1
+#include <immintrin.h>
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#define HAVE_NEON_KERNELS 1
+#include <arm_neon.h>
+#endif
+
+static void ScalarFixed32(const int32_t* in, double* out, size_t n,
+                          double scale) {
+  for (size_t i = 0; i < n; ++i) {
+    out[i] = in[i] * scale;
+  }
+}
+
+static void ScalarFixed32f(const int32_t* in, float* out, size_t n,
+                           float scale) {
+  for (size_t i = 0; i < n; ++i) {
+    out[i] = (float)in[i] * scale;
+  }
+}
+
+static void ScalarFixed16(const uint16_t* in, double* out, size_t n,
+                          double scale) {
+  for (size_t i = 0; i < n; ++i) {
+    out[i] = in[i] * scale;
+  }
+}
+
+static void ScalarFixed16f(const uint16_t* in, float* out, size_t n,
+                           float scale) {
+  for (size_t i = 0; i < n; ++i) {
+    out[i] = (float)in[i] * scale;
+  }
+}
+
+static void ScalarScan8(const uint8_t* in, size_t n,
+                        const uint8_t* thresholds, int count,
+                        ColumnScan* scan) {
+  for (size_t i = 0; i < n; ++i) {
+    uint8_t v = in[i];
+    scan->sum += v;
+    scan->zeros += v == 0;
+    if (v > scan->max) {
+      scan->max = v;
+    }
+    for (int t = 0; t < count; ++t) {
+      scan->at_least[t] += v >= thresholds[t];
+    }
+  }
+}
+
+static void ScalarScan16(const uint16_t* in, size_t n,
+                         const uint16_t* thresholds, int count,
+                         ColumnScan* scan) {
+  for (size_t i = 0; i < n; ++i) {
+    uint16_t v = in[i];
+    scan->sum += v;
+    scan->zeros += v == 0;
+    if (v > scan->max) {
+      scan->max = v;
+    }
+    for (int t = 0; t < count; ++t) {
+      scan->at_least[t] += v >= thresholds[t];
+    }
+  }
+}
+
+#ifdef HAVE_AVX2_KERNELS
+
+static int HasAVX2(void) {
+  static int has_avx2 = -1;
+  if (has_avx2 < 0) {
+    __builtin_cpu_init();
+    has_avx2 = __builtin_cpu_supports("avx2") != 0;
+  }
+  return has_avx2;
+}
+
+__attribute__((target("avx2")))
+static size_t AVX2Fixed32(const int32_t* in, double* out, size_t n,
+                          double scale) {
+  const __m256d s = _mm256_set1_pd(scale);
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    __m128i lo = _mm_loadu_si128((const __m128i*)(in + i));
+    __m128i hi = _mm_loadu_si128((const __m128i*)(in + i + 4));
+    _mm256_storeu_pd(out + i, _mm256_mul_pd(_mm256_cvtepi32_pd(lo), s));
+    _mm256_storeu_pd(out + i + 4, _mm256_mul_pd(_mm256_cvtepi32_pd(hi), s));
+  }
+  return i;
+}
+
+__attribute__((target("avx2")))
+static size_t AVX2Fixed32f(const int32_t* in, float* out, size_t n,
+                           float scale) {
+  const __m256 s = _mm256_set1_ps(scale);
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    __m256i v = _mm256_loadu_si256((const __m256i*)(in + i));
+    _mm256_storeu_ps(out + i, _mm256_mul_ps(_mm256_cvtepi32_ps(v), s));
+  }
+  return i;
+}
+
+__attribute__((target("avx2")))
+static size_t AVX2Fixed16(const uint16_t* in, double* out, size_t n,
+                          double scale) {
+  const __m256d s = _mm256_set1_pd(scale);
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    __m256i v = _mm256_cvtepu16_epi32(
+        _mm_loadu_si128((const __m128i*)(in + i)));
+    __m128i lo = _mm256_castsi256_si128(v);
+    __m128i hi = _mm256_extracti128_si256(v, 1);
+    _mm256_storeu_pd(out + i, _mm256_mul_pd(_mm256_cvtepi32_pd(lo), s));
+    _mm256_storeu_pd(out + i + 4, _mm256_mul_pd(_mm256_cvtepi32_pd(hi), s));
+  }
+  return i;
+}
+
+__attribute__((target("avx2")))
+static size_t AVX2Fixed16f(const uint16_t* in, float* out, size_t n,
+                           float scale) {
+  const __m256 s = _mm256_set1_ps(scale);
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    __m256i v = _mm256_cvtepu16_epi32(
+        _mm_loadu_si128((const __m128i*)(in + i)));
+    _mm256_storeu_ps(out + i, _mm256_mul_ps(_mm256_cvtepi32_ps(v), s));
+  }
+  return i;
+}
+
+// v >= t for unsigned lanes is max(v, t) == v.
+__attribute__((target("avx2,popcnt")))
+static size_t AVX2Scan8(const uint8_t* in, size_t n,
+                        const uint8_t* thresholds, int count,
+                        ColumnScan* scan) {
+  const __m256i zero = _mm256_setzero_si256();
+  __m256i t[SCAN_MAX_THRESHOLDS];
+  for (int j = 0; j < count; ++j) {
+    t[j] = _mm256_set1_epi8((char)thresholds[j]);
+  }
+  __m256i sum = zero;
+  __m256i max = zero;
+  size_t i = 0;
+  for (; i + 32 <= n; i += 32) {
+    __m256i v = _mm256_loadu_si256((const __m256i*)(in + i));
+    sum = _mm256_add_epi64(sum, _mm256_sad_epu8(v, zero));
+    max = _mm256_max_epu8(max, v);
+    scan->zeros += __builtin_popcount(
+        _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, zero)));
+    for (int j = 0; j < count; ++j) {
+      __m256i ge = _mm256_cmpeq_epi8(_mm256_max_epu8(v, t[j]), v);
+      scan->at_least[j] += __builtin_popcount(_mm256_movemask_epi8(ge));
+    }
+  }
+  uint64_t sums[4];
+  uint8_t maxes[32];
+  _mm256_storeu_si256((__m256i*)sums, sum);
+  _mm256_storeu_si256((__m256i*)maxes, max);
+  scan->sum += sums[0] + sums[1] + sums[2] + sums[3];
+  for (int j = 0; j < 32; ++j) {
+    if (maxes[j] > scan->max) {
+      scan->max = maxes[j];
+    }
+  }
+  return i;
+}
+
+// Adds the 32 bit lanes of sum to the scan.
+__attribute__((target("avx2")))
+static void AVX2Flush32(__m256i sum, ColumnScan* scan) {
+  uint32_t sums[8];
+  _mm256_storeu_si256((__m256i*)sums, sum);
+  for (int j = 0; j < 8; ++j) {
+    scan->sum += sums[j];
+  }
+}
+
+__attribute__((target("avx2,popcnt")))
+static size_t AVX2Scan16(const uint16_t* in, size_t n,
+                         const uint16_t* thresholds, int count,
+                         ColumnScan* scan) {
+  const __m256i zero = _mm256_setzero_si256();
+  __m256i t[SCAN_MAX_THRESHOLDS];
+  for (int j = 0; j < count; ++j) {
+    t[j] = _mm256_set1_epi16((short)thresholds[j]);
+  }
+  __m256i sum = zero;
+  __m256i max = zero;
+  size_t i = 0;
+  size_t pending = 0;
+  for (; i + 16 <= n; i += 16) {
+    __m256i v = _mm256_loadu_si256((const __m256i*)(in + i));
+    // Two values per 32 bit lane and round, flushed before overflowing.
+    sum = _mm256_add_epi32(sum, _mm256_unpacklo_epi16(v, zero));
+    sum = _mm256_add_epi32(sum, _mm256_unpackhi_epi16(v, zero));
+    if (++pending == 16384) {
+      AVX2Flush32(sum, scan);
+      sum = zero;
+      pending = 0;
+    }
+    max = _mm256_max_epu16(max, v);
+    // Two mask bits per value.
+    scan->zeros += __builtin_popcount(
+        _mm256_movemask_epi8(_mm256_cmpeq_epi16(v, zero))) / 2;
+    for (int j = 0; j < count; ++j) {
+      __m256i ge = _mm256_cmpeq_epi16(_mm256_max_epu16(v, t[j]), v);
+      scan->at_least[j] += __builtin_popcount(_mm256_movemask_epi8(ge)) / 2;
+    }
+  }
+  AVX2Flush32(sum, scan);
+  uint16_t maxes[16];
+  _mm256_storeu_si256((__m256i*)maxes, max);
+  for (int j = 0; j < 16; ++j) {
+    if (maxes[j] > scan->max) {
+      scan->max = maxes[j];
+    }
+  }
+  return i;
+}
+
+#endif  // HAVE_AVX2_KERNELS
+
+#ifdef HAVE_NEON_KERNELS
+
+static size_t NEONFixed32(const int32_t* in, double* out, size_t n,
+                          double scale) {
+  const float64x2_t s = vdupq_n_f64(scale);
+  size_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    int32x4_t v = vld1q_s32(in + i);
+    float64x2_t lo = vcvtq_f64_s64(vmovl_s32(vget_low_s32(v)));
+    float64x2_t hi = vcvtq_f64_s64(vmovl_s32(vget_high_s32(v)));
+    vst1q_f64(out + i, vmulq_f64(lo, s));
+    vst1q_f64(out + i + 2, vmulq_f64(hi, s));
+  }
+  return i;
+}
+
+static size_t NEONFixed32f(const int32_t* in, float* out, size_t n,
+                           float scale) {
+  const float32x4_t s = vdupq_n_f32(scale);
+  size_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    vst1q_f32(out + i, vmulq_f32(vcvtq_f32_s32(vld1q_s32(in + i)), s));
+  }
+  return i;
+}
+
+static size_t NEONFixed16(const uint16_t* in, double* out, size_t n,
+                          double scale) {
+  const float64x2_t s = vdupq_n_f64(scale);
+  size_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    uint32x4_t v = vmovl_u16(vld1_u16(in + i));
+    float64x2_t lo = vcvtq_f64_u64(vmovl_u32(vget_low_u32(v)));
+    float64x2_t hi = vcvtq_f64_u64(vmovl_u32(vget_high_u32(v)));
+    vst1q_f64(out + i, vmulq_f64(lo, s));
+    vst1q_f64(out + i + 2, vmulq_f64(hi, s));
+  }
+  return i;
+}
+
+static size_t NEONFixed16f(const uint16_t* in, float* out, size_t n,
+                           float scale) {
+  const float32x4_t s = vdupq_n_f32(scale);
+  size_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    uint32x4_t v = vmovl_u16(vld1_u16(in + i));
+    vst1q_f32(out + i, vmulq_f32(vcvtq_f32_u32(v), s));
+  }
+  return i;
+}
+
+static size_t NEONScan8(const uint8_t* in, size_t n,
+                        const uint8_t* thresholds, int count,
+                        ColumnScan* scan) {
+  const uint8x16_t one = vdupq_n_u8(1);
+  uint8x16_t max = vdupq_n_u8(0);
+  size_t i = 0;
+  for (; i + 16 <= n; i += 16) {
+    uint8x16_t v = vld1q_u8(in + i);
+    scan->sum += vaddlvq_u8(v);
+    max = vmaxq_u8(max, v);
+    scan->zeros += vaddvq_u8(vandq_u8(vceqzq_u8(v), one));
+    for (int j = 0; j < count; ++j) {
+      uint8x16_t ge = vcgeq_u8(v, vdupq_n_u8(thresholds[j]));
+      scan->at_least[j] += vaddvq_u8(vandq_u8(ge, one));
+    }
+  }
+  uint8_t m = vmaxvq_u8(max);
+  if (m > scan->max) {
+    scan->max = m;
+  }
+  return i;
+}
+
+static size_t NEONScan16(const uint16_t* in, size_t n,
+                         const uint16_t* thresholds, int count,
+                         ColumnScan* scan) {
+  uint16x8_t max = vdupq_n_u16(0);
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    uint16x8_t v = vld1q_u16(in + i);
+    scan->sum += vaddlvq_u16(v);
+    max = vmaxq_u16(max, v);
+    scan->zeros += vaddvq_u16(vshrq_n_u16(vceqzq_u16(v), 15));
+    for (int j = 0; j < count; ++j) {
+      uint16x8_t ge = vcgeq_u16(v, vdupq_n_u16(thresholds[j]));
+      scan->at_least[j] += vaddvq_u16(vshrq_n_u16(ge, 15));
+    }
+  }
+  uint16_t m = vmaxvq_u16(max);
+  if (m > scan->max) {
+    scan->max = m;
+  }
+  return i;
+}
+
+#endif  // HAVE_NEON_KERNELS
+
+void ConvertFixed32(const int32_t* in, double* out, size_t n, double scale) {
+  size_t done = 0;
+#if defined(HAVE_AVX2_KERNELS)
+  if (HasAVX2()) done = AVX2Fixed32(in, out, n, scale);
+#elif defined(HAVE_NEON_KERNELS)
+  done = NEONFixed32(in, out, n, scale);
+#endif
+  ScalarFixed32(in + done, out + done, n - done, scale);
+}
+
+void ConvertFixed32f(const int32_t* in, float* out, size_t n, float scale) {
+  size_t done = 0;
+#if defined(HAVE_AVX2_KERNELS)
+  if (HasAVX2()) done = AVX2Fixed32f(in, out, n, scale);
+#elif defined(HAVE_NEON_KERNELS)
+  done = NEONFixed32f(in, out, n, scale);
+#endif
+  ScalarFixed32f(in + done, out + done, n - done, scale);
+}
+
+void ConvertFixed16(const uint16_t* in, double* out, size_t n, double scale) {
+  size_t done = 0;
+#if defined(HAVE_AVX2_KERNELS)
+  if (HasAVX2()) done = AVX2Fixed16(in, out, n, scale);
+#elif defined(HAVE_NEON_KERNELS)
+  done = NEONFixed16(in, out, n, scale);
+#endif
+  ScalarFixed16(in + done, out + done, n - done, scale);
+}
+
+void ConvertFixed16f(const uint16_t* in, float* out, size_t n, float scale) {
+  size_t done = 0;
+#if defined(HAVE_AVX2_KERNELS)
+  if (HasAVX2()) done = AVX2Fixed16f(in, out, n, scale);
+#elif defined(HAVE_NEON_KERNELS)
+  done = NEONFixed16f(in, out, n, scale);
+#endif
+  ScalarFixed16f(in + done, out + done, n - done, scale);
+}
+
+void ScanColumn8(const uint8_t* in, size_t n, const uint8_t* thresholds,
+                 int count, ColumnScan* scan) {
+  size_t done = 0;
+#if defined(HAVE_AVX2_KERNELS)
+  if (HasAVX2()) done = AVX2Scan8(in, n, thresholds, count, scan);
+#elif defined(HAVE_NEON_KERNELS)
+  done = NEONScan8(in, n, thresholds, count, scan);
+#endif
+  ScalarScan8(in + done, n - done, thresholds, count, scan);
+}
+
+void ScanColumn16(const uint16_t* in, size_t n, const uint16_t* thresholds,
+                  int count, ColumnScan* scan) {
+  size_t done = 0;
+#if defined(HAVE_AVX2_KERNELS)
+  if (HasAVX2()) done = AVX2Scan16(in, n, thresholds, count, scan);
+#elif defined(HAVE_NEON_KERNELS)
+  done = NEONScan16(in, n, thresholds, count, scan);
+#endif
+  ScalarScan16(in + done, n - done, thresholds, count, scan);
+}
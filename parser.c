@@ -0,0 +1,845 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "ttbin.h"
+#include "fields.h"
+#include "instrument.h"
+
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+int RecordSize(uint8_t tag) {
+  switch(tag) {
+    case 0x20: return sizeof(Header);
+    case 0x16: return sizeof(RecordLengths);
+    case 0x21: return sizeof(Lap);
+    case 0x22: return sizeof(GPS);
+    case 0x23: return sizeof(R23);
+    case 0x25: return sizeof(HeartRate);
+    case 0x26: return 6;
+    case 0x27: return sizeof(Summary);
+    case 0x30: return 2;
+    case 0x32: return sizeof(Treadmill);
+    case 0x34: return sizeof(Swim);
+    case 0x35: return sizeof(UnknownAndTime);
+    case 0x37: return 1;
+    default: return -1;
+  }
+}
+
+void InitRecordLengths(RecordLengthTable* table) {
+  for (int tag = 0; tag < 256; ++tag) {
+    table->length[tag] = RecordSize(tag);
+  }
+}
+
+void ReadRecordLengths(RecordLengthTable* table, const RecordLengths* lengths) {
+  for (int i = 0; i + 3 <= sizeof(lengths->entries); i += 3) {
+    const uint8_t* entry = lengths->entries + i;
+    uint16_t length = entry[1] | (entry[2] << 8);
+    if (length > 0) {
+      table->length[entry[0]] = length - 1;
+    }
+  }
+}
+
+// Tags whose records the visitor wants, so the others are skipped without
+// going through Dispatch().
+static void WantedTags(const TTBinVisitor* v, uint8_t wanted[256]) {
+  for (int tag = 0; tag < 256; ++tag) {
+    wanted[tag] = v->raw != NULL;
+  }
+  // Always needed to learn the file format.
+  wanted[0x20] = 1;
+  // Always needed to learn the lengths.
+  wanted[0x16] = 1;
+  wanted[0x21] = v->lap != NULL;
+  wanted[0x22] = v->gps != NULL || v->gps_span != NULL;
+  wanted[0x23] = v->r23 != NULL;
+  wanted[0x25] = v->heart_rate != NULL || v->heart_rate_span != NULL;
+  wanted[0x27] = v->summary != NULL;
+  wanted[0x32] = v->treadmill != NULL;
+  wanted[0x34] = v->swim != NULL;
+  wanted[0x35] = v->r35 != NULL;
+}
+
+static void InitParserState(const TTBinVisitor* v, ParserState* state) {
+  InitRecordLengths(&state->lengths);
+  WantedTags(v, state->wanted);
+  state->file_format = 0;
+  state->cum_distance = 0;
+  state->last_time = 0;
+  state->jump_count = 0;
+  state->filter = NULL;
+  state->lap = -1;
+  state->gps_count = 0;
+  state->heart_count = 0;
+}
+
+// Hands the buffered records over, before the records that split the
+// activity.
+static inline void FlushSpans(ParserState* state, const TTBinVisitor* v) {
+  if (state->gps_count > 0) {
+    v->gps_span(v->context, state->gps, state->gps_count);
+    state->gps_count = 0;
+  }
+  if (state->heart_count > 0) {
+    v->heart_rate_span(v->context, state->hearts, state->heart_count);
+    state->heart_count = 0;
+  }
+}
+
+// The decoding loops are specialized by file format: with the format a
+// constant, the GPS layout and its field offsets are known at compile
+// time and no record tests the version. ANY_FORMAT reads it from the
+// state instead, for the other formats.
+#define ANY_FORMAT -1
+#define ALWAYS_INLINE inline __attribute__((always_inline))
+
+static ALWAYS_INLINE int FormatOf(const ParserState* state, int format) {
+  return format == ANY_FORMAT ? state->file_format : format;
+}
+
+static ALWAYS_INLINE void ConvertGPS(const uint8_t* data, GPSSample* gps) {
+  gps->latitude = (int32_t)LOAD32(data, GPS, latitude);
+  gps->longitude = (int32_t)LOAD32(data, GPS, longitude);
+  gps->heading = LOAD16(data, GPS, heading);
+  gps->speed = LOAD16(data, GPS, speed);
+  gps->time = LOAD32(data, GPS, time);
+  gps->calories = LOAD16(data, GPS, calories);
+  gps->inc_distance = LOADFLOAT(data, GPS, inc_distance);
+  gps->cum_distance = LOADFLOAT(data, GPS, cum_distance);
+  gps->cycles = data[offsetof(GPS, cycles)];
+}
+
+static ALWAYS_INLINE void ConvertGPS5(const uint8_t* data, ParserState* state,
+                                      GPSSample* gps) {
+  gps->latitude = (int32_t)LOAD32(data, GPS5, latitude);
+  gps->longitude = (int32_t)LOAD32(data, GPS5, longitude);
+  gps->heading = LOAD16(data, GPS5, heading);
+  gps->speed = LOAD16(data, GPS5, speed);
+  gps->time = LOAD32(data, GPS5, time);
+  gps->calories = LOAD16(data, GPS5, calories);
+  gps->inc_distance = LOAD16(data, GPS5, inc_distance) * 0.1f;
+  gps->cycles = data[offsetof(GPS5, cycles)];
+  if (gps->time != 0xffffffff) {
+    state->cum_distance += gps->inc_distance;
+  }
+  gps->cum_distance = state->cum_distance;
+}
+
+// The samples are loaded field by field into the span buffer, or a local
+// for the single record callback, in host order whatever the host.
+static ALWAYS_INLINE void DispatchGPS(const uint8_t* data, ParserState* state,
+                                      const TTBinVisitor* v, int format) {
+  GPSSample sample;
+  GPSSample* gps = v->gps_span ? &state->gps[state->gps_count] : &sample;
+  if (FormatOf(state, format) == 5) {
+    ConvertGPS5(data, state, gps);
+  } else {
+    ConvertGPS(data, gps);
+  }
+  if (!v->gps_span) {
+    v->gps(v->context, gps);
+  } else if (++state->gps_count == SPAN_RECORDS) {
+    v->gps_span(v->context, state->gps, state->gps_count);
+    state->gps_count = 0;
+  }
+}
+
+static ALWAYS_INLINE void DispatchHeartRate(const uint8_t* data,
+                                            ParserState* state,
+                                            const TTBinVisitor* v) {
+  HeartRateSample sample;
+  HeartRateSample* heart =
+      v->heart_rate_span ? &state->hearts[state->heart_count] : &sample;
+  heart->heart_rate = data[offsetof(HeartRate, heart_rate)];
+  heart->u1 = data[offsetof(HeartRate, u1)];
+  heart->time = LOAD32(data, HeartRate, time);
+  if (!v->heart_rate_span) {
+    v->heart_rate(v->context, heart);
+  } else if (++state->heart_count == SPAN_RECORDS) {
+    v->heart_rate_span(v->context, state->hearts, state->heart_count);
+    state->heart_count = 0;
+  }
+}
+
+// The multi byte fields of the records, swapped to host order on big
+// endian hosts. The byte arrays and the GPS and heart rate records,
+// loaded field by field, aren't listed.
+typedef struct {
+  uint8_t offset;
+  uint8_t size;
+} Field;
+
+#define FIELD(type, member) \
+  { offsetof(type, member), sizeof(((type*)0)->member) }
+
+static const Field kHeaderFields[] = {
+  FIELD(Header, unkown1), FIELD(Header, timestamp),
+  FIELD(Header, watch_time), FIELD(Header, local_time_offset),
+};
+static const Field kLapFields[] = { FIELD(Lap, time) };
+static const Field kR23Fields[] = {
+  FIELD(R23, u1), FIELD(R23, u2), FIELD(R23, u6),
+};
+static const Field kSummaryFields[] = {
+  FIELD(Summary, activity_type), FIELD(Summary, distance),
+  FIELD(Summary, duration), FIELD(Summary, calories),
+};
+static const Field kTreadmillFields[] = {
+  FIELD(Treadmill, time), FIELD(Treadmill, distance),
+  FIELD(Treadmill, calories), FIELD(Treadmill, steps), FIELD(Treadmill, u2),
+};
+static const Field kSwimFields[] = {
+  FIELD(Swim, time), FIELD(Swim, calories),
+};
+static const Field kR35Fields[] = { FIELD(UnknownAndTime, time) };
+
+#define FIELDS(fields) \
+  *count = sizeof(fields) / sizeof(fields[0]); \
+  return fields
+
+static const Field* RecordFields(uint8_t tag, int* count) {
+  switch (tag) {
+    case 0x20: FIELDS(kHeaderFields);
+    case 0x21: FIELDS(kLapFields);
+    case 0x23: FIELDS(kR23Fields);
+    case 0x27: FIELDS(kSummaryFields);
+    case 0x32: FIELDS(kTreadmillFields);
+    case 0x34: FIELDS(kSwimFields);
+    case 0x35: FIELDS(kR35Fields);
+    default: return NULL;
+  }
+}
+
+// Turns a record of tag from little endian to host order, in place.
+static void SwapRecord(uint8_t tag, uint8_t* record) {
+  int count = 0;
+  const Field* fields = RecordFields(tag, &count);
+  for (int i = 0; i < count; ++i) {
+    uint8_t* p = record + fields[i].offset;
+    for (int j = 0; j < fields[i].size / 2; ++j) {
+      uint8_t byte = p[j];
+      p[j] = p[fields[i].size - 1 - j];
+      p[fields[i].size - 1 - j] = byte;
+    }
+  }
+}
+
+static ALWAYS_INLINE void Dispatch(uint8_t tag, const uint8_t* data,
+                                   int size, ParserState* state,
+                                   const TTBinVisitor* v, int format) {
+  if (tag == 0x20 || tag == 0x16 || tag == 0x21 || tag == 0x27) {
+    FlushSpans(state, v);
+  }
+  // The visitors get the records in host order. The header is the
+  // largest record; tags of unknown layout are left as they are, the GPS
+  // and heart rate records are loaded field by field.
+  uint8_t native[sizeof(Header)];
+  if (TTBIN_BIG_ENDIAN && RecordSize(tag) > 0 && size >= RecordSize(tag) &&
+      tag != 0x16 && tag != 0x22 && tag != 0x25) {
+    memcpy(native, data, RecordSize(tag));
+    SwapRecord(tag, native);
+    data = native;
+  }
+  if (size < RecordSize(tag)) {
+    // Shorter than the layout we know, can only be handed as raw bytes.
+    if (v->raw) v->raw(v->context, tag, data, size);
+    return;
+  }
+  switch(tag) {
+    case 0x20:
+      state->file_format = ((const Header*)data)->file_format;
+      STATS_HEADER((const Header*)data);
+      if (v->header) v->header(v->context, (const Header*)data);
+      break;
+    case 0x16:
+      if (v->record_lengths) {
+        v->record_lengths(v->context, (const RecordLengths*)data);
+      }
+      break;
+    case 0x21:
+      if (v->lap) v->lap(v->context, (const Lap*)data);
+      break;
+    case 0x22:
+      if (v->gps || v->gps_span) DispatchGPS(data, state, v, format);
+      break;
+    case 0x23:
+      if (v->r23) v->r23(v->context, (const R23*)data);
+      break;
+    case 0x25:
+      if (v->heart_rate || v->heart_rate_span) {
+        DispatchHeartRate(data, state, v);
+      }
+      break;
+    case 0x27:
+      if (v->summary) v->summary(v->context, (const Summary*)data);
+      break;
+    case 0x32:
+      if (v->treadmill) v->treadmill(v->context, (const Treadmill*)data);
+      break;
+    case 0x34:
+      if (v->swim) v->swim(v->context, (const Swim*)data);
+      break;
+    case 0x35:
+      if (v->r35) v->r35(v->context, (const UnknownAndTime*)data);
+      break;
+    default:
+      if (v->raw) v->raw(v->context, tag, data, size);
+      break;
+  }
+}
+
+// Time of a GPS payload, 0xffffffff without a lock.
+static inline uint32_t GPSTime(const uint8_t* payload, int file_format) {
+  return file_format == 5 ? LOAD32(payload, GPS5, time) :
+                            LOAD32(payload, GPS, time);
+}
+
+// GPS samples are about a second apart, within a day is plausible.
+static int PlausibleTime(uint32_t time, uint32_t last_time) {
+  return time == 0xffffffff || last_time == 0 ||
+      (time >= last_time && time - last_time <= 86400);
+}
+
+// Records checked after a corrupt byte before parsing resumes.
+#define RESYNC_RECORDS 4
+
+// Largest step of the GPS time taken at once. A longer jump (a pause, or
+// a corrupt time) only moves last_time once RESYNC_RECORDS samples in
+// order confirm it, so that one bad time can't hide the samples after it.
+#define RESYNC_STEP 60
+
+static int InStep(uint32_t time, uint32_t from) {
+  return time >= from && time - from <= RESYNC_STEP;
+}
+
+static void UpdateLastTime(ParserState* state, uint32_t time) {
+  if (time == 0xffffffff) {
+    return;
+  }
+  if (state->last_time == 0 || InStep(time, state->last_time)) {
+    state->last_time = time;
+    state->jump_count = 0;
+    return;
+  }
+  if (state->jump_count > 0 && InStep(time, state->jump_time)) {
+    if (++state->jump_count >= RESYNC_RECORDS) {
+      state->last_time = time;
+      state->jump_count = 0;
+      return;
+    }
+  } else {
+    state->jump_count = 1;
+  }
+  state->jump_time = time;
+}
+
+// Whether a record can start at offset: the next RESYNC_RECORDS records
+// (or as many as fit in the data) have known tags and GPS times in order.
+// About one chance in 5e6 for random bytes. A run of RESYNC_RECORDS whose
+// first GPS time is before last_time (a corrupt time got through) is also
+// taken, *restart is then that time, 0 otherwise.
+static int PlausibleRecord(const uint8_t* data, size_t size, size_t offset,
+                           const ParserState* state, uint32_t* restart) {
+  uint32_t last_time = state->last_time;
+  int gps = 0;
+  int records = 0;
+  *restart = 0;
+  for (; records < RESYNC_RECORDS && offset < size; ++records) {
+    uint8_t tag = data[offset];
+    int length = state->lengths.length[tag];
+    if (length < 0) {
+      return 0;
+    }
+    if (size - offset - 1 < (size_t)length) {
+      break;
+    }
+    if (tag == 0x22 && length >= RecordSize(0x22)) {
+      uint32_t time = GPSTime(data + offset + 1, state->file_format);
+      if (!PlausibleTime(time, last_time)) {
+        if (gps > 0 || time > last_time) {
+          return 0;
+        }
+        *restart = time;
+      }
+      if (time != 0xffffffff) {
+        last_time = time;
+        ++gps;
+      }
+    }
+    offset += 1 + length;
+  }
+  return *restart == 0 || records == RESYNC_RECORDS;
+}
+
+// Skips the corrupt bytes at offset, returns the offset of the next
+// plausible record or size.
+static size_t Resync(const uint8_t* data, size_t size, size_t offset,
+                     ParserState* state, size_t base,
+                     const TTBinVisitor* visitor) {
+  size_t next = offset + 1;
+  uint32_t restart = 0;
+  while (next < size && !PlausibleRecord(data, size, next, state, &restart)) {
+    ++next;
+  }
+  if (next < size && restart != 0) {
+    state->last_time = restart;
+    state->jump_count = 0;
+  }
+  STATS_CORRUPT(next - offset);
+  visitor->corrupt(visitor->context, base + offset, next - offset);
+  return next;
+}
+
+static ALWAYS_INLINE int InWindow(const TTBinFilter* filter, uint32_t time) {
+  return time >= filter->first_time && time <= filter->last_time &&
+         time != 0xffffffff;
+}
+
+// Whether the record passes the filter, from the fields at their offsets
+// in the payload. Keeps the lap number and the format 5 distance, which
+// the skipped records still count in.
+static ALWAYS_INLINE int Matches(uint8_t tag, const uint8_t* payload,
+                                 int length, ParserState* state,
+                                 int format) {
+  const TTBinFilter* filter = state->filter;
+  if (tag == 0x20 || tag == 0x16) {
+    return 1;
+  }
+  if (length < RecordSize(tag)) {
+    return 0;
+  }
+  if (tag == 0x21) {
+    state->lap = payload[offsetof(Lap, lap)];
+    return 0;
+  }
+  if (tag == 0x25) {
+    uint8_t heart_rate = payload[offsetof(HeartRate, heart_rate)];
+    uint32_t time = LOAD32(payload, HeartRate, time) -
+                    filter->local_time_offset;
+    return !filter->has_speed && InWindow(filter, time) &&
+           (filter->lap < 0 || filter->lap == state->lap) &&
+           (!filter->has_heart_rate ||
+            (heart_rate >= filter->min_heart_rate &&
+             heart_rate <= filter->max_heart_rate));
+  }
+  if (tag != 0x22) {
+    return 0;
+  }
+  int format5 = FormatOf(state, format) == 5;
+  uint32_t time = GPSTime(payload, FormatOf(state, format));
+  uint16_t speed = format5 ? LOAD16(payload, GPS5, speed) :
+                             LOAD16(payload, GPS, speed);
+  int match = !filter->has_heart_rate && InWindow(filter, time) &&
+              (filter->lap < 0 || filter->lap == state->lap) &&
+              (!filter->has_speed ||
+               (speed >= filter->min_speed && speed <= filter->max_speed));
+  if (!match && format5 && time != 0xffffffff) {
+    state->cum_distance += LOAD16(payload, GPS5, inc_distance) * 0.1f;
+  }
+  return match;
+}
+
+// Handles a complete record, whose tag is at offset in the file.
+static ALWAYS_INLINE void HandleRecord(uint8_t tag, const uint8_t* payload,
+                                       int length, size_t offset,
+                                       ParserState* state,
+                                       const TTBinVisitor* visitor,
+                                       int format) {
+  STATS_RECORD(tag, length);
+  if (visitor->corrupt && tag == 0x22 && length >= RecordSize(0x22)) {
+    UpdateLastTime(state, GPSTime(payload, FormatOf(state, format)));
+  }
+  if (visitor->record) {
+    visitor->record(visitor->context, tag, offset);
+  }
+  if (state->filter && !Matches(tag, payload, length, state, format)) {
+    return;
+  }
+  if (state->wanted[tag]) {
+    if (tag == 0x16 && length >= (int)sizeof(RecordLengths)) {
+      ReadRecordLengths(&state->lengths, (const RecordLengths*)payload);
+    }
+    Dispatch(tag, payload, length, state, visitor, format);
+  }
+}
+
+// Parses the complete records at the start of data, as format. Stops
+// after a header or a length table, which may change the format or the
+// lengths, and sets *more. Returns the number of bytes consumed.
+static ALWAYS_INLINE size_t ParseLoop(const uint8_t* data, size_t size,
+                                      size_t base, ParserState* state,
+                                      const TTBinVisitor* visitor,
+                                      int format, int* more) {
+  *more = 0;
+  size_t offset = 0;
+  while (offset < size) {
+    uint8_t tag = data[offset];
+    int length = state->lengths.length[tag];
+    if (length < 0) {
+      STATS_UNKNOWN_TAG();
+      FlushSpans(state, visitor);
+      if (visitor->unknown_tag) {
+        visitor->unknown_tag(visitor->context, tag, base + offset);
+      }
+      if (visitor->corrupt) {
+        offset = Resync(data, size, offset, state, base, visitor);
+      } else {
+        ++offset;
+      }
+      continue;
+    }
+    if (size - offset - 1 < (size_t)length) {
+      break;
+    }
+    if (visitor->corrupt && tag == 0x22 && length >= RecordSize(0x22) &&
+        !PlausibleTime(GPSTime(data + offset + 1, FormatOf(state, format)),
+                       state->last_time)) {
+      FlushSpans(state, visitor);
+      offset = Resync(data, size, offset, state, base, visitor);
+      continue;
+    }
+    HandleRecord(tag, data + offset + 1, length, base + offset, state,
+                 visitor, format);
+    offset += 1 + length;
+    if (tag == 0x20 || tag == 0x16) {
+      *more = offset < size;
+      break;
+    }
+  }
+  return offset;
+}
+
+static size_t ParseFormat5(const uint8_t* data, size_t size, size_t base,
+                           ParserState* state, const TTBinVisitor* visitor,
+                           int* more) {
+  return ParseLoop(data, size, base, state, visitor, 5, more);
+}
+
+static size_t ParseFormat7(const uint8_t* data, size_t size, size_t base,
+                           ParserState* state, const TTBinVisitor* visitor,
+                           int* more) {
+  return ParseLoop(data, size, base, state, visitor, 7, more);
+}
+
+static size_t ParseAnyFormat(const uint8_t* data, size_t size, size_t base,
+                             ParserState* state, const TTBinVisitor* visitor,
+                             int* more) {
+  return ParseLoop(data, size, base, state, visitor, ANY_FORMAT, more);
+}
+
+// Parses the complete records at the start of data, base is the offset of
+// data in the file. Returns the number of bytes consumed, less than size
+// if the last record is cut. The loop is chosen again after each header or
+// length table, so usually twice per file.
+static size_t ParseRecords(const uint8_t* data, size_t size, size_t base,
+                           ParserState* state, const TTBinVisitor* visitor) {
+  size_t offset = 0;
+  int more = 1;
+  while (more) {
+    int format = state->file_format;
+    size_t (*parse)(const uint8_t*, size_t, size_t, ParserState*,
+                    const TTBinVisitor*, int*) = ParseAnyFormat;
+    if (format == 5) {
+      parse = ParseFormat5;
+    } else if (format == 7) {
+      parse = ParseFormat7;
+    }
+    offset += parse(data + offset, size - offset, base + offset, state,
+                    visitor, &more);
+  }
+  return offset;
+}
+
+// Result of a parse that consumed consumed bytes out of size.
+static int ParseResult(size_t consumed, size_t size, size_t base,
+                       const TTBinVisitor* visitor) {
+  if (consumed == size) {
+    return 0;
+  }
+  if (visitor->corrupt) {
+    STATS_CORRUPT(size - consumed);
+    visitor->corrupt(visitor->context, base + consumed, size - consumed);
+    return 0;
+  }
+  return -1;
+}
+
+int ParseTTBin(const uint8_t* data, size_t size, const TTBinVisitor* visitor) {
+  STATS_BEGIN(outer, PHASE_DECODE);
+  ParserState state;
+  InitParserState(visitor, &state);
+  size_t consumed = ParseRecords(data, size, 0, &state, visitor);
+  FlushSpans(&state, visitor);
+  int result = ParseResult(consumed, size, 0, visitor);
+  STATS_END(outer);
+  return result;
+}
+
+int ParseTTBinRange(const uint8_t* data, const TTBinRange* range,
+                    const TTBinVisitor* visitor) {
+  ParserState state;
+  InitParserState(visitor, &state);
+  if (range->lengths != NULL) {
+    state.lengths = *range->lengths;
+  }
+  state.file_format = range->file_format;
+  state.cum_distance = range->cum_distance;
+  state.filter = range->filter;
+  state.lap = range->lap;
+  size_t size = range->end - range->begin;
+  STATS_BEGIN(outer, PHASE_DECODE);
+  size_t consumed = ParseRecords(data + range->begin, size, range->begin,
+                                 &state, visitor);
+  FlushSpans(&state, visitor);
+  int result = ParseResult(consumed, size, range->begin, visitor);
+  STATS_END(outer);
+  return result;
+}
+
+static void CopySummary(Summary* summary, const uint8_t* payload) {
+  memcpy(summary, payload, sizeof(Summary));
+  if (TTBIN_BIG_ENDIAN) {
+    SwapRecord(0x27, (uint8_t*)summary);
+  }
+}
+
+// Rejects a trailing 0x27 byte that doesn't start a summary.
+static int PlausibleSummary(const Summary* summary) {
+  return summary->activity_type < 256 && summary->duration < 1000000;
+}
+
+int ReadTTBinSummary(const uint8_t* data, size_t size, Header* header,
+                     Summary* summary) {
+  size_t offset = 1 + sizeof(Header);
+  if (size < offset || data[0] != 0x20) {
+    return -1;
+  }
+  memcpy(header, data + 1, sizeof(Header));
+  if (TTBIN_BIG_ENDIAN) {
+    SwapRecord(0x20, (uint8_t*)header);
+  }
+  STATS_HEADER(header);
+  RecordLengthTable lengths;
+  InitRecordLengths(&lengths);
+  if (size - offset > sizeof(RecordLengths) && data[offset] == 0x16) {
+    ReadRecordLengths(&lengths, (const RecordLengths*)(data + offset + 1));
+  }
+  int length = lengths.length[0x27];
+  if (length < (int)sizeof(Summary)) {
+    return -1;
+  }
+  if (size - offset >= 1 + (size_t)length &&
+      data[size - 1 - length] == 0x27) {
+    CopySummary(summary, data + size - length);
+    if (PlausibleSummary(summary)) {
+      return 0;
+    }
+  }
+  // Not at the end, skip the records up to it.
+  while (offset < size) {
+    uint8_t tag = data[offset];
+    length = lengths.length[tag];
+    if (length < 0) {
+      ++offset;
+      continue;
+    }
+    if (size - offset - 1 < (size_t)length) {
+      break;
+    }
+    if (tag == 0x27 && length >= (int)sizeof(Summary)) {
+      CopySummary(summary, data + offset + 1);
+      return 0;
+    }
+    if (tag == 0x16 && length >= (int)sizeof(RecordLengths)) {
+      ReadRecordLengths(&lengths, (const RecordLengths*)(data + offset + 1));
+    }
+    offset += 1 + length;
+  }
+  return -1;
+}
+
+void InitTTBinStream(TTBinStream* stream, const TTBinVisitor* visitor) {
+  InitParserState(visitor, &stream->state);
+  stream->visitor = visitor;
+  stream->offset = 0;
+  stream->pending_size = 0;
+}
+
+void FeedTTBinStream(TTBinStream* stream, const uint8_t* data, size_t size) {
+  STATS_BEGIN(outer, PHASE_DECODE);
+  ParserState* state = &stream->state;
+  while (size > 0) {
+    if (stream->pending_size > 0) {
+      // Complete the record cut by the previous chunk.
+      uint8_t tag = stream->pending[0];
+      size_t total = 1 + state->lengths.length[tag];
+      size_t count = total - stream->pending_size;
+      if (count > size) {
+        count = size;
+      }
+      memcpy(stream->pending + stream->pending_size, data, count);
+      stream->pending_size += count;
+      data += count;
+      size -= count;
+      if (stream->pending_size < total) {
+        break;
+      }
+      HandleRecord(tag, stream->pending + 1, total - 1, stream->offset,
+                   state, stream->visitor, ANY_FORMAT);
+      stream->offset += total;
+      stream->pending_size = 0;
+      continue;
+    }
+    // Records entirely in the chunk are parsed in place.
+    size_t consumed = ParseRecords(data, size, stream->offset, state,
+                                   stream->visitor);
+    stream->offset += consumed;
+    data += consumed;
+    size -= consumed;
+    if (size > 0) {
+      memcpy(stream->pending, data, size);
+      stream->pending_size = size;
+      break;
+    }
+  }
+  FlushSpans(state, stream->visitor);
+  STATS_END(outer);
+}
+
+int FinishTTBinStream(TTBinStream* stream) {
+  return ParseResult(0, stream->pending_size, stream->offset,
+                     stream->visitor);
+}
+
+static int ReadRecords(FILE* f, ParserState* state,
+                       const TTBinVisitor* visitor) {
+  uint8_t buffer[65536];
+  size_t offset = 0;
+  while(!feof(f)) {
+    if (fread(buffer, 1, 1, f) < 1) {
+      return ferror(f) ? -1 : 0;
+    }
+    uint8_t tag = buffer[0];
+    int size = state->lengths.length[tag];
+    if (size < 0) {
+      STATS_UNKNOWN_TAG();
+      FlushSpans(state, visitor);
+      if (visitor->unknown_tag) {
+        visitor->unknown_tag(visitor->context, tag, offset);
+      }
+      ++offset;
+      continue;
+    }
+    STATS_RECORD(tag, size);
+    if (visitor->record) {
+      visitor->record(visitor->context, tag, offset);
+    }
+    if (!state->wanted[tag]) {
+      if (fseek(f, size, SEEK_CUR) != 0) {
+        // Not seekable, read the payload anyway.
+        if (fread(buffer, 1, size, f) != size) {
+          return -1;
+        }
+      }
+    } else {
+      if (fread(buffer, 1, size, f) != size) {
+        return -1;
+      }
+      if (tag == 0x16 && size >= (int)sizeof(RecordLengths)) {
+        ReadRecordLengths(&state->lengths, (const RecordLengths*)buffer);
+      }
+      Dispatch(tag, buffer, size, state, visitor, ANY_FORMAT);
+    }
+    offset += 1 + size;
+  }
+  return 0;
+}
+
+int ParseTTBinFile(FILE* f, const TTBinVisitor* visitor) {
+  STATS_BEGIN(outer, PHASE_DECODE);
+  ParserState state;
+  InitParserState(visitor, &state);
+  int result = ReadRecords(f, &state, visitor);
+  // Also on error, for the records read until then.
+  FlushSpans(&state, visitor);
+  STATS_END(outer);
+  return result;
+}
+
+static int ReadWholeFile(int fd, InputFile* input) {
+  size_t capacity = 1 << 16;
+  size_t size = 0;
+  uint8_t* data = malloc(capacity);
+  while (data != NULL) {
+    if (size == capacity) {
+      uint8_t* grown = realloc(data, 2 * capacity);
+      if (grown == NULL) {
+        break;
+      }
+      data = grown;
+      capacity *= 2;
+    }
+    ssize_t count = read(fd, data + size, capacity - size);
+    if (count < 0) {
+      break;
+    }
+    if (count == 0) {
+      input->data = data;
+      input->size = size;
+      input->mapped = 0;
+      return 0;
+    }
+    size += count;
+  }
+  free(data);
+  return -1;
+}
+
+static int OpenInput(const char* filename, InputFile* input) {
+  int fd = open(filename, O_RDONLY);
+  if (fd < 0) {
+    return -1;
+  }
+  int result = 0;
+  struct stat st;
+  if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+    void* data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data != MAP_FAILED) {
+      posix_madvise(data, st.st_size, POSIX_MADV_SEQUENTIAL);
+      input->data = data;
+      input->size = st.st_size;
+      input->mapped = 1;
+    } else {
+      result = ReadWholeFile(fd, input);
+    }
+  } else {
+    result = ReadWholeFile(fd, input);
+  }
+  close(fd);
+  return result;
+}
+
+int OpenInputFile(const char* filename, InputFile* input) {
+  STATS_FILE();
+  STATS_BEGIN(outer, PHASE_IO);
+  int result = OpenInput(filename, input);
+  STATS_END(outer);
+  return result;
+}
+
+void CloseInputFile(InputFile* input) {
+  if (input->mapped) {
+    munmap((void*)input->data, input->size);
+  } else {
+    free((void*)input->data);
+  }
+  input->data = NULL;
+  input->size = 0;
+}
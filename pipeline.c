@@ -0,0 +1,532 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "pipeline.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "export.h"
+#include "instrument.h"
+#include "ring.h"
+#include "ttbin.h"
+
+typedef enum {
+  EVENT_HEADER,
+  EVENT_GPS,
+  EVENT_HEART_RATE,
+  EVENT_LAP,
+  EVENT_SUMMARY,
+} EventType;
+
+// The records the transform needs, in file order.
+typedef struct {
+  EventType type;
+  union {
+    int32_t local_time_offset;
+    GPSSample gps;
+    HeartRateSample heart;
+    Lap lap;
+    uint32_t activity_type;
+  } u;
+} Event;
+
+typedef struct {
+  size_t count;
+  int last;  // End of the stream.
+  Event items[PIPELINE_BATCH];
+} EventBatch;
+
+typedef struct {
+  size_t count;
+  int last;
+  CSVRow items[PIPELINE_BATCH];
+} RowBatch;
+
+// Filled batches one way, emptied ones back, so the batches in flight are
+// allocated once.
+typedef struct {
+  Ring full;
+  Ring free;
+  char* batches;
+} Link;
+
+static int InitLink(Link* link, size_t batch_size) {
+  int failed = InitRing(&link->full, PIPELINE_DEPTH) < 0;
+  failed |= InitRing(&link->free, PIPELINE_DEPTH) < 0;
+  link->batches = malloc(PIPELINE_DEPTH * batch_size);
+  if (failed || link->batches == NULL) {
+    return -1;
+  }
+  for (int i = 0; i < PIPELINE_DEPTH; ++i) {
+    PushRing(&link->free, link->batches + i * batch_size);
+  }
+  return 0;
+}
+
+static void FreeLink(Link* link) {
+  FreeRing(&link->full);
+  FreeRing(&link->free);
+  free(link->batches);
+}
+
+// Growable queue of items of one size.
+typedef struct {
+  char* data;
+  size_t item_size;
+  size_t head;
+  size_t count;
+  size_t capacity;
+} Fifo;
+
+static void InitFifo(Fifo* f, size_t item_size) {
+  memset(f, 0, sizeof(*f));
+  f->item_size = item_size;
+}
+
+static void* FifoAt(const Fifo* f, size_t i) {
+  return f->data + (f->head + i) % f->capacity * f->item_size;
+}
+
+static int PushFifo(Fifo* f, const void* item) {
+  if (f->count == f->capacity) {
+    size_t capacity = f->capacity ? 2 * f->capacity : 256;
+    char* data = malloc(capacity * f->item_size);
+    if (data == NULL) {
+      return -1;
+    }
+    for (size_t i = 0; i < f->count; ++i) {
+      memcpy(data + i * f->item_size, FifoAt(f, i), f->item_size);
+    }
+    free(f->data);
+    f->data = data;
+    f->head = 0;
+    f->capacity = capacity;
+  }
+  memcpy(FifoAt(f, f->count), item, f->item_size);
+  ++f->count;
+  return 0;
+}
+
+static void PopFifo(Fifo* f) {
+  f->head = (f->head + 1) % f->capacity;
+  --f->count;
+}
+
+static void FreeFifo(Fifo* f) {
+  free(f->data);
+  f->data = NULL;
+}
+
+// Decoding stage.
+
+typedef struct {
+  const uint8_t* data;
+  size_t size;
+  Link* link;
+  EventBatch* batch;
+  size_t corrupt_bytes;
+} Decoder;
+
+static Event* NextEvent(Decoder* d, EventType type) {
+  if (d->batch->count == PIPELINE_BATCH) {
+    PushRing(&d->link->full, d->batch);
+    d->batch = PopRing(&d->link->free);
+    d->batch->count = 0;
+    d->batch->last = 0;
+  }
+  Event* e = &d->batch->items[d->batch->count++];
+  e->type = type;
+  return e;
+}
+
+static void OnHeader(void* context, const Header* header) {
+  NextEvent(context, EVENT_HEADER)->u.local_time_offset =
+      header->local_time_offset;
+}
+
+static void OnGPS(void* context, const GPSSample* gps) {
+  if (gps->time != 0xffffffff) {
+    NextEvent(context, EVENT_GPS)->u.gps = *gps;
+  }
+}
+
+static void OnHeartRate(void* context, const HeartRateSample* heart) {
+  NextEvent(context, EVENT_HEART_RATE)->u.heart = *heart;
+}
+
+static void OnLap(void* context, const Lap* lap) {
+  NextEvent(context, EVENT_LAP)->u.lap = *lap;
+}
+
+static void OnSummary(void* context, const Summary* summary) {
+  NextEvent(context, EVENT_SUMMARY)->u.activity_type =
+      summary->activity_type;
+}
+
+static void OnCorrupt(void* context, size_t offset, size_t size) {
+  Decoder* d = context;
+  d->corrupt_bytes += size;
+}
+
+static const TTBinVisitor kDecoder = {
+  .header = OnHeader,
+  .gps = OnGPS,
+  .heart_rate = OnHeartRate,
+  .lap = OnLap,
+  .summary = OnSummary,
+  .corrupt = OnCorrupt,
+};
+
+static void* DecodeMain(void* argument) {
+  Decoder* d = argument;
+  d->batch = PopRing(&d->link->free);
+  d->batch->count = 0;
+  d->batch->last = 0;
+  TTBinVisitor visitor = kDecoder;
+  visitor.context = d;
+  // Never fails, damaged data is skipped.
+  ParseTTBin(d->data, d->size, &visitor);
+  d->batch->last = 1;
+  PushRing(&d->link->full, d->batch);
+  STATS_MERGE();
+  return NULL;
+}
+
+// Transform stage: the heart rate join and the lap numbers of WriteCSV(),
+// then the moving average of SmoothActivity(), as the records come.
+
+typedef struct {
+  CSVRow row;
+  int untyped;  // Before the first lap, gets the type of the summary.
+} Sample;
+
+typedef struct {
+  const PipelineOptions* options;
+  Link* in;
+  Link* out;
+  RowBatch* batch;
+  int failed;
+  int ended;          // All the records are in.
+  int64_t watermark;  // Latest local time seen.
+
+  int32_t offset;
+  int has_summary;
+  uint32_t summary_type;
+  int has_first;
+  uint32_t first_time;
+
+  Fifo gps;     // Samples waiting for the records around them.
+  Fifo hearts;  // Readings after the samples done.
+  Fifo laps;
+  int has_last;
+  HeartRateSample last;  // Last non zero reading up to the samples done.
+  int typed;       // A lap record was applied.
+  uint32_t activity_type;
+  int lap_number;
+
+  size_t half;      // Of the smoothing window, 0 = none.
+  Fifo window;      // Unsmoothed samples from window_first.
+  size_t window_first;
+  size_t received;  // Samples into the smoothing so far.
+  size_t smoothed;  // And out of it.
+  int64_t sums[3];  // Latitude, longitude and speed over the window.
+
+  Fifo held;  // Samples waiting for the summary, with the ones after.
+} Transformer;
+
+static void Emit(Transformer* t, const CSVRow* row) {
+  if (t->batch->count == PIPELINE_BATCH) {
+    PushRing(&t->out->full, t->batch);
+    t->batch = PopRing(&t->out->free);
+    t->batch->count = 0;
+    t->batch->last = 0;
+  }
+  t->batch->items[t->batch->count++] = *row;
+}
+
+static void Release(Transformer* t) {
+  for (; t->held.count > 0; PopFifo(&t->held)) {
+    Sample* s = FifoAt(&t->held, 0);
+    if (s->untyped) {
+      s->row.activity_type = t->has_summary ? t->summary_type : 0;
+    }
+    Emit(t, &s->row);
+  }
+}
+
+static void Hold(Transformer* t, const Sample* s) {
+  if (t->held.count > 0 || (s->untyped && !t->has_summary && !t->ended)) {
+    if (PushFifo(&t->held, s) < 0) {
+      t->failed = 1;
+    }
+    return;
+  }
+  Sample typed = *s;
+  if (typed.untyped) {
+    typed.row.activity_type = t->has_summary ? t->summary_type : 0;
+  }
+  Emit(t, &typed.row);
+}
+
+// Rounded mean of count values, as SmoothActivity().
+static int64_t Mean(int64_t sum, int64_t count) {
+  return sum < 0 ? (sum - count / 2) / count : (sum + count / 2) / count;
+}
+
+static void AddToWindow(Transformer* t, const Sample* s, int sign) {
+  t->sums[0] += sign * (int64_t)s->row.latitude;
+  t->sums[1] += sign * (int64_t)s->row.longitude;
+  t->sums[2] += sign * (int64_t)s->row.speed;
+}
+
+// Smooths the sample i, whose window [i - half, i + half] is in.
+static void SmoothSample(Transformer* t, size_t i) {
+  while (t->window_first + t->half < i) {
+    AddToWindow(t, FifoAt(&t->window, 0), -1);
+    PopFifo(&t->window);
+    ++t->window_first;
+  }
+  Sample s = *(Sample*)FifoAt(&t->window, i - t->window_first);
+  int64_t count = t->window.count;
+  s.row.latitude = Mean(t->sums[0], count);
+  s.row.longitude = Mean(t->sums[1], count);
+  s.row.speed = Mean(t->sums[2], count);
+  Hold(t, &s);
+  ++t->smoothed;
+}
+
+static void Smooth(Transformer* t, const Sample* s) {
+  if (t->half == 0) {
+    Hold(t, s);
+    return;
+  }
+  if (PushFifo(&t->window, s) < 0) {
+    t->failed = 1;
+    return;
+  }
+  AddToWindow(t, s, 1);
+  if (++t->received > t->half) {
+    SmoothSample(t, t->received - 1 - t->half);
+  }
+}
+
+// Applies the laps and readings that come before local.
+static void Advance(Transformer* t, uint32_t local) {
+  while (t->laps.count > 0) {
+    const Lap* lap = FifoAt(&t->laps, 0);
+    if (lap->time >= local) {
+      break;
+    }
+    t->lap_number = lap->lap > 0 ? lap->lap : 1;
+    t->activity_type = lap->activity;
+    t->typed = 1;
+    PopFifo(&t->laps);
+  }
+  while (t->hearts.count > 0) {
+    const HeartRateSample* heart = FifoAt(&t->hearts, 0);
+    if (heart->time > local) {
+      break;
+    }
+    if (heart->heart_rate != 0) {
+      t->last = *heart;
+      t->has_last = 1;
+    }
+    PopFifo(&t->hearts);
+  }
+}
+
+// Turns the oldest waiting sample into a row, unless records it depends
+// on may still come. Returns 0 in that case.
+static int Finish(Transformer* t) {
+  const GPSSample* gps = FifoAt(&t->gps, 0);
+  uint32_t local = gps->time + t->offset;
+  if (!t->ended && (int64_t)local + PIPELINE_SLACK >= t->watermark) {
+    return 0;
+  }
+  Advance(t, local);
+  uint8_t heart_rate = 0;
+  if (t->has_last) {
+    uint32_t before = local - t->last.time;
+    int next = -1;
+    uint32_t span = 0;
+    if (t->options->join.policy == JOIN_INTERPOLATE && before > 0) {
+      size_t i = 0;
+      while (i < t->hearts.count &&
+             ((HeartRateSample*)FifoAt(&t->hearts, i))->heart_rate == 0) {
+        ++i;
+      }
+      if (i < t->hearts.count) {
+        const HeartRateSample* after = FifoAt(&t->hearts, i);
+        next = after->heart_rate;
+        span = after->time - t->last.time;
+      } else if (!t->ended) {
+        return 0;
+      }
+    }
+    heart_rate = JoinReadings(&t->options->join, before,
+                              t->last.heart_rate, next, span);
+  }
+  if (!t->has_first) {
+    t->first_time = gps->time;
+    t->has_first = 1;
+  }
+  Sample s = {
+    {
+      gps->time - t->first_time, t->typed ? t->activity_type : 0,
+      t->typed ? t->lap_number : 1, gps->inc_distance, gps->speed,
+      gps->calories, gps->latitude, gps->longitude, heart_rate, gps->cycles
+    },
+    !t->typed
+  };
+  PopFifo(&t->gps);
+  Smooth(t, &s);
+  return 1;
+}
+
+static void Drain(Transformer* t) {
+  while (t->gps.count > 0 && Finish(t)) {
+  }
+  if (t->gps.count == 0 && t->watermark > PIPELINE_SLACK + 1) {
+    // Without samples the records would pile up: the next sample comes
+    // after these.
+    Advance(t, t->watermark - PIPELINE_SLACK - 1);
+  }
+}
+
+static int64_t Later(int64_t a, int64_t b) {
+  return a > b ? a : b;
+}
+
+static void Take(Transformer* t, const Event* e) {
+  switch (e->type) {
+    case EVENT_HEADER:
+      t->offset = e->u.local_time_offset;
+      break;
+    case EVENT_GPS:
+      t->watermark = Later(t->watermark, (uint32_t)(e->u.gps.time +
+                                                    t->offset));
+      if (PushFifo(&t->gps, &e->u.gps) < 0) {
+        t->failed = 1;
+      }
+      break;
+    case EVENT_HEART_RATE:
+      t->watermark = Later(t->watermark, e->u.heart.time);
+      if (PushFifo(&t->hearts, &e->u.heart) < 0) {
+        t->failed = 1;
+      }
+      break;
+    case EVENT_LAP:
+      t->watermark = Later(t->watermark, e->u.lap.time);
+      if (PushFifo(&t->laps, &e->u.lap) < 0) {
+        t->failed = 1;
+      }
+      break;
+    case EVENT_SUMMARY:
+      t->has_summary = 1;
+      t->summary_type = e->u.activity_type;
+      Release(t);
+      break;
+  }
+}
+
+static void* TransformMain(void* argument) {
+  Transformer* t = argument;
+  t->batch = PopRing(&t->out->free);
+  t->batch->count = 0;
+  t->batch->last = 0;
+  while (!t->ended) {
+    EventBatch* in = PopRing(&t->in->full);
+    for (size_t i = 0; i < in->count; ++i) {
+      Take(t, &in->items[i]);
+    }
+    t->ended = in->last;
+    PushRing(&t->in->free, in);
+    Drain(t);
+  }
+  while (t->smoothed < t->received) {
+    SmoothSample(t, t->smoothed);
+  }
+  Release(t);
+  t->batch->last = 1;
+  PushRing(&t->out->full, t->batch);
+  STATS_MERGE();
+  return NULL;
+}
+
+int PipelineCSV(const uint8_t* data, size_t size,
+                const PipelineOptions* options, FILE* out,
+                size_t* corrupt_bytes) {
+  Link events;
+  Link rows;
+  int result = InitLink(&events, sizeof(EventBatch));
+  if (InitLink(&rows, sizeof(RowBatch)) < 0) {
+    result = -1;
+  }
+  Decoder d = { data, size, &events, NULL, 0 };
+  Transformer t;
+  memset(&t, 0, sizeof(t));
+  t.options = options;
+  t.in = &events;
+  t.out = &rows;
+  t.half = options->smooth >= 2 ? options->smooth / 2 : 0;
+  InitFifo(&t.gps, sizeof(GPSSample));
+  InitFifo(&t.hearts, sizeof(HeartRateSample));
+  InitFifo(&t.laps, sizeof(Lap));
+  InitFifo(&t.window, sizeof(Sample));
+  InitFifo(&t.held, sizeof(Sample));
+
+  pthread_t transformer;
+  pthread_t decoder;
+  if (result < 0 ||
+      pthread_create(&transformer, NULL, TransformMain, &t) != 0) {
+    FreeLink(&events);
+    FreeLink(&rows);
+    return -1;
+  }
+  int decoding = pthread_create(&decoder, NULL, DecodeMain, &d) == 0;
+  if (!decoding) {
+    // Ends the stream right away for the transform to stop.
+    EventBatch* end = PopRing(&events.free);
+    end->count = 0;
+    end->last = 1;
+    PushRing(&events.full, end);
+    result = -1;
+  }
+
+  CSVWriter* w = OpenCSVWriter(out);
+  if (w == NULL) {
+    result = -1;
+  }
+  // Keeps taking the rows after a failure so that the other stages end.
+  for (;;) {
+    RowBatch* batch = PopRing(&rows.full);
+    if (w != NULL) {
+      WriteCSVRows(w, batch->items, batch->count);
+    }
+    int last = batch->last;
+    PushRing(&rows.free, batch);
+    if (last) {
+      break;
+    }
+  }
+  if (w != NULL && CloseCSVWriter(w) < 0) {
+    result = -1;
+  }
+  pthread_join(transformer, NULL);
+  if (decoding) {
+    pthread_join(decoder, NULL);
+  }
+  if (t.failed) {
+    result = -1;
+  }
+  *corrupt_bytes = d.corrupt_bytes;
+  FreeFifo(&t.gps);
+  FreeFifo(&t.hearts);
+  FreeFifo(&t.laps);
+  FreeFifo(&t.window);
+  FreeFifo(&t.held);
+  FreeLink(&events);
+  FreeLink(&rows);
+  return result;
+}
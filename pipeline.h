@@ -0,0 +1,40 @@
+#ifndef PIPELINE_H
+#define PIPELINE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "join.h"
+
+// CSV export of one file on three threads, so that a very large file
+// uses more than one core: a decoder hands the records to a transform
+// stage (heart rate join, lap numbers, smoothing), which hands the rows
+// to the writer, in the calling thread. The stages are linked by rings
+// of PIPELINE_DEPTH batches of PIPELINE_BATCH items and wait on each
+// other when a ring is full, so a slow output holds back the decoding
+// instead of piling up rows.
+//
+// The output is the one of WriteCSV() on the decoded activity, smoothed
+// as SmoothActivity() would. It relies on the records being written in
+// time order, as the watches do, give or take PIPELINE_SLACK seconds.
+// Rows wait in the transform stage for what they depend on: the next
+// reading to interpolate the heart rate, and the summary for the samples
+// before the first lap record, if any.
+#define PIPELINE_BATCH 1024
+#define PIPELINE_DEPTH 8
+#define PIPELINE_SLACK 4
+
+typedef struct {
+  JoinOptions join;
+  int smooth;  // Window in samples, 0 = none.
+} PipelineOptions;
+
+// Exports the .ttbin file held in data. The number of bytes skipped as
+// corrupt goes to corrupt_bytes. Returns 0 on success, -1 on write or
+// allocation error or when a thread can't be started.
+int PipelineCSV(const uint8_t* data, size_t size,
+                const PipelineOptions* options, FILE* out,
+                size_t* corrupt_bytes);
+
+#endif  // PIPELINE_H
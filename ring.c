@@ -0,0 +1,99 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "ring.h"
+
+#include <stdlib.h>
+
+// Tries before sleeping.
+#define RING_SPINS 256
+
+int InitRing(Ring* ring, size_t capacity) {
+  size_t size = 1;
+  while (size < capacity) {
+    size *= 2;
+  }
+  ring->slots = malloc(size * sizeof(void*));
+  ring->mask = size - 1;
+  ring->head = 0;
+  ring->tail = 0;
+  ring->waiters = 0;
+  pthread_mutex_init(&ring->lock, NULL);
+  pthread_cond_init(&ring->cond, NULL);
+  return ring->slots == NULL ? -1 : 0;
+}
+
+void FreeRing(Ring* ring) {
+  free(ring->slots);
+  ring->slots = NULL;
+  pthread_mutex_destroy(&ring->lock);
+  pthread_cond_destroy(&ring->cond);
+}
+
+int TryPushRing(Ring* ring, void* item) {
+  size_t tail = ring->tail;
+  size_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+  if (tail - head > ring->mask) {
+    return -1;
+  }
+  ring->slots[tail & ring->mask] = item;
+  // Publishes the slot along with the index.
+  __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+  return 0;
+}
+
+void* TryPopRing(Ring* ring) {
+  size_t head = ring->head;
+  size_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+  if (head == tail) {
+    return NULL;
+  }
+  void* item = ring->slots[head & ring->mask];
+  __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+  return item;
+}
+
+// After a push or pop. waiters is read with a read-modify-write so that
+// it is ordered with the increment of the waiting side, which tries again
+// after it: either that try sees the new index or this sees the waiter.
+static void WakeRing(Ring* ring) {
+  if (__atomic_fetch_add(&ring->waiters, 0, __ATOMIC_SEQ_CST) > 0) {
+    pthread_mutex_lock(&ring->lock);
+    pthread_cond_broadcast(&ring->cond);
+    pthread_mutex_unlock(&ring->lock);
+  }
+}
+
+void PushRing(Ring* ring, void* item) {
+  int pushed = 0;
+  for (int spins = 0; !pushed && spins < RING_SPINS; ++spins) {
+    pushed = TryPushRing(ring, item) == 0;
+  }
+  if (!pushed) {
+    pthread_mutex_lock(&ring->lock);
+    __atomic_fetch_add(&ring->waiters, 1, __ATOMIC_SEQ_CST);
+    while (TryPushRing(ring, item) < 0) {
+      pthread_cond_wait(&ring->cond, &ring->lock);
+    }
+    __atomic_fetch_sub(&ring->waiters, 1, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&ring->lock);
+  }
+  WakeRing(ring);
+}
+
+void* PopRing(Ring* ring) {
+  void* item = NULL;
+  for (int spins = 0; item == NULL && spins < RING_SPINS; ++spins) {
+    item = TryPopRing(ring);
+  }
+  if (item == NULL) {
+    pthread_mutex_lock(&ring->lock);
+    __atomic_fetch_add(&ring->waiters, 1, __ATOMIC_SEQ_CST);
+    while ((item = TryPopRing(ring)) == NULL) {
+      pthread_cond_wait(&ring->cond, &ring->lock);
+    }
+    __atomic_fetch_sub(&ring->waiters, 1, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&ring->lock);
+  }
+  WakeRing(ring);
+  return item;
+}
@@ -0,0 +1,40 @@
+#ifndef RING_H
+#define RING_H
+
+#include <pthread.h>
+#include <stddef.h>
+
+// Bounded queue of pointers between one producer thread and one consumer
+// thread, without locks: each side only writes its own index. The indices
+// are on their own cache lines so that the two sides don't share one.
+typedef struct {
+  void** slots;
+  size_t mask;  // Capacity - 1, the capacity is a power of two.
+  char pad1[64];
+  size_t head;  // Next slot to pop, written by the consumer.
+  char pad2[64];
+  size_t tail;  // Next slot to push, written by the producer.
+  char pad3[64];
+  // Where a side that spun in vain sleeps, woken by the other side only
+  // when waiters isn't 0.
+  int waiters;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+} Ring;
+
+// capacity is rounded up to a power of two. Returns -1 on allocation
+// failure.
+int InitRing(Ring* ring, size_t capacity);
+void FreeRing(Ring* ring);
+
+// Return 0 (push) or NULL (pop) when the ring is full or empty.
+int TryPushRing(Ring* ring, void* item);
+void* TryPopRing(Ring* ring);
+
+// Wait until there is room or an item: spin a little, then sleep until
+// the other side pops or pushes, so that a slow consumer (a pipe...)
+// doesn't leave the producers burning a core each.
+void PushRing(Ring* ring, void* item);
+void* PopRing(Ring* ring);
+
+#endif  // RING_H
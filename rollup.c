@@ -0,0 +1,342 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "rollup.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "activity.h"
+#include "archive.h"
+#include "batch.h"
+
+void InitRollup(Rollup* rollup, RollupPeriod by) {
+  rollup->by = by;
+  rollup->entries = NULL;
+  rollup->count = 0;
+  rollup->capacity = 0;
+  rollup->failed = 0;
+}
+
+void FreeRollup(Rollup* rollup) {
+  free(rollup->entries);
+  InitRollup(rollup, rollup->by);
+}
+
+static int64_t FloorDiv(int64_t a, int64_t b) {
+  return a / b - (a % b < 0);
+}
+
+static int64_t Period(uint32_t timestamp, RollupPeriod by) {
+  if (by == ROLLUP_WEEK) {
+    // 1970-01-01 was a Thursday.
+    return FloorDiv(FloorDiv(timestamp, 86400) - 4, 7);
+  }
+  time_t t = timestamp;
+  struct tm tm;
+  gmtime_r(&t, &tm);
+  return (int64_t)(tm.tm_year - 70) * 12 + tm.tm_mon;
+}
+
+typedef struct {
+  int has_header;
+  int has_summary;
+  Header header;
+  Summary summary;
+  uint64_t heart_sum;
+  uint64_t heart_count;
+  uint8_t max_heart_rate;
+} RollupReader;
+
+static void OnHeader(void* context, const Header* header) {
+  RollupReader* r = context;
+  r->header = *header;
+  r->has_header = 1;
+}
+
+static void OnSummary(void* context, const Summary* summary) {
+  RollupReader* r = context;
+  r->summary = *summary;
+  r->has_summary = 1;
+}
+
+static void AddReading(RollupReader* r, uint8_t heart_rate) {
+  if (heart_rate != 0) {
+    r->heart_sum += heart_rate;
+    ++r->heart_count;
+    if (heart_rate > r->max_heart_rate) {
+      r->max_heart_rate = heart_rate;
+    }
+  }
+}
+
+static void OnHeartRateSpan(void* context, const HeartRateSample* hearts,
+                            size_t count) {
+  RollupReader* r = context;
+  for (size_t i = 0; i < count; ++i) {
+    AddReading(r, hearts[i].heart_rate);
+  }
+}
+
+// Damaged files still count, with what could be read.
+static void OnCorrupt(void* context, size_t offset, size_t size) {
+}
+
+static const TTBinVisitor kRollupReader = {
+  .header = OnHeader,
+  .summary = OnSummary,
+  .heart_rate_span = OnHeartRateSpan,
+  .corrupt = OnCorrupt,
+};
+
+static int ReadArchiveEntry(const uint8_t* data, size_t size, Arena* arena,
+                            RollupReader* r) {
+  Activity a;
+  int result = ReadArchiveInArena(data, size, arena, &a);
+  if (result == 0) {
+    r->has_header = a.has_header;
+    r->has_summary = a.has_summary;
+    r->header = a.header;
+    r->summary = a.summary;
+    for (size_t i = 0; i < a.heart_count; ++i) {
+      AddReading(r, a.heart_rate[i]);
+    }
+  }
+  FreeActivity(&a);
+  return result;
+}
+
+int ReadRollupEntry(const uint8_t* data, size_t size, RollupPeriod by,
+                    Arena* arena, RollupEntry* entry) {
+  RollupReader r;
+  memset(&r, 0, sizeof(r));
+  if (IsArchive(data, size)) {
+    if (ReadArchiveEntry(data, size, arena, &r) < 0) {
+      return -1;
+    }
+  } else {
+    TTBinVisitor visitor = kRollupReader;
+    visitor.context = &r;
+    ParseTTBin(data, size, &visitor);
+  }
+  if (!r.has_header || !r.has_summary) {
+    return -1;
+  }
+  memset(entry, 0, sizeof(*entry));
+  entry->period = Period(r.header.timestamp, by);
+  entry->activity_type = r.summary.activity_type;
+  entry->activities = 1;
+  entry->distance = r.summary.distance;
+  entry->duration = r.summary.duration + 1;
+  entry->calories = r.summary.calories;
+  entry->heart_sum = r.heart_sum;
+  entry->heart_count = r.heart_count;
+  entry->max_heart_rate = r.max_heart_rate;
+  return 0;
+}
+
+static size_t Slot(const Rollup* rollup, int64_t period, uint32_t type) {
+  uint64_t h = ((uint64_t)period << 8 ^ type) * 0x9E3779B97F4A7C15ull;
+  return (h >> 32) & (rollup->capacity - 1);
+}
+
+static RollupEntry* FindSlot(const Rollup* rollup, int64_t period,
+                             uint32_t type) {
+  size_t i = Slot(rollup, period, type);
+  for (;;) {
+    RollupEntry* e = &rollup->entries[i];
+    if (e->activities == 0 ||
+        (e->period == period && e->activity_type == type)) {
+      return e;
+    }
+    i = (i + 1) & (rollup->capacity - 1);
+  }
+}
+
+// Keeps the table at most half full.
+static int Grow(Rollup* rollup) {
+  size_t capacity = rollup->capacity ? 2 * rollup->capacity : 64;
+  Rollup grown = *rollup;
+  grown.entries = calloc(capacity, sizeof(RollupEntry));
+  if (grown.entries == NULL) {
+    return -1;
+  }
+  grown.capacity = capacity;
+  for (size_t i = 0; i < rollup->capacity; ++i) {
+    const RollupEntry* e = &rollup->entries[i];
+    if (e->activities > 0) {
+      *FindSlot(&grown, e->period, e->activity_type) = *e;
+    }
+  }
+  free(rollup->entries);
+  *rollup = grown;
+  return 0;
+}
+
+int AddRollupEntry(Rollup* rollup, const RollupEntry* entry) {
+  if (2 * (rollup->count + 1) > rollup->capacity && Grow(rollup) < 0) {
+    rollup->failed = 1;
+    return -1;
+  }
+  RollupEntry* e = FindSlot(rollup, entry->period, entry->activity_type);
+  if (e->activities == 0) {
+    *e = *entry;
+    ++rollup->count;
+    return 0;
+  }
+  e->activities += entry->activities;
+  e->distance += entry->distance;
+  e->duration += entry->duration;
+  e->calories += entry->calories;
+  e->heart_sum += entry->heart_sum;
+  e->heart_count += entry->heart_count;
+  if (entry->max_heart_rate > e->max_heart_rate) {
+    e->max_heart_rate = entry->max_heart_rate;
+  }
+  return 0;
+}
+
+int MergeRollup(Rollup* into, const Rollup* from) {
+  int result = 0;
+  for (size_t i = 0; i < from->capacity; ++i) {
+    if (from->entries[i].activities > 0 &&
+        AddRollupEntry(into, &from->entries[i]) < 0) {
+      result = -1;
+    }
+  }
+  if (from->failed) {
+    into->failed = 1;
+  }
+  return result;
+}
+
+typedef struct {
+  RollupPeriod by;
+  Rollup* parked;  // Totals of the finished threads, waiting for a merge.
+} RollupRun;
+
+// Totals of the files done by the thread so far.
+static __thread Rollup* partial;
+
+static int RollupJob(const char* filename, FILE* out, void* context,
+                     Arena* arena) {
+  const RollupRun* run = context;
+  if (partial == NULL) {
+    partial = malloc(sizeof(Rollup));
+    if (partial == NULL) {
+      return -1;
+    }
+    InitRollup(partial, run->by);
+  }
+  InputFile input;
+  if (OpenInputFile(filename, &input) < 0) {
+    return -1;
+  }
+  RollupEntry entry;
+  int result = ReadRollupEntry(input.data, input.size, run->by, arena,
+                               &entry);
+  CloseInputFile(&input);
+  return result < 0 ? -1 : AddRollupEntry(partial, &entry);
+}
+
+// A finishing thread takes the parked totals, if any, into its own and
+// tries again, until it can park its totals in the empty slot. The merges
+// happen in parallel in the threads as they finish, none waits on a lock,
+// and when they are all done the slot holds everything.
+static void RollupFinish(void* context) {
+  RollupRun* run = context;
+  Rollup* mine = partial;
+  partial = NULL;
+  while (mine != NULL) {
+    Rollup* other = __atomic_exchange_n(&run->parked, NULL,
+                                        __ATOMIC_ACQ_REL);
+    if (other != NULL) {
+      MergeRollup(mine, other);
+      FreeRollup(other);
+      free(other);
+      continue;
+    }
+    Rollup* expected = NULL;
+    if (__atomic_compare_exchange_n(&run->parked, &expected, mine, 0,
+                                    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+      mine = NULL;
+    }
+  }
+}
+
+int RunRollup(char** paths, int count, int threads, Rollup* rollup) {
+  RollupRun run = { rollup->by, NULL };
+  BatchOptions options = { 0 };
+  options.job = RollupJob;
+  options.context = &run;
+  options.threads = threads;
+  options.finish = RollupFinish;
+  int failures = RunBatch(paths, count, &options);
+  if (run.parked != NULL) {
+    if (MergeRollup(rollup, run.parked) < 0) {
+      ++failures;
+    }
+    FreeRollup(run.parked);
+    free(run.parked);
+  }
+  return failures;
+}
+
+static int ByPeriodAndType(const void* a, const void* b) {
+  const RollupEntry* x = a;
+  const RollupEntry* y = b;
+  if (x->period != y->period) {
+    return x->period < y->period ? -1 : 1;
+  }
+  return x->activity_type < y->activity_type ? -1 :
+         x->activity_type > y->activity_type;
+}
+
+static void FormatPeriod(int64_t period, RollupPeriod by, char* out,
+                         size_t size) {
+  if (by == ROLLUP_WEEK) {
+    time_t t = (period * 7 + 4) * 86400;
+    struct tm tm;
+    gmtime_r(&t, &tm);
+    snprintf(out, size, "%04d-%02d-%02d", tm.tm_year + 1900, tm.tm_mon + 1,
+             tm.tm_mday);
+  } else {
+    snprintf(out, size, "%04d-%02d", (int)(1970 + FloorDiv(period, 12)),
+             (int)(period - FloorDiv(period, 12) * 12) + 1);
+  }
+}
+
+int WriteRollup(const Rollup* rollup, FILE* out) {
+  RollupEntry* sorted = malloc((rollup->count + 1) * sizeof(RollupEntry));
+  if (sorted == NULL) {
+    return -1;
+  }
+  size_t count = 0;
+  for (size_t i = 0; i < rollup->capacity; ++i) {
+    if (rollup->entries[i].activities > 0) {
+      sorted[count++] = rollup->entries[i];
+    }
+  }
+  qsort(sorted, count, sizeof(RollupEntry), ByPeriodAndType);
+
+  fprintf(out, "%s,activityType,activities,distance,duration,calories,"
+               "averageHeartRate,maxHeartRate\n",
+          rollup->by == ROLLUP_WEEK ? "week" : "month");
+  for (size_t i = 0; i < count; ++i) {
+    const RollupEntry* e = &sorted[i];
+    char period[32];
+    FormatPeriod(e->period, rollup->by, period, sizeof(period));
+    fprintf(out, "%s,%u,%u,%llu,%llu,%llu,", period, e->activity_type,
+            e->activities, (unsigned long long)e->distance,
+            (unsigned long long)e->duration,
+            (unsigned long long)e->calories);
+    if (e->heart_count > 0) {
+      fprintf(out, "%.1f,%u\n", (double)e->heart_sum / e->heart_count,
+              e->max_heart_rate);
+    } else {
+      fprintf(out, ",\n");
+    }
+  }
+  free(sorted);
+  return fflush(out) == 0 ? 0 : -1;
+}
@@ -0,0 +1,68 @@
+#ifndef ROLLUP_H
+#define ROLLUP_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "arena.h"
+#include "ttbin.h"
+
+// Totals over many activities, by week or month of the header timestamp
+// (watch local time) and by activity type, from the summary records and
+// the heart rate readings.
+
+typedef enum {
+  ROLLUP_WEEK,   // From Monday.
+  ROLLUP_MONTH,
+} RollupPeriod;
+
+typedef struct {
+  int64_t period;  // Weeks since Monday 1970-01-05, or months since 1970.
+  uint32_t activity_type;
+  uint32_t activities;  // 0 = free slot of the table.
+  uint64_t distance;    // meters
+  uint64_t duration;    // seconds
+  uint64_t calories;
+  uint64_t heart_sum;   // Of the readings, zeros (no reading) left out.
+  uint64_t heart_count;
+  uint8_t max_heart_rate;
+} RollupEntry;
+
+// Hash table of the entries, by period and type.
+typedef struct {
+  RollupPeriod by;
+  RollupEntry* entries;
+  size_t count;
+  size_t capacity;  // Power of two, 0 before the first entry.
+  int failed;       // An entry was lost to an allocation failure.
+} Rollup;
+
+void InitRollup(Rollup* rollup, RollupPeriod by);
+void FreeRollup(Rollup* rollup);
+
+// Reads the totals of one .ttbin file or archive into entry, a single
+// activity. Only the header, summary and heart rate records are decoded;
+// archives are decoded into the arena (can be NULL). Returns -1 if the
+// file has no header or summary.
+int ReadRollupEntry(const uint8_t* data, size_t size, RollupPeriod by,
+                    Arena* arena, RollupEntry* entry);
+
+// Adds entry to the totals of its period and type. Returns -1 on
+// allocation failure.
+int AddRollupEntry(Rollup* rollup, const RollupEntry* entry);
+
+// Adds all the totals of from into into, both by the same period.
+int MergeRollup(Rollup* into, const Rollup* from);
+
+// Rolls up the files, directories are searched recursively for .ttbin
+// files, as RunBatch() with that many threads (0 = one per core). Each
+// thread gathers its own partial totals, which are combined without locks
+// as the threads finish. Returns the number of files that failed.
+int RunRollup(char** paths, int count, int threads, Rollup* rollup);
+
+// Writes the totals as CSV, by period then type.
+// Returns 0 on success, -1 on write error.
+int WriteRollup(const Rollup* rollup, FILE* out);
+
+#endif  // ROLLUP_H
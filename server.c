@@ -0,0 +1,606 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "server.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "instrument.h"
+#include "ttbin.h"
+
+// Open connections at most, the next ones are closed at once.
+#define SERVER_MAX_CLIENTS 1024
+
+// Seconds a thread waits for the rest of a request before dropping the
+// connection, so that a client sending half a request can't hold it.
+#define SERVER_TIMEOUT 5
+
+// Buffer of the result streams, so that they reach the segment in few
+// writes.
+#define SERVER_BUFFER (64u << 10)
+
+// The main thread polls the idle connections and queues those with a
+// request; a thread serves that one request and hands the connection
+// back. Idle clients then cost a descriptor, not a thread.
+typedef struct {
+  const ServerOptions* options;
+  pthread_mutex_t lock;
+  pthread_cond_t pending_cond;  // A connection was queued, or stopping.
+  int pending[SERVER_MAX_CLIENTS];  // With a request waiting.
+  size_t head;
+  size_t count;
+  int returned[SERVER_MAX_CLIENTS];  // Served, to be polled again.
+  size_t returned_count;
+  int stopping;
+  int connections;  // Open, atomic.
+  int wake;  // Write end of the pipe waking the main thread.
+} Server;
+
+typedef struct {
+  Server* server;
+  Arena arena;
+} Worker;
+
+static volatile sig_atomic_t stop_signal = 0;
+static int stop_pipe = -1;
+
+static void OnStopSignal(int signal) {
+  stop_signal = signal;
+  if (write(stop_pipe, "", 1) < 0) {
+    // The pipe is full, the main thread wakes up anyway.
+  }
+}
+
+// Returns 1 when all of size bytes were read, 0 at the end of the stream
+// before any byte, -1 on error or end in the middle.
+static int ReadFull(int fd, void* buffer, size_t size) {
+  char* p = buffer;
+  size_t done = 0;
+  while (done < size) {
+    ssize_t n = read(fd, p + done, size - done);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return n == 0 && done == 0 ? 0 : -1;
+    }
+    done += n;
+  }
+  return 1;
+}
+
+static int WriteFull(int fd, const void* buffer, size_t size) {
+  const char* p = buffer;
+  while (size > 0) {
+    // No SIGPIPE when the other side is gone, just an error.
+    ssize_t n = send(fd, p, size, MSG_NOSIGNAL);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n < 0) {
+      return -1;
+    }
+    p += n;
+    size -= n;
+  }
+  return 0;
+}
+
+// Anonymous segment: the name is only around until it's unlinked, the
+// descriptor keeps it alive until the client is done with it.
+static int CreateSegment(void) {
+  static unsigned long counter = 0;
+  char name[64];
+  for (int attempt = 0; attempt < 16; ++attempt) {
+    snprintf(name, sizeof(name), "/ttbin-%ld-%lu", (long)getpid(),
+             __atomic_fetch_add(&counter, 1, __ATOMIC_RELAXED));
+    int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd >= 0) {
+      shm_unlink(name);
+      return fd;
+    }
+    if (errno != EEXIST) {
+      break;
+    }
+  }
+  return -1;
+}
+
+// The reply, with the segment if there is one.
+static int SendReply(int fd, const ServerReply* reply, int segment) {
+  struct iovec iov = { (void*)reply, sizeof(*reply) };
+  union {
+    struct cmsghdr header;
+    char space[CMSG_SPACE(sizeof(int))];
+  } control;
+  struct msghdr message;
+  memset(&message, 0, sizeof(message));
+  message.msg_iov = &iov;
+  message.msg_iovlen = 1;
+  if (segment >= 0) {
+    memset(&control, 0, sizeof(control));
+    message.msg_control = control.space;
+    message.msg_controllen = sizeof(control.space);
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&message);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &segment, sizeof(int));
+  }
+  ssize_t n;
+  do {
+    n = sendmsg(fd, &message, MSG_NOSIGNAL);
+  } while (n < 0 && errno == EINTR);
+  if (n < 0) {
+    return -1;
+  }
+  return WriteFull(fd, (const char*)reply + n, sizeof(*reply) - n);
+}
+
+// Runs the job with its output in a new segment. Returns the segment, or
+// -1 if it couldn't be made, and the status and size in reply.
+static int RunJob(Worker* worker, ServerJob job, const char* name,
+                  const uint8_t* data, size_t size, ServerReply* reply) {
+  reply->status = -1;
+  reply->size = 0;
+  int segment = CreateSegment();
+  if (segment < 0) {
+    perror("Failed to create a segment");
+    return -1;
+  }
+  int copy = dup(segment);
+  FILE* out = copy >= 0 ? fdopen(copy, "w") : NULL;
+  if (out == NULL) {
+    if (copy >= 0) {
+      close(copy);
+    }
+    close(segment);
+    return -1;
+  }
+  setvbuf(out, NULL, _IOFBF, SERVER_BUFFER);
+  reply->status = job(name, data, size, out, worker->server->options->context,
+                      &worker->arena);
+  if (fclose(out) != 0) {
+    reply->status = -1;
+  }
+  struct stat st;
+  if (fstat(segment, &st) == 0) {
+    reply->size = st.st_size;
+  }
+  return segment;
+}
+
+// Serves one request. Returns -1 when the connection should be dropped.
+static int Serve(Worker* worker, int fd, const ServerRequest* request) {
+  const ServerOptions* options = worker->server->options;
+  if (request->magic != SERVER_MAGIC ||
+      request->output >= SERVER_OUTPUTS ||
+      (request->inline_data ? request->size > SERVER_MAX_INLINE :
+       request->size >= PATH_MAX)) {
+    return -1;
+  }
+  // A path lives in the arena too and costs no allocation. A file sent
+  // inline gets a buffer of its own: in the arena, one large file would
+  // keep it that large for the life of the thread.
+  uint8_t* payload = request->inline_data ? malloc(request->size + 1) :
+      ArenaAlloc(&worker->arena, request->size + 1);
+  if (payload == NULL || ReadFull(fd, payload, request->size) != 1) {
+    if (request->inline_data) {
+      free(payload);
+    }
+    return -1;
+  }
+  payload[request->size] = '\0';
+
+  ServerReply reply = { -1, 0, 0 };
+  ServerJob job = options->jobs[request->output];
+  int segment = -1;
+  if (job == NULL) {
+    fprintf(stderr, "Output not served: %u\n", request->output);
+  } else if (request->inline_data) {
+    segment = RunJob(worker, job, "-", payload, request->size, &reply);
+  } else {
+    const char* name = (const char*)payload;
+    InputFile input;
+    if (OpenInputFile(name, &input) < 0) {
+      fprintf(stderr, "Failed to open: %s\n", name);
+    } else {
+      segment = RunJob(worker, job, name, input.data, input.size, &reply);
+      CloseInputFile(&input);
+    }
+  }
+  if (segment >= 0 && reply.size == 0) {
+    close(segment);
+    segment = -1;
+  }
+  if (request->inline_data) {
+    free(payload);
+  }
+  int result = SendReply(fd, &reply, segment);
+  if (segment >= 0) {
+    close(segment);
+  }
+  return result;
+}
+
+// Takes the next connection with a request, -1 once stopping and none is
+// left.
+static int TakeClient(Server* server) {
+  pthread_mutex_lock(&server->lock);
+  while (server->count == 0 && !server->stopping) {
+    pthread_cond_wait(&server->pending_cond, &server->lock);
+  }
+  int fd = -1;
+  if (server->count > 0) {
+    fd = server->pending[server->head];
+    server->head = (server->head + 1) % SERVER_MAX_CLIENTS;
+    --server->count;
+  }
+  pthread_mutex_unlock(&server->lock);
+  return fd;
+}
+
+static void QueueClient(Server* server, int fd) {
+  pthread_mutex_lock(&server->lock);
+  server->pending[(server->head + server->count) % SERVER_MAX_CLIENTS] = fd;
+  ++server->count;
+  pthread_cond_signal(&server->pending_cond);
+  pthread_mutex_unlock(&server->lock);
+}
+
+static void ReturnClient(Server* server, int fd) {
+  pthread_mutex_lock(&server->lock);
+  server->returned[server->returned_count++] = fd;
+  pthread_mutex_unlock(&server->lock);
+  if (write(server->wake, "", 1) < 0) {
+    // Full, a wake up is already pending.
+  }
+}
+
+static void CloseClient(Server* server, int fd) {
+  close(fd);
+  __atomic_fetch_sub(&server->connections, 1, __ATOMIC_RELAXED);
+}
+
+static void* WorkerMain(void* argument) {
+  Worker* worker = argument;
+  Server* server = worker->server;
+  int fd;
+  while ((fd = TakeClient(server)) >= 0) {
+    ServerRequest request;
+    int keep = ReadFull(fd, &request, sizeof(request)) == 1 &&
+               Serve(worker, fd, &request) == 0;
+    ResetArena(&worker->arena);
+    if (keep) {
+      ReturnClient(server, fd);
+    } else {
+      CloseClient(server, fd);
+    }
+  }
+  FreeArena(&worker->arena);
+  STATS_MERGE();
+  return NULL;
+}
+
+static int Listen(const char* path) {
+  struct sockaddr_un address;
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(address.sun_path)) {
+    fprintf(stderr, "Socket path too long: %s\n", path);
+    return -1;
+  }
+  strcpy(address.sun_path, path);
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0) {
+    perror("socket");
+    return -1;
+  }
+  unlink(path);
+  if (bind(fd, (struct sockaddr*)&address, sizeof(address)) < 0 ||
+      listen(fd, SOMAXCONN) < 0) {
+    perror(path);
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+// Returns the new connection, -1 if there is none or too many are open.
+static int Accept(Server* server, int listener) {
+  int fd = accept(listener, NULL, NULL);
+  if (fd < 0) {
+    if (errno != EINTR && errno != ECONNABORTED && errno != EAGAIN) {
+      perror("accept");
+    }
+    return -1;
+  }
+  if (__atomic_load_n(&server->connections, __ATOMIC_RELAXED) >=
+      SERVER_MAX_CLIENTS) {
+    close(fd);
+    return -1;
+  }
+  struct timeval timeout = { SERVER_TIMEOUT, 0 };
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+  setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+  __atomic_fetch_add(&server->connections, 1, __ATOMIC_RELAXED);
+  return fd;
+}
+
+// Polls the listener and the idle connections until a stop signal.
+static int Poll(Server* server, int listener, int wake) {
+  struct pollfd* polls = malloc((SERVER_MAX_CLIENTS + 2) *
+                                sizeof(struct pollfd));
+  int* idle = malloc(SERVER_MAX_CLIENTS * sizeof(int));
+  if (polls == NULL || idle == NULL) {
+    free(polls);
+    free(idle);
+    return -1;
+  }
+  size_t idle_count = 0;
+  int result = 0;
+  while (!stop_signal) {
+    polls[0].fd = listener;
+    polls[1].fd = wake;
+    for (size_t i = 0; i < idle_count; ++i) {
+      polls[2 + i].fd = idle[i];
+    }
+    for (size_t i = 0; i < idle_count + 2; ++i) {
+      polls[i].events = POLLIN;
+      polls[i].revents = 0;
+    }
+    if (poll(polls, idle_count + 2, -1) < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      perror("poll");
+      result = -1;
+      break;
+    }
+    // From the end, so that the connections moved down were seen.
+    for (size_t i = idle_count; i-- > 0;) {
+      if (polls[2 + i].revents != 0) {
+        QueueClient(server, idle[i]);
+        idle[i] = idle[--idle_count];
+      }
+    }
+    // Polled until the request arrives, a thread only waits for its end.
+    int fd;
+    if (polls[0].revents != 0 && (fd = Accept(server, listener)) >= 0) {
+      idle[idle_count++] = fd;
+    }
+    if (polls[1].revents != 0) {
+      char bytes[64];
+      while (read(wake, bytes, sizeof(bytes)) > 0) {
+      }
+      pthread_mutex_lock(&server->lock);
+      for (size_t i = 0; i < server->returned_count; ++i) {
+        idle[idle_count++] = server->returned[i];
+      }
+      server->returned_count = 0;
+      pthread_mutex_unlock(&server->lock);
+    }
+  }
+  for (size_t i = 0; i < idle_count; ++i) {
+    CloseClient(server, idle[i]);
+  }
+  free(polls);
+  free(idle);
+  return result;
+}
+
+int RunServer(const char* path, const ServerOptions* options) {
+  int threads = options->threads;
+  if (threads <= 0) {
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    threads = cores > 0 ? cores : 1;
+  }
+  int listener = Listen(path);
+  if (listener < 0) {
+    return -1;
+  }
+  int wake[2];
+  Server* server = malloc(sizeof(Server));
+  Worker* workers = malloc(threads * sizeof(Worker));
+  pthread_t* ids = malloc(threads * sizeof(pthread_t));
+  if (server == NULL || workers == NULL || ids == NULL || pipe(wake) < 0) {
+    free(server);
+    free(workers);
+    free(ids);
+    close(listener);
+    unlink(path);
+    return -1;
+  }
+  fcntl(wake[0], F_SETFL, O_NONBLOCK);
+  fcntl(wake[1], F_SETFL, O_NONBLOCK);
+  fcntl(listener, F_SETFL, O_NONBLOCK);
+  server->options = options;
+  pthread_mutex_init(&server->lock, NULL);
+  pthread_cond_init(&server->pending_cond, NULL);
+  server->head = 0;
+  server->count = 0;
+  server->returned_count = 0;
+  server->stopping = 0;
+  server->connections = 0;
+  server->wake = wake[1];
+
+  // The signals wake the poll through the pipe, the threads block them.
+  stop_pipe = wake[1];
+  struct sigaction action;
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = OnStopSignal;
+  sigemptyset(&action.sa_mask);
+  sigaction(SIGINT, &action, NULL);
+  sigaction(SIGTERM, &action, NULL);
+  sigset_t stop_set;
+  sigset_t previous;
+  sigemptyset(&stop_set);
+  sigaddset(&stop_set, SIGINT);
+  sigaddset(&stop_set, SIGTERM);
+  pthread_sigmask(SIG_BLOCK, &stop_set, &previous);
+
+  // Warm the pool before the first request: the threads are running and
+  // their arenas are faulted in.
+  int started = 0;
+  for (int i = 0; i < threads; ++i) {
+    workers[i].server = server;
+    InitArena(&workers[i].arena);
+    if (ReserveArena(&workers[i].arena, SERVER_ARENA_SIZE) == 0) {
+      memset(workers[i].arena.base, 0, workers[i].arena.size);
+    }
+    if (pthread_create(&ids[i], NULL, WorkerMain, &workers[i]) != 0) {
+      FreeArena(&workers[i].arena);
+      break;
+    }
+    ++started;
+  }
+  pthread_sigmask(SIG_SETMASK, &previous, NULL);
+
+  int result = started > 0 ? Poll(server, listener, wake[0]) : -1;
+  close(listener);
+  unlink(path);
+
+  // The queued requests are still served, then the threads stop.
+  pthread_mutex_lock(&server->lock);
+  server->stopping = 1;
+  pthread_cond_broadcast(&server->pending_cond);
+  pthread_mutex_unlock(&server->lock);
+  for (int i = 0; i < started; ++i) {
+    pthread_join(ids[i], NULL);
+  }
+  for (size_t i = 0; i < server->returned_count; ++i) {
+    CloseClient(server, server->returned[i]);
+  }
+  for (; server->count > 0; --server->count) {
+    CloseClient(server, server->pending[server->head]);
+    server->head = (server->head + 1) % SERVER_MAX_CLIENTS;
+  }
+  stop_pipe = -1;
+  close(wake[0]);
+  close(wake[1]);
+  pthread_mutex_destroy(&server->lock);
+  pthread_cond_destroy(&server->pending_cond);
+  free(server);
+  free(workers);
+  free(ids);
+  return result;
+}
+
+int ConnectServer(const char* path) {
+  struct sockaddr_un address;
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(address.sun_path)) {
+    errno = ENAMETOOLONG;
+    return -1;
+  }
+  strcpy(address.sun_path, path);
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0) {
+    return -1;
+  }
+  if (connect(fd, (struct sockaddr*)&address, sizeof(address)) < 0) {
+    int error = errno;
+    close(fd);
+    errno = error;
+    return -1;
+  }
+  return fd;
+}
+
+// Reads the reply and the segment, -1 if none came with it.
+static int ReceiveReply(int fd, ServerReply* reply, int* segment) {
+  struct iovec iov = { reply, sizeof(*reply) };
+  union {
+    struct cmsghdr header;
+    char space[CMSG_SPACE(sizeof(int))];
+  } control;
+  struct msghdr message;
+  memset(&message, 0, sizeof(message));
+  message.msg_iov = &iov;
+  message.msg_iovlen = 1;
+  message.msg_control = control.space;
+  message.msg_controllen = sizeof(control.space);
+  *segment = -1;
+  ssize_t n;
+  do {
+    n = recvmsg(fd, &message, 0);
+  } while (n < 0 && errno == EINTR);
+  if (n <= 0) {
+    return -1;
+  }
+  struct cmsghdr* cmsg = CMSG_FIRSTHDR(&message);
+  if (cmsg != NULL && cmsg->cmsg_level == SOL_SOCKET &&
+      cmsg->cmsg_type == SCM_RIGHTS) {
+    memcpy(segment, CMSG_DATA(cmsg), sizeof(int));
+  }
+  if ((size_t)n < sizeof(*reply) &&
+      ReadFull(fd, (char*)reply + n, sizeof(*reply) - n) != 1) {
+    return -1;
+  }
+  return 0;
+}
+
+int RequestServer(int socket, ServerOutput output, const char* name,
+                  const uint8_t* data, size_t size, FILE* out) {
+  ServerRequest request = { SERVER_MAGIC, output, data != NULL, 0, size };
+  char path[PATH_MAX];
+  if (data == NULL) {
+    // From the root, the daemon runs elsewhere.
+    path[0] = '\0';
+    if (name[0] != '/' && getcwd(path, sizeof(path) - 1) == NULL) {
+      fprintf(stderr, "Failed to open: %s\n", name);
+      return -1;
+    }
+    size_t length = strlen(path);
+    if (length > 0) {
+      path[length++] = '/';
+    }
+    if (length + strlen(name) >= sizeof(path)) {
+      fprintf(stderr, "Path too long: %s\n", name);
+      return -1;
+    }
+    strcpy(path + length, name);
+    data = (const uint8_t*)path;
+    request.size = strlen(path);
+  } else if (size > SERVER_MAX_INLINE) {
+    fprintf(stderr, "Too large to send: %s\n", name);
+    return -1;
+  }
+  ServerReply reply;
+  int segment;
+  if (WriteFull(socket, &request, sizeof(request)) < 0 ||
+      WriteFull(socket, data, request.size) < 0 ||
+      ReceiveReply(socket, &reply, &segment) < 0) {
+    fprintf(stderr, "No reply for: %s\n", name);
+    return -1;
+  }
+  int result = reply.status;
+  if (segment >= 0 && reply.size > 0) {
+    void* result_data = mmap(NULL, reply.size, PROT_READ, MAP_SHARED,
+                             segment, 0);
+    if (result_data == MAP_FAILED ||
+        fwrite(result_data, 1, reply.size, out) != reply.size) {
+      result = -1;
+    }
+    if (result_data != MAP_FAILED) {
+      munmap(result_data, reply.size);
+    }
+  }
+  if (segment >= 0) {
+    close(segment);
+  }
+  return result;
+}
@@ -0,0 +1,76 @@
+#ifndef SERVER_H
+#define SERVER_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "arena.h"
+
+// Daemon decoding files for clients on a Unix socket, so that a request
+// costs neither a process start nor cold caches. A pool of threads, each
+// with an arena reserved up front, serves the requests; a connection can
+// send any number of them, one at a time, and costs no thread while idle.
+//
+// A request is a ServerRequest followed by size bytes: the path of the
+// file (from the root, the daemon has its own working directory) or the
+// file itself. The reply is a ServerReply along with the descriptor of a
+// shared memory segment (shm_open, already unlinked) holding the size
+// bytes of the result, so that the result isn't copied through the socket.
+
+#define SERVER_MAGIC 0x31535454  // "TTS1"
+
+typedef enum {
+  SERVER_SUMMARY,  // The -s line.
+  SERVER_CSV,
+  SERVER_COLUMNS,  // The columnar archive, see archive.h.
+  SERVER_OUTPUTS,
+} ServerOutput;
+
+typedef struct {
+  uint32_t magic;
+  uint8_t output;       // ServerOutput.
+  uint8_t inline_data;  // 1 = the file follows, 0 = its path.
+  uint16_t reserved;
+  uint64_t size;
+} ServerRequest;
+
+typedef struct {
+  int32_t status;  // 0 on success, -1 on failure (with a result or not).
+  uint32_t reserved;
+  uint64_t size;
+} ServerReply;
+
+// Largest file sent inline.
+#define SERVER_MAX_INLINE (256u << 20)
+
+// Arena reserved by each thread at start, enough for the columns of a
+// file of a few hours.
+#define SERVER_ARENA_SIZE (16u << 20)
+
+// Work done on one request, like a BatchJob but on a file in memory.
+// name is the path, or "-" for a file sent inline. The arena is reset
+// after each request. Returns 0 on success, -1 on failure.
+typedef int (*ServerJob)(const char* name, const uint8_t* data, size_t size,
+                         FILE* out, void* context, Arena* arena);
+
+typedef struct {
+  ServerJob jobs[SERVER_OUTPUTS];  // NULL = output not served.
+  void* context;
+  int threads;  // 0 = one per core.
+} ServerOptions;
+
+// Serves the socket at path (replaced if it exists) until SIGINT or
+// SIGTERM, then removes it. Returns -1 if it can't be set up.
+int RunServer(const char* path, const ServerOptions* options);
+
+// Client side. Returns the connected socket, -1 with errno set otherwise.
+int ConnectServer(const char* path);
+
+// Sends a request on the socket and writes the result to out: for the
+// file at name when data is NULL, otherwise for the size bytes of data.
+// Returns the status of the reply, -1 if the daemon can't be reached.
+int RequestServer(int socket, ServerOutput output, const char* name,
+                  const uint8_t* data, size_t size, FILE* out);
+
+#endif  // SERVER_H
@@ -0,0 +1,188 @@
+#include "splits.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+static const uint32_t kWindows[SPLITS_WINDOWS] = { 30, 300 };
+
+static void InitWindow(RollingWindow* w, uint32_t length) {
+  memset(w, 0, offsetof(RollingWindow, time));
+  w->length = length;
+}
+
+// Drops the samples out of the window, adds the new one and updates the
+// best average when the window has been filled.
+static void AddToWindow(RollingWindow* w, uint32_t time, uint16_t value) {
+  uint32_t last = w->count > 0 ?
+      w->time[(w->head + w->count - 1) % ROLLING_CAPACITY] : time;
+  if (!w->started || time < last || time - last > ROLLING_MAX_GAP) {
+    // The times went back or there was a pause, the window starts over:
+    // a best average is only taken over samples covering the window.
+    w->count = 0;
+    w->sum = 0;
+    w->since = time;
+    w->started = 1;
+  }
+  while (w->count > 0 && (time - w->time[w->head] >= w->length ||
+                          w->count == ROLLING_CAPACITY)) {
+    w->sum -= w->value[w->head];
+    w->head = (w->head + 1) % ROLLING_CAPACITY;
+    --w->count;
+  }
+  uint32_t tail = (w->head + w->count) % ROLLING_CAPACITY;
+  w->time[tail] = time;
+  w->value[tail] = value;
+  w->sum += value;
+  ++w->count;
+  if (time - w->since + 1 >= w->length) {
+    double average = (double)w->sum / w->count;
+    if (average > w->best) {
+      w->best = average;
+      w->best_time = time;
+    }
+  }
+}
+
+static void OpenLap(Splits* s, int lap, uint8_t activity, uint32_t time) {
+  memset(&s->current, 0, sizeof(s->current));
+  s->current.lap = lap;
+  s->current.activity = activity;
+  s->current.start_time = time;
+  s->start_distance = s->distance;
+}
+
+// Closes the current lap at end, a local time. Laps before the first lap
+// record are only kept when they have samples.
+static void CloseLap(Splits* s, uint32_t end) {
+  LapSplit* lap = &s->current;
+  if (lap->lap < 0 && lap->gps_samples == 0 && lap->heart_samples == 0) {
+    return;
+  }
+  lap->duration = end > lap->start_time ? end - lap->start_time : 0;
+  lap->distance = s->distance - s->start_distance;
+  if (s->lap_count == s->lap_capacity) {
+    size_t capacity = s->lap_capacity ? 2 * s->lap_capacity : 16;
+    LapSplit* grown = realloc(s->laps, capacity * sizeof(LapSplit));
+    if (grown == NULL) {
+      s->failed = 1;
+      return;
+    }
+    s->laps = grown;
+    s->lap_capacity = capacity;
+  }
+  s->laps[s->lap_count++] = *lap;
+}
+
+void InitSplits(Splits* s) {
+  memset(s, 0, offsetof(Splits, speed));
+  for (int i = 0; i < SPLITS_WINDOWS; ++i) {
+    InitWindow(&s->speed[i], kWindows[i]);
+    InitWindow(&s->heart[i], kWindows[i]);
+  }
+  OpenLap(s, -1, 0, 0);
+}
+
+void FreeSplits(Splits* s) {
+  free(s->laps);
+  InitSplits(s);
+}
+
+// A lap before any lap record starts at its first sample.
+static void Started(Splits* s, uint32_t time) {
+  if (s->current.lap < 0 && s->current.start_time == 0) {
+    s->current.start_time = time;
+  }
+}
+
+static void OnHeader(void* context, const Header* header) {
+  Splits* s = context;
+  s->local_time_offset = header->local_time_offset;
+  s->start_time = header->timestamp;
+}
+
+static void OnSummary(void* context, const Summary* summary) {
+  Splits* s = context;
+  s->end_time = s->start_time + summary->duration + 1;
+}
+
+static void OnLap(void* context, const Lap* lap) {
+  Splits* s = context;
+  s->last_time = lap->time;
+  CloseLap(s, lap->time);
+  OpenLap(s, lap->lap, lap->activity, lap->time);
+}
+
+static void OnGPSSpan(void* context, const GPSSample* gps, size_t count) {
+  Splits* s = context;
+  LapSplit* lap = &s->current;
+  for (size_t i = 0; i < count; ++i) {
+    if (gps[i].time == 0xffffffff) {
+      continue;
+    }
+    uint16_t speed = gps[i].speed;
+    ++lap->gps_samples;
+    lap->speed_sum += speed;
+    if (speed > lap->max_speed) {
+      lap->max_speed = speed;
+    }
+    s->distance = gps[i].cum_distance;
+    for (int w = 0; w < SPLITS_WINDOWS; ++w) {
+      AddToWindow(&s->speed[w], gps[i].time, speed);
+    }
+    s->last_time = gps[i].time + s->local_time_offset;
+    Started(s, s->last_time);
+  }
+}
+
+static void OnHeartRateSpan(void* context, const HeartRateSample* hearts,
+                            size_t count) {
+  Splits* s = context;
+  LapSplit* lap = &s->current;
+  for (size_t i = 0; i < count; ++i) {
+    uint8_t heart_rate = hearts[i].heart_rate;
+    Started(s, hearts[i].time);
+    if (heart_rate == 0) {
+      continue;
+    }
+    ++lap->heart_samples;
+    lap->heart_sum += heart_rate;
+    if (heart_rate > lap->max_heart_rate) {
+      lap->max_heart_rate = heart_rate;
+    }
+    for (int w = 0; w < SPLITS_WINDOWS; ++w) {
+      AddToWindow(&s->heart[w], hearts[i].time, heart_rate);
+    }
+  }
+}
+
+static void OnCorrupt(void* context, size_t offset, size_t size) {
+  Splits* s = context;
+  s->corrupt_bytes += size;
+}
+
+static const TTBinVisitor kSplitsVisitor = {
+  .header = OnHeader,
+  .lap = OnLap,
+  .summary = OnSummary,
+  .gps_span = OnGPSSpan,
+  .heart_rate_span = OnHeartRateSpan,
+  .corrupt = OnCorrupt,
+};
+
+void InitSplitsVisitor(Splits* splits, TTBinVisitor* visitor) {
+  *visitor = kSplitsVisitor;
+  visitor->context = splits;
+}
+
+void FinishSplits(Splits* s) {
+  CloseLap(s, s->end_time != 0 ? s->end_time : s->last_time);
+  OpenLap(s, -1, 0, 0);
+}
+
+int ReadSplits(const uint8_t* data, size_t size, Splits* splits) {
+  TTBinVisitor visitor;
+  InitSplitsVisitor(splits, &visitor);
+  ParseTTBin(data, size, &visitor);
+  FinishSplits(splits);
+  return splits->failed ? -1 : 0;
+}
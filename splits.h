@@ -0,0 +1,86 @@
+#ifndef SPLITS_H
+#define SPLITS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "ttbin.h"
+
+// Lap splits and rolling averages of speed and heart rate, gathered as the
+// records are parsed: each lap is closed out when the next lap record
+// arrives and the windows are updated in O(1) per sample, so everything is
+// ready when the parse ends, without a pass over decoded columns.
+
+#define SPLITS_WINDOWS 2  // 30 s and 5 min.
+
+// Samples a window can hold, more than the longest window in seconds
+// (the samples are about one second apart).
+#define ROLLING_CAPACITY 512
+
+// Seconds without a sample after which a window starts over, so that a
+// window spanning a pause isn't averaged over the few samples around it.
+#define ROLLING_MAX_GAP 10
+
+// Sliding window over the last length seconds of one metric: a ring of
+// the samples in it and their running sum.
+typedef struct {
+  uint32_t length;  // seconds
+  uint32_t head;    // Oldest sample.
+  uint32_t count;
+  uint64_t sum;
+  int started;
+  uint32_t since;      // First sample since the times went back or a gap.
+  double best;         // Highest average over a whole window, 0 if none.
+  uint32_t best_time;  // Of the last sample of that window.
+  uint32_t time[ROLLING_CAPACITY];
+  uint16_t value[ROLLING_CAPACITY];
+} RollingWindow;
+
+typedef struct {
+  int lap;           // Number of the lap record starting it, -1 before any.
+  uint8_t activity;  // Of the lap record.
+  uint32_t start_time;  // Watch local time.
+  uint32_t duration;    // seconds, to the next lap record or the end
+  float distance;       // meters
+  uint32_t gps_samples;  // With a GPS lock.
+  uint64_t speed_sum;    // 100 * m/s
+  uint16_t max_speed;
+  uint32_t heart_samples;  // Readings, without the zeros (no reading).
+  uint64_t heart_sum;
+  uint8_t max_heart_rate;
+} LapSplit;
+
+typedef struct {
+  int32_t local_time_offset;  // From the header, the GPS times are UTC.
+  uint32_t start_time;  // Local times of the header and of the end of the
+  uint32_t end_time;    // summary, 0 if none.
+  LapSplit current;
+  float start_distance;  // Cumulative distance at the start of the lap.
+  float distance;        // Of the last GPS sample.
+  uint32_t last_time;    // Local time of the last GPS sample or lap.
+  LapSplit* laps;        // Closed out, in file order.
+  size_t lap_count;
+  size_t lap_capacity;
+  int failed;  // A lap was lost to an allocation failure.
+  size_t corrupt_bytes;  // Skipped by the parser.
+  RollingWindow speed[SPLITS_WINDOWS];  // 100 * m/s, every sample.
+  RollingWindow heart[SPLITS_WINDOWS];  // BPM, zeros left out.
+} Splits;
+
+void InitSplits(Splits* splits);
+void FreeSplits(Splits* splits);
+
+// Visitor feeding the splits, to be parsed alone or along with others by
+// forwarding its callbacks.
+void InitSplitsVisitor(Splits* splits, TTBinVisitor* visitor);
+
+// Closes out the last lap at the end of the activity given by the summary,
+// or else at the last GPS sample, after the parse.
+void FinishSplits(Splits* splits);
+
+// Parses the file held in data into the splits and finishes them.
+// Damaged parts are skipped and counted. Returns -1 if a lap was lost to
+// an allocation failure; the splits must be freed in both cases.
+int ReadSplits(const uint8_t* data, size_t size, Splits* splits);
+
+#endif  // SPLITS_H
@@ -0,0 +1,80 @@
+#include "stats.h"
+
+#include <string.h>
+
+uint16_t SpeedFromPace(double seconds_per_km) {
+  double speed = 1000 / (seconds_per_km * SPEED_SCALE);
+  return speed >= 65535 ? 65535 : (uint16_t)(speed + 0.5);
+}
+
+// Turns the counts of samples at or above each bound into zone counts.
+static void Zones(const ColumnScan* scan, size_t valid, int count,
+                  size_t* zones) {
+  size_t below = valid;
+  for (int i = 0; i < count; ++i) {
+    zones[i] = below - scan->at_least[i];
+    below = scan->at_least[i];
+  }
+  zones[count] = below;
+}
+
+static int Ascending8(const uint8_t* bounds, int count) {
+  if (count < 0 || count > STATS_MAX_ZONES || (count > 0 && bounds[0] == 0)) {
+    return 0;
+  }
+  for (int i = 1; i < count; ++i) {
+    if (bounds[i - 1] >= bounds[i]) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+static int Ascending16(const uint16_t* bounds, int count) {
+  if (count < 0 || count > STATS_MAX_ZONES || (count > 0 && bounds[0] == 0)) {
+    return 0;
+  }
+  for (int i = 1; i < count; ++i) {
+    if (bounds[i - 1] >= bounds[i]) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+int ComputeStats(const Activity* activity, const StatsOptions* options,
+                 ActivityStats* stats) {
+  memset(stats, 0, sizeof(*stats));
+  if (!Ascending8(options->heart_zones, options->heart_zone_count) ||
+      !Ascending16(options->speed_zones, options->speed_zone_count)) {
+    return -1;
+  }
+
+  // Zero BPM is below every zone, so it only needs removing from zone 0.
+  ColumnScan heart;
+  memset(&heart, 0, sizeof(heart));
+  ScanColumn8(activity->heart_rate, activity->heart_count,
+              options->heart_zones, options->heart_zone_count, &heart);
+  stats->heart_samples = activity->heart_count - heart.zeros;
+  if (stats->heart_samples > 0) {
+    stats->average_heart_rate = (double)heart.sum / stats->heart_samples;
+  }
+  stats->max_heart_rate = heart.max;
+  Zones(&heart, stats->heart_samples, options->heart_zone_count,
+        stats->time_in_heart_zone);
+
+  ColumnScan speed;
+  memset(&speed, 0, sizeof(speed));
+  ScanColumn16(activity->speed, activity->gps_count, options->speed_zones,
+               options->speed_zone_count, &speed);
+  stats->speed_samples = activity->gps_count;
+  stats->moving_samples = activity->gps_count - speed.zeros;
+  if (stats->moving_samples > 0) {
+    stats->average_speed =
+        (double)speed.sum / stats->moving_samples * SPEED_SCALE;
+  }
+  stats->max_speed = speed.max * SPEED_SCALE;
+  Zones(&speed, stats->speed_samples, options->speed_zone_count,
+        stats->time_in_speed_zone);
+  return 0;
+}
@@ -0,0 +1,42 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "activity.h"
+
+#define STATS_MAX_ZONES SCAN_MAX_THRESHOLDS
+
+// Lower bounds of the zones above the first one, both ascending: zone 0
+// is below bounds[0], zone i from bounds[i - 1] to bounds[i].
+typedef struct {
+  int heart_zone_count;
+  uint8_t heart_zones[STATS_MAX_ZONES];  // BPM, from 1
+  int speed_zone_count;
+  uint16_t speed_zones[STATS_MAX_ZONES];  // speed column units
+} StatsOptions;
+
+// Samples are one second apart, so sample counts are times in seconds.
+typedef struct {
+  size_t heart_samples;  // Readings, without the zeros (no reading).
+  double average_heart_rate;
+  int max_heart_rate;
+  size_t time_in_heart_zone[STATS_MAX_ZONES + 1];
+
+  size_t speed_samples;
+  size_t moving_samples;  // Non zero speed.
+  double average_speed;   // m/s, moving samples only.
+  double max_speed;
+  size_t time_in_speed_zone[STATS_MAX_ZONES + 1];
+} ActivityStats;
+
+// Lower bound of a speed zone for a pace, in seconds per km.
+uint16_t SpeedFromPace(double seconds_per_km);
+
+// One pass over the heart rate column and one over the speed column.
+// Returns -1 if the zones are not ascending or start at 0 BPM.
+int ComputeStats(const Activity* activity, const StatsOptions* options,
+                 ActivityStats* stats);
+
+#endif  // STATS_H
@@ -0,0 +1,137 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "timefmt.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#define SECONDS_PER_DAY 86400
+
+// Days since 1970-01-01 of a date, proleptic Gregorian calendar.
+static int64_t DaysFromCivil(int64_t year, int month, int day) {
+  year -= month <= 2;
+  int64_t era = (year >= 0 ? year : year - 399) / 400;
+  int64_t year_of_era = year - era * 400;
+  int day_of_year = (153 * (month > 2 ? month - 3 : month + 9) + 2) / 5 +
+                    day - 1;
+  int64_t day_of_era = year_of_era * 365 + year_of_era / 4 -
+                       year_of_era / 100 + day_of_year;
+  return era * 146097 + day_of_era - 719468;
+}
+
+static void CivilFromDays(int64_t days, int64_t* year, int* month,
+                          int* day) {
+  days += 719468;
+  int64_t era = (days >= 0 ? days : days - 146096) / 146097;
+  int64_t day_of_era = days - era * 146097;
+  int64_t year_of_era = (day_of_era - day_of_era / 1460 +
+                         day_of_era / 36524 - day_of_era / 146096) / 365;
+  int64_t day_of_year = day_of_era -
+                        (365 * year_of_era + year_of_era / 4 -
+                         year_of_era / 100);
+  int shifted_month = (5 * day_of_year + 2) / 153;
+  *day = day_of_year - (153 * shifted_month + 2) / 5 + 1;
+  *month = shifted_month < 10 ? shifted_month + 3 : shifted_month - 9;
+  *year = year_of_era + era * 400 + (*month <= 2);
+}
+
+static int64_t FloorDiv(int64_t a, int64_t b) {
+  return a / b - (a % b < 0);
+}
+
+// Offset of the host local time at a given time, only asks the C library
+// once per quarter of an hour, often enough to follow the DST changes.
+static int32_t LocalOffset(TimeFormatter* f, int64_t seconds) {
+  int64_t period = FloorDiv(seconds, 900);
+  if (period != f->period) {
+    time_t tt = seconds;
+    struct tm tm;
+    if (localtime_r(&tt, &tm) != NULL) {
+      int64_t local = DaysFromCivil(tm.tm_year + 1900, tm.tm_mon + 1,
+                                    tm.tm_mday) * SECONDS_PER_DAY +
+                      tm.tm_hour * 3600 + tm.tm_min * 60 + tm.tm_sec;
+      f->local_offset = local - seconds;
+    }
+    f->period = period;
+  }
+  return f->local_offset;
+}
+
+static void Put2(char* out, int value) {
+  out[0] = '0' + value / 10;
+  out[1] = '0' + value % 10;
+}
+
+void InitTimeFormatter(TimeFormatter* f, int local) {
+  f->local = local;
+  f->period = INT64_MIN;
+  f->local_offset = 0;
+  f->last = INT64_MIN;
+  f->day = INT64_MIN;
+  memcpy(f->text, "0000-00-00 00:00:00", TIME_BUFFER_SIZE);
+}
+
+// Adds one second to the HH:MM:SS part, which isn't 23:59:59.
+static void NextSecond(char* text) {
+  static const char kLimits[] = "29:59:59";
+  for (int i = 18; i >= 11; --i) {
+    if (text[i] == ':') {
+      continue;
+    }
+    if (text[i] < kLimits[i - 11] &&
+        !(i == 12 && text[11] == '2' && text[12] == '3')) {
+      ++text[i];
+      return;
+    }
+    text[i] = '0';
+  }
+}
+
+char* FormatTime(TimeFormatter* f, int64_t seconds, char* out) {
+  if (f->local) {
+    seconds += LocalOffset(f, seconds);
+  }
+  int64_t day = FloorDiv(seconds, SECONDS_PER_DAY);
+  if (day == f->day && seconds == f->last + 1) {
+    NextSecond(f->text);
+  } else if (seconds != f->last) {
+    if (day != f->day) {
+      int64_t year;
+      int month, mday;
+      CivilFromDays(day, &year, &month, &mday);
+      char* text = f->text;
+      text[0] = '0' + year / 1000 % 10;
+      text[1] = '0' + year / 100 % 10;
+      Put2(text + 2, year % 100);
+      Put2(text + 5, month);
+      Put2(text + 8, mday);
+      f->day = day;
+    }
+    int second_of_day = seconds - day * SECONDS_PER_DAY;
+    Put2(f->text + 11, second_of_day / 3600);
+    Put2(f->text + 14, second_of_day / 60 % 60);
+    Put2(f->text + 17, second_of_day % 60);
+  }
+  f->last = seconds;
+  memcpy(out, f->text, TIME_BUFFER_SIZE);
+  return out;
+}
+
+// Activities:
+// 0: Run
+// 1: Cycle
+// 2: Swim
+// 7: Treadmill
+
+const char* FormatActivityType(uint32_t activity, char* buffer, size_t size) {
+  switch(activity) {
+    case 0: return "Run";
+    case 1: return "Cycle";
+    case 2: return "Swim";
+    case 7: return "Treadmill";
+    default:
+      snprintf(buffer, size, "Type %u", activity);
+      return buffer;
+  }
+}
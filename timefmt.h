@@ -0,0 +1,34 @@
+#ifndef TIMEFMT_H
+#define TIMEFMT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// "YYYY-MM-DD HH:MM:SS" and the terminating NUL.
+#define TIME_BUFFER_SIZE 20
+
+// Reentrant replacement for strftime("%F %T", gmtime()/localtime()).
+// Consecutive records are usually one second apart: the date is only
+// computed when the day changes and the time of day is incremented in
+// place. One formatter per thread (or per file).
+typedef struct {
+  int local;             // Local time instead of UTC.
+  int64_t period;        // Quarter of an hour (since 1970) of local_offset.
+  int32_t local_offset;  // Seconds added to UTC to get the local time.
+  int64_t last;          // Last formatted second, shifted to local time.
+  int64_t day;           // Day of the date in text.
+  char text[TIME_BUFFER_SIZE];
+} TimeFormatter;
+
+// local = 0 for UTC, 1 for the local time of the host.
+void InitTimeFormatter(TimeFormatter* formatter, int local);
+
+// Formats seconds since 1970 into out, which must hold TIME_BUFFER_SIZE
+// bytes. Returns out.
+char* FormatTime(TimeFormatter* formatter, int64_t seconds, char* out);
+
+// Returns the name of an activity ("Run", "Cycle"...). Unknown types are
+// written as "Type N" into buffer, which should hold 16 bytes.
+const char* FormatActivityType(uint32_t activity, char* buffer, size_t size);
+
+#endif  // TIMEFMT_H
@@ -0,0 +1,235 @@
+#include "track.h"
+
+#include <math.h>
+#include <stdlib.h>
+
+#define PI 3.14159265358979323846
+
+// Rounded mean of count values.
+static int64_t Mean(int64_t sum, int64_t count) {
+  return sum < 0 ? (sum - count / 2) / count : (sum + count / 2) / count;
+}
+
+// The originals of the values overwritten but still in the window are
+// kept in a ring of half + 2 values.
+static void SmoothInt32(int32_t* values, size_t n, size_t half,
+                        int64_t* ring) {
+  size_t ring_size = half + 2;
+  int64_t sum = 0;
+  size_t count = 0;
+  for (size_t i = 0; i < half && i < n; ++i) {
+    sum += values[i];
+    ++count;
+  }
+  for (size_t i = 0; i < n; ++i) {
+    // Window [i - half, i + half].
+    if (i + half < n) {
+      sum += values[i + half];
+      ++count;
+    }
+    if (i > half) {
+      sum -= ring[(i - half - 1) % ring_size];
+      --count;
+    }
+    ring[i % ring_size] = values[i];
+    values[i] = Mean(sum, count);
+  }
+}
+
+static void SmoothUInt16(uint16_t* values, size_t n, size_t half,
+                         int64_t* ring) {
+  size_t ring_size = half + 2;
+  int64_t sum = 0;
+  size_t count = 0;
+  for (size_t i = 0; i < half && i < n; ++i) {
+    sum += values[i];
+    ++count;
+  }
+  for (size_t i = 0; i < n; ++i) {
+    if (i + half < n) {
+      sum += values[i + half];
+      ++count;
+    }
+    if (i > half) {
+      sum -= ring[(i - half - 1) % ring_size];
+      --count;
+    }
+    ring[i % ring_size] = values[i];
+    values[i] = Mean(sum, count);
+  }
+}
+
+int SmoothActivity(Activity* a, int window) {
+  if (window < 2 || a->gps_count < 2) {
+    return 0;
+  }
+  size_t half = window / 2;
+  int64_t* ring = malloc((half + 2) * sizeof(int64_t));
+  if (ring == NULL) {
+    return -1;
+  }
+  SmoothInt32(a->latitude, a->gps_count, half, ring);
+  SmoothInt32(a->longitude, a->gps_count, half, ring);
+  SmoothUInt16(a->speed, a->gps_count, half, ring);
+  free(ring);
+  return 0;
+}
+
+// Min heap of points by triangle area, with the position of each point in
+// the heap so that the areas can be updated.
+typedef struct {
+  double* area;
+  size_t* heap;
+  size_t* position;
+  size_t size;
+} Heap;
+
+static void Swap(Heap* h, size_t i, size_t j) {
+  size_t point = h->heap[i];
+  h->heap[i] = h->heap[j];
+  h->heap[j] = point;
+  h->position[h->heap[i]] = i;
+  h->position[h->heap[j]] = j;
+}
+
+static void SiftUp(Heap* h, size_t i) {
+  while (i > 0 && h->area[h->heap[i]] < h->area[h->heap[(i - 1) / 2]]) {
+    Swap(h, i, (i - 1) / 2);
+    i = (i - 1) / 2;
+  }
+}
+
+static void SiftDown(Heap* h, size_t i) {
+  for (;;) {
+    size_t smallest = i;
+    size_t left = 2 * i + 1;
+    size_t right = left + 1;
+    if (left < h->size &&
+        h->area[h->heap[left]] < h->area[h->heap[smallest]]) {
+      smallest = left;
+    }
+    if (right < h->size &&
+        h->area[h->heap[right]] < h->area[h->heap[smallest]]) {
+      smallest = right;
+    }
+    if (smallest == i) {
+      return;
+    }
+    Swap(h, i, smallest);
+    i = smallest;
+  }
+}
+
+static size_t PopMin(Heap* h) {
+  size_t point = h->heap[0];
+  Swap(h, 0, --h->size);
+  SiftDown(h, 0);
+  return point;
+}
+
+static void Update(Heap* h, size_t point, double area) {
+  double old = h->area[point];
+  h->area[point] = area;
+  if (area < old) {
+    SiftUp(h, h->position[point]);
+  } else {
+    SiftDown(h, h->position[point]);
+  }
+}
+
+// Points projected in meters around the first one (equirectangular,
+// plenty for the size of an activity).
+typedef struct {
+  double x;
+  double y;
+} Point;
+
+static double Area(const Point* p, size_t a, size_t b, size_t c) {
+  return fabs((p[b].x - p[a].x) * (p[c].y - p[a].y) -
+              (p[c].x - p[a].x) * (p[b].y - p[a].y)) / 2;
+}
+
+int SimplifyActivity(Activity* a, double tolerance) {
+  size_t n = a->gps_count;
+  if (n < 3) {
+    return 0;
+  }
+  Point* points = malloc(n * sizeof(Point));
+  size_t* previous = malloc(n * sizeof(size_t));
+  size_t* next = malloc(n * sizeof(size_t));
+  Heap h;
+  h.area = malloc(n * sizeof(double));
+  h.heap = malloc(n * sizeof(size_t));
+  h.position = malloc(n * sizeof(size_t));
+  int result = -1;
+  if (points == NULL || previous == NULL || next == NULL ||
+      h.area == NULL || h.heap == NULL || h.position == NULL) {
+    goto cleanup;
+  }
+
+  const double kMetersPerUnit = 6371000.0 * PI / 180 * 1e-7;
+  double scale_x = kMetersPerUnit * cos(a->latitude[0] * 1e-7 * PI / 180);
+  for (size_t i = 0; i < n; ++i) {
+    points[i].x = (double)(a->longitude[i] - a->longitude[0]) * scale_x;
+    points[i].y = (double)(a->latitude[i] - a->latitude[0]) *
+                  kMetersPerUnit;
+    previous[i] = i - 1;
+    next[i] = i + 1;
+  }
+  // The ends are never dropped.
+  h.size = 0;
+  for (size_t i = 1; i + 1 < n; ++i) {
+    h.area[i] = Area(points, i - 1, i, i + 1);
+    h.heap[h.size] = i;
+    h.position[i] = h.size++;
+    SiftUp(&h, h.size - 1);
+  }
+  double threshold = tolerance * tolerance;
+  while (h.size > 0 && h.area[h.heap[0]] < threshold) {
+    double area = h.area[h.heap[0]];
+    size_t point = PopMin(&h);
+    size_t before = previous[point];
+    size_t after = next[point];
+    next[before] = after;
+    previous[after] = before;
+    // The neighbours never get smaller than the point dropped, so that the
+    // points are dropped in order of importance.
+    if (before > 0) {
+      double grown = Area(points, previous[before], before, after);
+      Update(&h, before, grown > area ? grown : area);
+    }
+    if (after + 1 < n) {
+      double grown = Area(points, before, after, next[after]);
+      Update(&h, after, grown > area ? grown : area);
+    }
+  }
+
+  // Compact the columns along the next links.
+  size_t count = 0;
+  float last_distance = 0;
+  for (size_t i = 0; i < n; i = next[i]) {
+    a->time[count] = a->time[i];
+    a->latitude[count] = a->latitude[i];
+    a->longitude[count] = a->longitude[i];
+    a->speed[count] = a->speed[i];
+    a->heading[count] = a->heading[i];
+    a->inc_distance[count] = count == 0 ? a->inc_distance[i] :
+        a->cum_distance[i] - last_distance;
+    last_distance = a->cum_distance[i];
+    a->cum_distance[count] = a->cum_distance[i];
+    a->calories[count] = a->calories[i];
+    a->cycles[count] = a->cycles[i];
+    ++count;
+  }
+  a->gps_count = count;
+  result = 0;
+
+cleanup:
+  free(points);
+  free(previous);
+  free(next);
+  free(h.area);
+  free(h.heap);
+  free(h.position);
+  return result;
+}
@@ -0,0 +1,22 @@
+#ifndef TRACK_H
+#define TRACK_H
+
+#include <stddef.h>
+
+#include "activity.h"
+
+// Post-decode processing of the GPS columns of an activity, in place.
+
+// Centered moving average of latitude, longitude and speed over window
+// samples (made odd, shrinking at both ends). O(n), whatever the window.
+// Returns -1 on allocation failure.
+int SmoothActivity(Activity* activity, int window);
+
+// Visvalingam-Whyatt simplification: repeatedly drops the point making the
+// smallest triangle with its neighbours until all the triangles left are
+// at least tolerance^2 m^2, then compacts the GPS columns. inc_distance of
+// the points left becomes the distance from the previous point left.
+// O(n log n). Returns -1 on allocation failure.
+int SimplifyActivity(Activity* activity, double tolerance);
+
+#endif  // TRACK_H
@@ -1,294 +1,1064 @@
+#define _POSIX_C_SOURCE 200809L
+
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
-#include <time.h>
-
-// Header (Tag 0x20)
-typedef struct __attribute__((__packed__)) {
-  uint8_t file_format; // Currently 07, have also seen 05
-  uint8_t version[4];  // Watch software version.
-  uint16_t unkown1;
-  uint32_t timestamp;  // Seconds since 1/1/1970
-  uint8_t unknown2[105];
-} Header;
-
-// Record lengths (Tag 0x16)
-// This might be variable length???
-// Each entry is { uint8_t tag; uint16_t (length + 1); }
-// for example: 21 07 00
-typedef struct __attribute__((__packed__)) {
-  uint8_t entries[69];
-} RecordLengths;
-
-// Tag 0x22
-typedef struct __attribute__((__packed__)) {
-  int32_t latitude;  // in 1e-7 degrees
-  int32_t longitude; // in 1e-7 degrees
-  uint16_t heading;  // degrees * 100, 0 = North, 9000 = East...
-  uint16_t speed;  // 100 * m/s
-  uint32_t time; // seconds since 1970
-  uint16_t calories;
-  float inc_distance;
-  float cum_distance;
-  uint8_t cycles; // Tomtom CSV calls it "cycles", maybe steps?
-} GPS;
-
-// Tag 0x25
-typedef struct __attribute__((__packed__)) {
-  uint8_t heart_rate;
-  uint8_t u1;
-  uint32_t time;
-} HeartRate;
-
-// Tag 0x21
-typedef struct __attribute__((__packed__)) {
-  uint8_t lap;
-  uint8_t activity;
-  uint32_t time;
-} Lap;
-
-typedef struct __attribute__((__packed__)) {
-  uint8_t u[2];
-  uint32_t time;
-} UnknownAndTime;
-
-// Tag 0x27
-typedef struct __attribute__((__packed__)) {
-  uint32_t activity_type;  // 7 = treadmill?
-  uint32_t distance;  // meters.
-  uint32_t duration;  // seconds (add 1).
-  uint32_t calories;
-} Summary;
-
-// Tag 0x32
-typedef struct __attribute__((__packed__)) {
-  uint32_t time;  // seconds since 1970
-  float distance; // meters
-  uint32_t calories;
-  uint32_t steps;  // steps?
-  uint16_t u2;
-} Treadmill;
-
-// Tag 0x23 ??
-typedef struct __attribute__((__packed__)) {
-  uint16_t u1;
-  uint16_t u2;
-  uint8_t u3;
-  uint8_t u4[4];
-  uint8_t u5[4];
-  uint16_t u6;
-  uint8_t u7[4];
-} R23;
-
-typedef struct __attribute__((__packed__)) {
-  uint32_t time;  // Seconds since 1/1/1970
-  uint8_t u[14];
-  uint32_t calories;
-} Swim;
-
-void ReadStruct(FILE* f, void* data, int size) {
-  if (fread(data, 1, size, f) != size) {
-    perror("Failed to read the file");
-    exit(-1);
-  }
-}
-
-// Activities:
-// 0: Run
-// 1: Cycle
-// 2: Swim
-// 7: Treadmill
-
-const char* GetActivityType(uint8_t activity) {
-  static char type[128];
-  switch(activity) {
-    case 0: return "Run";
-    case 1: return "Cycle";
-    case 2: return "Swim";
-    case 7: return "Treadmill";
-    default:
-      snprintf(type, sizeof(type), "Type %i", activity);
-      return type;
-  }
-}
-
-const char* GetGMTTime(uint32_t seconds) {
-  time_t tt = seconds;
-  static char buffer[128];
-  if (strftime(buffer, sizeof(buffer), "%F %T", gmtime(&tt)) > 0) {
-    return buffer;
-  }
-  return "";
-}
-
-const char* GetLocalTime(uint32_t seconds) {
-  time_t tt = seconds;
-  static char buffer[128];
-  if (strftime(buffer, sizeof(buffer), "%F %T", localtime(&tt)) > 0) {
-    return buffer;
-  }
-  return "";
-}
-
-void ReadAndDump(int size, FILE* f) {
-  uint8_t buffer[256];
-  if (fread(buffer, 1, size, f) != size) {
-    perror("Failed to read the file");
-    exit(-1);
-  }
+#include <string.h>
+#include <unistd.h>
+
+#include "activity.h"
+#include "archive.h"
+#include "batch.h"
+#include "cache.h"
+#include "export.h"
+#include "filter.h"
+#include "index.h"
+#include "instrument.h"
+#include "pipeline.h"
+#include "rollup.h"
+#include "server.h"
+#include "splits.h"
+#include "stats.h"
+#include "timefmt.h"
+#include "track.h"
+#include "ttbin.h"
+
+// Text dump of the records, one per file (or thread).
+typedef struct {
+  FILE* out;
+  TimeFormatter gmt;
+  TimeFormatter local;
+  char time[TIME_BUFFER_SIZE];
+  char activity[16];
+} Dumper;
+
+static void InitDumper(Dumper* d, FILE* out) {
+  d->out = out;
+  InitTimeFormatter(&d->gmt, 0);
+  InitTimeFormatter(&d->local, 1);
+}
+
+static const char* GMTTime(Dumper* d, uint32_t seconds) {
+  return FormatTime(&d->gmt, seconds, d->time);
+}
+
+static const char* LocalTime(Dumper* d, uint32_t seconds) {
+  return FormatTime(&d->local, seconds, d->time);
+}
+
+static const char* ActivityType(Dumper* d, uint32_t activity) {
+  return FormatActivityType(activity, d->activity, sizeof(d->activity));
+}
+
+void Dump(FILE* out, const uint8_t* data, int size) {
   for (int i = 0; i < size; ++i) {
-    printf(" %02X", buffer[i]);
+    fprintf(out, " %02X", data[i]);
     if (i % 32 == 31) {
-      printf("\n");
+      fprintf(out, "\n");
     }
   }
   if (size % 32 != 0) {
-    printf("\n");
+    fprintf(out, "\n");
   }
 }
 
-void Dump(const uint8_t* data, int size) {
-  for (int i = 0; i < size; ++i) {
-    printf(" %02X", data[i]);
-    if (i % 32 == 31) {
-      printf("\n");
+static void DumpHeader(void* context, const Header* header) {
+  Dumper* d = context;
+  fprintf(d->out,
+          "[%s] Header: file format %i, watch version (%i,%i,%i,%i)\n",
+          GMTTime(d, header->timestamp), header->file_format,
+          header->version[0], header->version[1],
+          header->version[2], header->version[3]);
+}
+
+static void DumpRecordLengths(void* context, const RecordLengths* lengths) {
+  Dumper* d = context;
+  fprintf(d->out, "Record lengths:");
+  for (int i = 0; i + 3 <= sizeof(lengths->entries); i += 3) {
+    const uint8_t* entry = lengths->entries + i;
+    int length = entry[1] | (entry[2] << 8);
+    if (length > 0) {
+      fprintf(d->out, " %02X:%i", entry[0], length - 1);
     }
   }
-  if (size % 32 != 0) {
-    printf("\n");
+  fprintf(d->out, "\n");
+}
+
+static void DumpLap(void* context, const Lap* lap) {
+  Dumper* d = context;
+  fprintf(d->out, "[%s] Lap: %i activity: %s\n", GMTTime(d, lap->time),
+          lap->lap, ActivityType(d, lap->activity));
+}
+
+static void DumpGPS(void* context, const GPSSample* gps) {
+  Dumper* d = context;
+  fprintf(d->out, "\n");
+  if (gps->time != 0xffffffff) {
+    fprintf(d->out, "[%s] GPS: Lat: %f, Long: %f, Speed: %.2f m/s, "
+            "Cal: %i, Distance: %f m (+ %f m), Cycles: %i   "
+            "Heading %.2f\u00B0\n",
+            LocalTime(d, gps->time),
+            gps->latitude * 1e-7, gps->longitude * 1e-7, gps->speed * 0.01,
+            gps->calories, gps->cum_distance, gps->inc_distance,
+            gps->cycles, gps->heading * .01);
+  } else {
+    fprintf(d->out, "No GPS lock\n");
   }
+  fprintf(d->out, "\n");
 }
 
-int main(int argc, char** argv) {
-  if (argc < 2) {
-    printf("Need the filename.\n");
+static void DumpR23(void* context, const R23* r23) {
+  Dumper* d = context;
+  fprintf(d->out, "Tag 0x23: %04X  %04X  %02X\n", r23->u1, r23->u2,
+          r23->u3);
+  Dump(d->out, (const uint8_t*)r23, sizeof(R23));
+}
+
+static void DumpHeartRate(void* context, const HeartRateSample* heart) {
+  Dumper* d = context;
+  fprintf(d->out, "[%s] Heart BPM: %i\n", GMTTime(d, heart->time),
+          heart->heart_rate);
+}
+
+static void DumpSummary(void* context, const Summary* summary) {
+  Dumper* d = context;
+  fprintf(d->out, "Summary:\n  Activity type: %s\n  Distance %im\n"
+          "  Duration: %i s\n  Calories: %i\n",
+          ActivityType(d, summary->activity_type), summary->distance,
+          summary->duration + 1, summary->calories);
+}
+
+static void DumpTreadmill(void* context, const Treadmill* treadmill) {
+  Dumper* d = context;
+  fprintf(d->out,
+          "[%s] Treadmill: Distance: %.2f m  Calories: %i  Steps: %i\n",
+          GMTTime(d, treadmill->time), treadmill->distance,
+          treadmill->calories, treadmill->steps);
+}
+
+static void DumpSwim(void* context, const Swim* swim) {
+  Dumper* d = context;
+  fprintf(d->out, "Swim: %s Calories: %i\n", GMTTime(d, swim->time),
+          swim->calories);
+  for (int i = 0; i < sizeof(swim->u); ++i) {
+    fprintf(d->out, " %02X", swim->u[i]);
+  }
+  fprintf(d->out, "\n");
+}
+
+static void DumpR35(void* context, const UnknownAndTime* r35) {
+  Dumper* d = context;
+  fprintf(d->out, "Tag 0x35: %02X %02X  %s\n", r35->u[0], r35->u[1],
+          LocalTime(d, r35->time));
+}
+
+static void DumpRaw(void* context, uint8_t tag, const uint8_t* data,
+                    int size) {
+  Dumper* d = context;
+  fprintf(d->out, "Tag 0x%02X: ", tag);
+  Dump(d->out, data, size);
+}
+
+static void DumpUnknownTag(void* context, uint8_t tag, size_t offset) {
+  Dumper* d = context;
+  fprintf(d->out, "Unknow tag: %02X at %li\n", tag, (long)offset);
+}
+
+static void DumpCorrupt(void* context, size_t offset, size_t size) {
+  Dumper* d = context;
+  fprintf(d->out, "Corrupt data: %li bytes skipped at %li\n", (long)size,
+          (long)offset);
+}
+
+static const TTBinVisitor kDumper = {
+  .header = DumpHeader,
+  .record_lengths = DumpRecordLengths,
+  .lap = DumpLap,
+  .gps = DumpGPS,
+  .r23 = DumpR23,
+  .heart_rate = DumpHeartRate,
+  .summary = DumpSummary,
+  .treadmill = DumpTreadmill,
+  .swim = DumpSwim,
+  .r35 = DumpR35,
+  .raw = DumpRaw,
+  .unknown_tag = DumpUnknownTag,
+  .corrupt = DumpCorrupt,
+};
+
+// Dumps the records as they arrive, for live inputs.
+int DumpStream(FILE* in, FILE* out) {
+  TTBinStream* stream = malloc(sizeof(TTBinStream));
+  if (stream == NULL) {
+    return -1;
+  }
+  Dumper dumper;
+  InitDumper(&dumper, out);
+  TTBinVisitor visitor = kDumper;
+  visitor.context = &dumper;
+  InitTTBinStream(stream, &visitor);
+  STATS_FILE();
+  uint8_t buffer[4096];
+  ssize_t count;
+  for (;;) {
+    STATS_BEGIN(outer, PHASE_IO);
+    count = read(fileno(in), buffer, sizeof(buffer));
+    STATS_END(outer);
+    if (count <= 0) {
+      break;
+    }
+    FeedTTBinStream(stream, buffer, count);
+    fflush(out);
+  }
+  // Never fails, damaged data is reported in the dump.
+  int result = FinishTTBinStream(stream);
+  free(stream);
+  return result;
+}
+
+int DumpFile(const char* filename, FILE* out) {
+  if (strcmp(filename, "-") == 0) {
+    return DumpStream(stdin, out);
+  }
+  InputFile input;
+  if (OpenInputFile(filename, &input) < 0) {
+    fprintf(stderr, "Failed to open: %s\n", filename);
+    return -1;
+  }
+  Dumper dumper;
+  InitDumper(&dumper, out);
+  TTBinVisitor visitor = kDumper;
+  visitor.context = &dumper;
+  int result = ParseTTBin(input.data, input.size, &visitor);
+  CloseInputFile(&input);
+  return result;
+}
+
+static int DumpJob(const char* filename, FILE* out, void* context,
+                   Arena* arena) {
+  return DumpFile(filename, out);
+}
+
+static void IndexPath(const char* filename, char* path, size_t size) {
+  snprintf(path, size, "%s.idx", filename);
+}
+
+// Writes the "<file>.idx" sidecar.
+int IndexFile(const char* filename) {
+  InputFile input;
+  if (OpenInputFile(filename, &input) < 0) {
+    fprintf(stderr, "Failed to open: %s\n", filename);
+    return -1;
+  }
+  TTBinIndex index;
+  int result = BuildIndex(input.data, input.size, &index);
+  CloseInputFile(&input);
+  if (result < 0) {
+    fprintf(stderr, "Failed to index: %s\n", filename);
+  } else {
+    char path[4096];
+    IndexPath(filename, path, sizeof(path));
+    result = SaveIndex(&index, path);
+    if (result < 0) {
+      fprintf(stderr, "Failed to write: %s\n", path);
+    }
+  }
+  FreeIndex(&index);
+  return result;
+}
+
+static int IndexJob(const char* filename, FILE* out, void* context,
+                    Arena* arena) {
+  return IndexFile(filename);
+}
+
+// The sidecar of the file when it is up to date, otherwise a new index.
+static int ReadIndex(const char* filename, const InputFile* input,
+                     TTBinIndex* index) {
+  char path[4096];
+  IndexPath(filename, path, sizeof(path));
+  if (LoadIndex(path, input->data, input->size, index) == 0) {
+    return 0;
+  }
+  if (BuildIndex(input->data, input->size, index) < 0) {
+    fprintf(stderr, "Failed to index: %s\n", filename);
+    return -1;
+  }
+  return 0;
+}
+
+// Dumps one lap (lap >= 0) or the seconds from first to last after the
+// first GPS sample. Uses the sidecar when it is up to date.
+int DumpRange(const char* filename, int lap, uint32_t first, uint32_t last,
+              FILE* out) {
+  InputFile input;
+  if (OpenInputFile(filename, &input) < 0) {
+    fprintf(stderr, "Failed to open: %s\n", filename);
+    return -1;
+  }
+  TTBinIndex index;
+  int result = ReadIndex(filename, &input, &index);
+  TTBinRange range;
+  if (result == 0 && lap >= 0) {
+    result = IndexLapRange(&index, lap, &range);
+  } else if (result == 0) {
+    uint32_t start = IndexStartTime(&index);
+    result = IndexTimeRange(&index, start + first,
+                            last == 0xffffffff ? last : start + last, &range);
+  }
+  if (result == 0) {
+    Dumper dumper;
+    InitDumper(&dumper, out);
+    TTBinVisitor visitor = kDumper;
+    visitor.context = &dumper;
+    result = ParseTTBinRange(input.data, &range, &visitor);
+  }
+  FreeIndex(&index);
+  CloseInputFile(&input);
+  return result;
+}
+
+// Dumps the records passing the filter expression, -e.
+int DumpFiltered(const char* filename, const TTBinFilter* filter, FILE* out) {
+  InputFile input;
+  if (OpenInputFile(filename, &input) < 0) {
+    fprintf(stderr, "Failed to open: %s\n", filename);
     return -1;
   }
+  TTBinIndex index;
+  int result = ReadIndex(filename, &input, &index);
+  if (result == 0) {
+    Dumper dumper;
+    InitDumper(&dumper, out);
+    TTBinVisitor visitor = kDumper;
+    visitor.context = &dumper;
+    result = FilterTTBin(input.data, &index, filter, &visitor);
+  }
+  FreeIndex(&index);
+  CloseInputFile(&input);
+  return result;
+}
 
-  FILE* f = fopen(argv[1], "r");
-  if (f == NULL) {
-    printf("Failed to open: %s\n", argv[1]);
+// Track processing applied after decoding, -m and -r.
+typedef struct {
+  int smooth;       // Window in samples, 0 = none.
+  double simplify;  // Tolerance in meters, 0 = none.
+  JoinOptions join;  // Heart rate of the CSV, -p.
+  DecodeCache cache;  // Of the decoded files, -k, dir NULL = none.
+} Processing;
+
+// Decodes a .ttbin file, or reads it from the cache when it was decoded
+// before. Damaged files aren't cached so that the warning stays.
+static int DecodeCached(const InputFile* input, Arena* arena,
+                        const DecodeCache* cache, Activity* activity) {
+  if (cache == NULL || cache->dir == NULL) {
+    return DecodeActivityInArena(input->data, input->size, arena, activity);
+  }
+  uint64_t key = XXH64(input->data, input->size, 0);
+  if (LoadCachedActivity(cache, key, arena, activity) == 0) {
+    return 0;
+  }
+  FreeActivity(activity);
+  if (DecodeActivityInArena(input->data, input->size, arena, activity) < 0) {
     return -1;
   }
+  if (activity->corrupt_bytes == 0 &&
+      StoreCachedActivity(cache, key, activity) < 0) {
+    fprintf(stderr, "Failed to cache in: %s\n", cache->dir);
+  }
+  return 0;
+}
 
-  uint8_t buffer[255];
+// Decodes a .ttbin file or an archive held in input, into the arena if
+// not NULL. name is for the messages.
+static int DecodeInput(const char* name, const InputFile* input,
+                       Arena* arena, const Processing* processing,
+                       Activity* activity) {
+  int result;
+  if (IsArchive(input->data, input->size)) {
+    STATS_BEGIN(outer, PHASE_DECODE);
+    result = ReadArchiveInArena(input->data, input->size, arena, activity);
+    STATS_END(outer);
+  } else {
+    result = DecodeCached(input, arena, processing ? &processing->cache : NULL,
+                          activity);
+  }
+  if (result < 0) {
+    fprintf(stderr, "Failed to decode: %s\n", name);
+    return -1;
+  }
+  if (activity->corrupt_bytes > 0) {
+    fprintf(stderr, "Skipped %zu corrupt bytes in: %s\n",
+            activity->corrupt_bytes, name);
+  }
+  if (processing != NULL &&
+      ((processing->smooth > 0 &&
+        SmoothActivity(activity, processing->smooth) < 0) ||
+       (processing->simplify > 0 &&
+        SimplifyActivity(activity, processing->simplify) < 0))) {
+    fprintf(stderr, "Out of memory: %s\n", name);
+    return -1;
+  }
+  return 0;
+}
+
+// Decodes a .ttbin file or reads an archive, into the arena if not NULL.
+int LoadActivity(const char* filename, Arena* arena,
+                 const Processing* processing, Activity* activity) {
+  InputFile input;
+  if (OpenInputFile(filename, &input) < 0) {
+    fprintf(stderr, "Failed to open: %s\n", filename);
+    memset(activity, 0, sizeof(*activity));
+    return -1;
+  }
+  int result = DecodeInput(filename, &input, arena, processing, activity);
+  CloseInputFile(&input);
+  return result;
+}
+
+static int WriteCSVActivity(Activity* activity, const Processing* processing,
+                            FILE* out) {
+  STATS_BEGIN(outer, PHASE_FORMAT);
+  int result = WriteCSV(activity, &processing->join, out);
+  if (result < 0) {
+    perror("Failed to write the CSV");
+  }
+  STATS_END(outer);
+  FreeActivity(activity);
+  return result;
+}
+
+static int WriteArchiveActivity(Activity* activity, FILE* out) {
+  STATS_BEGIN(outer, PHASE_FORMAT);
+  int result = WriteArchive(activity, out);
+  if (result < 0) {
+    perror("Failed to write the archive");
+  }
+  STATS_END(outer);
+  FreeActivity(activity);
+  return result;
+}
+
+int ExportCSV(const char* filename, Arena* arena,
+              const Processing* processing, FILE* out) {
+  Activity activity;
+  if (LoadActivity(filename, arena, processing, &activity) < 0) {
+    FreeActivity(&activity);
+    return -1;
+  }
+  return WriteCSVActivity(&activity, processing, out);
+}
+
+int ExportArchive(const char* filename, Arena* arena,
+                  const Processing* processing, FILE* out) {
+  Activity activity;
+  if (LoadActivity(filename, arena, processing, &activity) < 0) {
+    FreeActivity(&activity);
+    return -1;
+  }
+  return WriteArchiveActivity(&activity, out);
+}
+
+// GPX, TCX or FIT, streamed from the records.
+int ExportTrack(const char* filename, TrackWriter writer, FILE* out) {
+  InputFile input;
+  if (OpenInputFile(filename, &input) < 0) {
+    fprintf(stderr, "Failed to open: %s\n", filename);
+    return -1;
+  }
+  int result = -1;
+  if (IsArchive(input.data, input.size)) {
+    fprintf(stderr, "Needs a .ttbin file: %s\n", filename);
+  } else {
+    // The records parsed on the way are charged to decode.
+    STATS_BEGIN(outer, PHASE_FORMAT);
+    result = writer(input.data, input.size, out);
+    STATS_END(outer);
+    if (result < 0) {
+      fprintf(stderr, "Failed to export: %s\n", filename);
+    }
+  }
+  CloseInputFile(&input);
+  return result;
+}
+
+// The CSV export on three threads, -w. Archives and -r need the whole
+// activity and use ExportCSV().
+int PipelineExportCSV(const char* filename, const Processing* processing,
+                      FILE* out) {
+  InputFile input;
+  if (OpenInputFile(filename, &input) < 0) {
+    fprintf(stderr, "Failed to open: %s\n", filename);
+    return -1;
+  }
+  if (IsArchive(input.data, input.size) || processing->simplify > 0) {
+    CloseInputFile(&input);
+    return ExportCSV(filename, NULL, processing, out);
+  }
+  PipelineOptions options = { processing->join, processing->smooth };
+  size_t corrupt_bytes = 0;
+  // The stages overlap, all of it is charged to format.
+  STATS_BEGIN(outer, PHASE_FORMAT);
+  int result = PipelineCSV(input.data, input.size, &options, out,
+                           &corrupt_bytes);
+  STATS_END(outer);
+  CloseInputFile(&input);
+  if (corrupt_bytes > 0) {
+    fprintf(stderr, "Skipped %zu corrupt bytes in: %s\n", corrupt_bytes,
+            filename);
+  }
+  if (result < 0) {
+    perror("Failed to write the CSV");
+  }
+  return result;
+}
 
+static int TrackJob(const char* filename, FILE* out, void* context,
+                    Arena* arena) {
+  const TrackWriter* writer = context;
+  return ExportTrack(filename, *writer, out);
+}
+
+static int CSVJob(const char* filename, FILE* out, void* context,
+                  Arena* arena) {
+  return ExportCSV(filename, arena, context, out);
+}
+
+static int ArchiveJob(const char* filename, FILE* out, void* context,
+                      Arena* arena) {
+  return ExportArchive(filename, arena, context, out);
+}
+
+// Time in the heart rate zones given as "120,140,160" and pace zones.
+int PrintStats(const char* filename, const char* zones, FILE* out) {
+  StatsOptions options = { 0 };
+  const char* p = zones;
+  while (*p != '\0') {
+    char* end;
+    long bpm = strtol(p, &end, 10);
+    if (end == p || (*end != ',' && *end != '\0') ||
+        (*end == ',' && end[1] == '\0') || bpm < 1 || bpm > 255 ||
+        options.heart_zone_count == STATS_MAX_ZONES) {
+      fprintf(stderr, "The zones must be up to %i BPMs from 1 to 255 "
+              "separated by commas: %s\n", STATS_MAX_ZONES, zones);
+      return -1;
+    }
+    options.heart_zones[options.heart_zone_count++] = bpm;
+    p = *end == ',' ? end + 1 : end;
+  }
+  // 10:00, 8:00, 6:00, 5:00 and 4:00 min/km.
+  static const int kPaces[] = { 600, 480, 360, 300, 240 };
+  for (int i = 0; i < 5; ++i) {
+    options.speed_zones[options.speed_zone_count++] =
+        SpeedFromPace(kPaces[i]);
+  }
+  Activity activity;
+  int result = LoadActivity(filename, NULL, NULL, &activity);
+  ActivityStats stats;
+  if (result == 0 && ComputeStats(&activity, &options, &stats) < 0) {
+    fprintf(stderr, "The zones must be ascending and above 0 BPM\n");
+    result = -1;
+  }
+  FreeActivity(&activity);
+  if (result < 0) {
+    return -1;
+  }
+  fprintf(out, "Heart rate: %zu s, average %.1f BPM, max %i BPM\n",
+          stats.heart_samples, stats.average_heart_rate,
+          stats.max_heart_rate);
+  for (int i = 0; i <= options.heart_zone_count; ++i) {
+    fprintf(out, "  Zone %i (from %i BPM): %zu s\n", i,
+            i == 0 ? 1 : options.heart_zones[i - 1],
+            stats.time_in_heart_zone[i]);
+  }
+  fprintf(out, "Speed: %zu s moving, average %.2f m/s, max %.2f m/s\n",
+          stats.moving_samples, stats.average_speed, stats.max_speed);
+  for (int i = 0; i <= options.speed_zone_count; ++i) {
+    if (i == 0) {
+      fprintf(out, "  Slower than %i:%02i min/km: %zu s\n",
+              kPaces[0] / 60, kPaces[0] % 60, stats.time_in_speed_zone[i]);
+    } else {
+      fprintf(out, "  From %i:%02i min/km: %zu s\n", kPaces[i - 1] / 60,
+              kPaces[i - 1] % 60, stats.time_in_speed_zone[i]);
+    }
+  }
+  return 0;
+}
+
+// Average of a sum over count samples, 0 if none.
+static double Average(uint64_t sum, uint32_t count) {
+  return count > 0 ? (double)sum / count : 0;
+}
+
+static void PrintPace(double speed, FILE* out) {
+  if (speed <= 0) {
+    fprintf(out, "no pace");
+    return;
+  }
+  int pace = (int)(1000 / speed + 0.5);
+  fprintf(out, "%i:%02i min/km", pace / 60, pace % 60);
+}
+
+// Lap splits and the best 30 s and 5 min averages, gathered while parsing.
+int PrintSplits(const char* filename, FILE* out) {
+  InputFile input;
+  if (OpenInputFile(filename, &input) < 0) {
+    fprintf(stderr, "Failed to open: %s\n", filename);
+    return -1;
+  }
+  if (IsArchive(input.data, input.size)) {
+    // The laps of an archive are no longer between the samples.
+    fprintf(stderr, "Not a .ttbin file: %s\n", filename);
+    CloseInputFile(&input);
+    return -1;
+  }
+  Splits splits;
+  InitSplits(&splits);
+  int result = ReadSplits(input.data, input.size, &splits);
+  CloseInputFile(&input);
+  if (splits.corrupt_bytes > 0) {
+    fprintf(stderr, "Skipped %zu corrupt bytes in: %s\n",
+            splits.corrupt_bytes, filename);
+  }
+  if (result < 0) {
+    fprintf(stderr, "Out of memory, some laps are missing: %s\n", filename);
+  }
+  Dumper d;
+  InitDumper(&d, out);
+  for (size_t i = 0; i < splits.lap_count; ++i) {
+    const LapSplit* lap = &splits.laps[i];
+    double speed = Average(lap->speed_sum, lap->gps_samples) * SPEED_SCALE;
+    fprintf(out, "Lap %i [%s] %s: %u s, %.0f m, average %.2f m/s (", lap->lap,
+            GMTTime(&d, lap->start_time), ActivityType(&d, lap->activity),
+            lap->duration, lap->distance, speed);
+    PrintPace(speed, out);
+    fprintf(out, "), max %.2f m/s, average %.1f BPM, max %i BPM\n",
+            lap->max_speed * SPEED_SCALE,
+            Average(lap->heart_sum, lap->heart_samples), lap->max_heart_rate);
+  }
+  for (int i = 0; i < SPLITS_WINDOWS; ++i) {
+    const RollingWindow* speed = &splits.speed[i];
+    const RollingWindow* heart = &splits.heart[i];
+    if (speed->length % 60 == 0) {
+      fprintf(out, "Best %u min: ", speed->length / 60);
+    } else {
+      fprintf(out, "Best %u s: ", speed->length);
+    }
+    fprintf(out, "%.2f m/s (", speed->best * SPEED_SCALE);
+    PrintPace(speed->best * SPEED_SCALE, out);
+    fprintf(out, "), %.1f BPM\n", heart->best);
+  }
+  FreeSplits(&splits);
+  return result;
+}
+
+// The -s line of the file held in data.
+static int WriteSummary(const char* name, const uint8_t* data, size_t size,
+                        FILE* out) {
   Header header;
-  RecordLengths record_lengths;
-  GPS gps;
-  HeartRate heart;
   Summary summary;
-  Treadmill treadmill;
-  Swim swim;
-  Lap lap;
-  UnknownAndTime r35;
-  R23 r23;
-  while(!feof(f)) {
-    if (fread(buffer, 1, 1, f) < 1) {
-      return 0;
+  if (ReadTTBinSummary(data, size, &header, &summary) < 0) {
+    fprintf(stderr, "No summary in: %s\n", name);
+    return -1;
+  }
+  Dumper d;
+  InitDumper(&d, out);
+  fprintf(out, "%s: [%s] %s %i m %i s %i cal\n", name,
+          GMTTime(&d, header.timestamp),
+          ActivityType(&d, summary.activity_type), summary.distance,
+          summary.duration + 1, summary.calories);
+  return 0;
+}
+
+// One line with the totals, without decoding the samples.
+int PrintSummary(const char* filename, FILE* out) {
+  InputFile input;
+  if (OpenInputFile(filename, &input) < 0) {
+    fprintf(stderr, "Failed to open: %s\n", filename);
+    return -1;
+  }
+  int result = WriteSummary(filename, input.data, input.size, out);
+  CloseInputFile(&input);
+  return result;
+}
+
+static int SummaryJob(const char* filename, FILE* out, void* context,
+                      Arena* arena) {
+  return PrintSummary(filename, out);
+}
+
+// The outputs of the daemon, -d. The context is the Processing.
+static int SummaryRequest(const char* name, const uint8_t* data, size_t size,
+                          FILE* out, void* context, Arena* arena) {
+  return WriteSummary(name, data, size, out);
+}
+
+static int CSVRequest(const char* name, const uint8_t* data, size_t size,
+                      FILE* out, void* context, Arena* arena) {
+  InputFile input = { data, size, 0 };
+  Activity activity;
+  if (DecodeInput(name, &input, arena, context, &activity) < 0) {
+    FreeActivity(&activity);
+    return -1;
+  }
+  return WriteCSVActivity(&activity, context, out);
+}
+
+static int ColumnsRequest(const char* name, const uint8_t* data, size_t size,
+                          FILE* out, void* context, Arena* arena) {
+  InputFile input = { data, size, 0 };
+  Activity activity;
+  if (DecodeInput(name, &input, arena, context, &activity) < 0) {
+    FreeActivity(&activity);
+    return -1;
+  }
+  return WriteArchiveActivity(&activity, out);
+}
+
+// Client of the daemon, -y: requests the files one after the other on the
+// same connection, "-" sends stdin.
+int RequestFiles(const char* socket_path, ServerOutput output, char** paths,
+                 int count, FILE* out) {
+  int fd = ConnectServer(socket_path);
+  if (fd < 0) {
+    perror(socket_path);
+    return -1;
+  }
+  int result = 0;
+  for (int i = 0; i < count; ++i) {
+    if (strcmp(paths[i], "-") != 0) {
+      if (RequestServer(fd, output, paths[i], NULL, 0, out) < 0) {
+        result = -1;
+      }
+      continue;
     }
-    uint8_t tag = buffer[0];
-    switch(tag) {
-      case 0x20:
-        ReadStruct(f, &header, sizeof(header));
-        printf("[%s] Header: file format %i, watch version (%i,%i,%i,%i)\n",
-                GetGMTTime(header.timestamp), header.file_format,
-                header.version[0], header.version[1],
-                header.version[2], header.version[3]);
-        break;
+    InputFile input;
+    if (OpenInputFile("/dev/stdin", &input) < 0) {
+      fprintf(stderr, "Failed to open: %s\n", paths[i]);
+      result = -1;
+      continue;
+    }
+    if (RequestServer(fd, output, paths[i], input.data, input.size, out) < 0) {
+      result = -1;
+    }
+    CloseInputFile(&input);
+  }
+  close(fd);
+  return result;
+}
 
-      case 0x16:
-        ReadStruct(f, &record_lengths, sizeof(record_lengths));
-        printf("Record lengths (ignored)\n");
-        break;
+// Totals by week or month and activity type, over all the files.
+int PrintRollup(char** paths, int count, RollupPeriod by, int threads,
+                FILE* out) {
+  Rollup rollup;
+  InitRollup(&rollup, by);
+  int failures = RunRollup(paths, count, threads, &rollup);
+  if (rollup.failed) {
+    fprintf(stderr, "Out of memory, the totals are incomplete\n");
+    ++failures;
+  }
+  if (WriteRollup(&rollup, out) < 0) {
+    perror("Failed to write the totals");
+    ++failures;
+  }
+  FreeRollup(&rollup);
+  return failures == 0 ? 0 : -1;
+}
 
-      case 0x21:
-        ReadStruct(f, &lap, sizeof(lap));
-        printf("[%s] Lap: %i activity: %s\n", GetGMTTime(lap.time), lap.lap,
-               GetActivityType(lap.activity));
-        break;
+void Usage(void) {
+  printf("Usage: ttbin [-c|-a] file.ttbin (- dumps stdin as it arrives)\n"
+         "       ttbin -c|-a [-p policy] [-m samples] [-r meters]\n"
+         "                   [-k dir[:MB]] file.ttbin\n"
+         "       ttbin -c -w [-p policy] [-m samples] file.ttbin\n"
+         "       ttbin -g|-x|-f file.ttbin\n"
+         "       ttbin -i|-s|-n file.ttbin\n"
+         "       ttbin -z 120,140,160 file.ttbin\n"
+         "       ttbin -u week|month [-j threads] files/dirs...\n"
+         "       ttbin -l lap | -t from[:to] file.ttbin\n"
+         "       ttbin -e filter file.ttbin\n"
+         "       ttbin -d socket [-j threads] [-p policy] [-m samples]\n"
+         "       ttbin -y socket [-c|-a|-s] files...\n"
+         "       ttbin -b [-c|-a|-g|-x|-f|-i|-s] [-j threads] [-o dir] "
+         "files/dirs...\n"
+         "  -c  Export in the Tomtom CSV format.\n"
+         "  -a  Convert to the compact columnar archive format.\n"
+         "      Archives can be used instead of .ttbin files with -c.\n"
+         "  -p  Heart rate of the CSV samples: hold (last reading, the\n"
+         "      default), interpolate or null (same second only), with\n"
+         "      :seconds for the largest gap bridged, e.g. hold:5.\n"
+         "  -k  With -c or -a, keeps the decoded files in dir, up to 256 MB\n"
+         "      (or the given MB), the least recently used go first.\n"
+         "  -w  With -c, decodes, joins and writes on three threads, for\n"
+         "      very large files.\n"
+         "  -m  With -c or -a, smooths the positions and speed over a\n"
+         "      window of that many samples.\n"
+         "  -r  With -c or -a, drops the points within about that many\n"
+         "      meters of the track (Visvalingam).\n"
+         "  -b  Batch mode, decodes all the files in parallel.\n"
+         "  -j  Number of threads in batch mode, one per core by default.\n"
+         "  -o  Writes one output per file in dir instead of stdout.\n"
+         "  -q  Files read ahead of the threads in batch mode, 16 by\n"
+         "      default, 0 for none.\n"
+         "  -g  Exports a GPX track.\n"
+         "  -x  Exports a TCX activity.\n"
+         "  -f  Exports a FIT activity file.\n"
+         "  -i  Writes a file.ttbin.idx index next to each file.\n"
+         "  -s  Prints the totals of the summary only, quickly.\n"
+         "  -n  Prints the lap splits and the best 30 s and 5 min speed\n"
+         "      and heart rate, in one pass over the records.\n"
+         "  -u  Totals of the summaries and heart rate by week (from\n"
+         "      Monday) or month and activity type, as CSV.\n"
+         "  -z  Prints the time in the heart rate zones starting at the\n"
+         "      given BPMs and in pace zones, with averages and maximums.\n"
+         "  -l  Dumps only the given lap.\n"
+         "  -t  Dumps only from:to, in seconds after the first GPS sample\n"
+         "      (to can be omitted). Uses the index when there is one.\n"
+         "  -e  Dumps only the samples matching all of: time=from:to (as\n"
+         "      -t), lap=n, speed>m/s, hr>bpm (also >=, <, <=, =), e.g.\n"
+         "      lap=2,speed>=3.5. speed keeps GPS samples and hr heart\n"
+         "      rate records, they can't be combined. Skips the index\n"
+         "      blocks out of bounds.\n"
+         "  -d  Runs as a daemon on the Unix socket, decoding with a pool\n"
+         "      of -j threads for the clients until SIGINT or SIGTERM.\n"
+         "      -p, -m, -r and -k apply to all its outputs.\n"
+         "  -y  Requests the summary (the default), CSV (-c) or archive\n"
+         "      (-a) of the files from the daemon on the socket; - sends\n"
+         "      stdin to it.\n");
+}
+
+#ifdef TTBIN_STATS
+static void ReportStats(void) {
+  WriteDecodeStats(stderr);
+}
+#endif
 
-      case 0x22:
-        printf("\n");
-        ReadStruct(f, &gps, sizeof(gps));
-        if (gps.time != 0xffffffff) {
-          printf("[%s] GPS: Lat: %f, Long: %f, Speed: %.2f m/s, "
-                 "Cal: %i, Distance: %f m (+ %f m), Cycles: %i   "
-                 "Heading %.2f\u00B0\n",
-                 GetLocalTime(gps.time),
-                 gps.latitude * 1e-7, gps.longitude * 1e-7, gps.speed * 0.01,
-                 gps.calories, gps.cycles,
-                 gps.cum_distance, gps.inc_distance, gps.heading * .01);
+int main(int argc, char** argv) {
+#ifdef TTBIN_STATS
+  atexit(ReportStats);
+#endif
+  int csv = 0;
+  int archive = 0;
+  int batch = 0;
+  int index = 0;
+  int summary = 0;
+  int splits = 0;
+  int pipeline = 0;
+  int rollup = -1;
+  const char* zones = NULL;
+  const char* filter = NULL;
+  const char* daemon = NULL;
+  const char* client = NULL;
+  TrackWriter writer = NULL;
+  Processing processing = { 0, 0, { JOIN_HOLD, 0 }, { NULL, 0 } };
+  const char* extension = NULL;
+  int lap = -1;
+  long first = -1;
+  long last = 0xffffffff;
+  BatchOptions options = { 0 };
+  int opt;
+  const char* flags = "cabfginswxd:e:j:k:l:m:o:p:q:r:t:u:y:z:";
+  while ((opt = getopt(argc, argv, flags)) != -1) {
+    switch (opt) {
+      case 'c':
+        csv = 1;
+        break;
+      case 'a':
+        archive = 1;
+        break;
+      case 'g':
+        writer = WriteGPX;
+        extension = ".gpx";
+        break;
+      case 'x':
+        writer = WriteTCX;
+        extension = ".tcx";
+        break;
+      case 'f':
+        writer = WriteFIT;
+        extension = ".fit";
+        break;
+      case 'b':
+        batch = 1;
+        break;
+      case 'i':
+        index = 1;
+        break;
+      case 's':
+        summary = 1;
+        break;
+      case 'n':
+        splits = 1;
+        break;
+      case 'w':
+        pipeline = 1;
+        break;
+      case 'l':
+        lap = atoi(optarg);
+        break;
+      case 't': {
+        char* end;
+        first = strtol(optarg, &end, 10);
+        if (*end == ':' && end[1] != '\0') {
+          last = strtol(end + 1, NULL, 10);
+        }
+        break;
+      }
+      case 'k': {
+        // Megabytes after a colon.
+        char* size = strrchr(optarg, ':');
+        processing.cache.max_size = CACHE_DEFAULT_SIZE;
+        if (size != NULL) {
+          *size = '\0';
+          processing.cache.max_size = strtoull(size + 1, NULL, 10) << 20;
+        }
+        processing.cache.dir = optarg;
+        break;
+      }
+      case 'm':
+        processing.smooth = atoi(optarg);
+        break;
+      case 'p': {
+        char* gap = strchr(optarg, ':');
+        size_t length = gap ? (size_t)(gap - optarg) : strlen(optarg);
+        if (strncmp(optarg, "hold", length) == 0) {
+          processing.join.policy = JOIN_HOLD;
+        } else if (strncmp(optarg, "interpolate", length) == 0) {
+          processing.join.policy = JOIN_INTERPOLATE;
+        } else if (strncmp(optarg, "null", length) == 0) {
+          processing.join.policy = JOIN_NULL;
         } else {
-          printf("No GPS lock\n");
+          Usage();
+          return -1;
         }
-        printf("\n");
+        processing.join.max_gap = gap ? atoi(gap + 1) : 0;
         break;
-
-      case 0x23:
-        ReadStruct(f, &r23, sizeof(r23));
-        printf("Tag 0x23: %04X  %04X  %02X\n", r23.u1, r23.u2, r23.u3);
-        Dump((const uint8_t*)&r23, sizeof(r23));
+      }
+      case 'r':
+        processing.simplify = atof(optarg);
         break;
-
-      case 0x25:
-        ReadStruct(f, &heart, sizeof(heart));
-        printf("[%s] Heart BPM: %i\n", GetGMTTime(heart.time),
-               heart.heart_rate);
+      case 'u':
+        if (strcmp(optarg, "week") == 0) {
+          rollup = ROLLUP_WEEK;
+        } else if (strcmp(optarg, "month") == 0) {
+          rollup = ROLLUP_MONTH;
+        } else {
+          Usage();
+          return -1;
+        }
         break;
-
-      case 0x26:
-        printf("Tag 0x26: ");
-        ReadAndDump(6, f);
+      case 'z':
+        zones = optarg;
         break;
-
-      case 0x27:
-        ReadStruct(f, &summary, sizeof(summary));
-        printf("Summary:\n  Activity type: %s\n  Distance %im\n"
-               "  Duration: %i s\n  Calories: %i\n",
-               GetActivityType(summary.activity_type), summary.distance,
-               summary.duration + 1, summary.calories);
+      case 'e':
+        filter = optarg;
         break;
-
-      case 0x30:
-        printf("Tag 0x30: ");
-        ReadAndDump(2, f);
+      case 'd':
+        daemon = optarg;
         break;
-
-      case 0x32:
-        ReadStruct(f, &treadmill, sizeof(Treadmill));
-        printf("[%s] Treadmill: Distance: %.2f m  Calories: %i  Steps: %i\n",
-               GetGMTTime(treadmill.time), treadmill.distance,
-               treadmill.calories, treadmill.steps);
+      case 'y':
+        client = optarg;
         break;
-
-      case 0x34:
-        ReadStruct(f, &swim, sizeof(swim));
-        printf("Swim: %s Calories: %i\n", GetGMTTime(swim.time),
-               swim.calories);
-        for (int i = 0; i < sizeof(swim.u); ++i) {
-          printf(" %02X", swim.u[i]);
-        }
-        printf("\n");
+      case 'j':
+        options.threads = atoi(optarg);
         break;
-
-
-      case 0x35:
-        ReadStruct(f, &r35, sizeof(r35));
-        printf("Tag 0x35: %02X %02X  %s\n", r35.u[0], r35.u[1],
-               GetLocalTime(r35.time));
+      case 'o':
+        options.output_dir = optarg;
         break;
-
-      case 0x37:
-        printf("Tag 0x37: ");
-        ReadAndDump(1, f);
+      case 'q':
+        // 0 turns the read ahead off.
+        options.prefetch = atoi(optarg) > 0 ? atoi(optarg) : -1;
         break;
-
       default:
-        printf("Unknow tag: %02X at %li\n", tag, ftell(f) - 1);
-        break;
+        Usage();
+        return -1;
     }
-  };
+  }
+  if (daemon != NULL) {
+    ServerOptions server = {
+      { SummaryRequest, CSVRequest, ColumnsRequest }, &processing,
+      options.threads
+    };
+    return RunServer(daemon, &server);
+  }
+  if (optind >= argc) {
+    printf("Need the filename.\n");
+    return -1;
+  }
 
-  return 0;
+  if (client != NULL) {
+    ServerOutput output = csv ? SERVER_CSV : archive ? SERVER_COLUMNS :
+                          SERVER_SUMMARY;
+    return RequestFiles(client, output, argv + optind, argc - optind, stdout);
+  }
+  if (rollup >= 0) {
+    return PrintRollup(argv + optind, argc - optind, rollup, options.threads,
+                       stdout);
+  }
+  if (batch) {
+    if (index) {
+      // The sidecars always go next to the files.
+      options.job = IndexJob;
+      options.output_dir = NULL;
+    } else if (writer != NULL) {
+      options.job = TrackJob;
+      options.context = &writer;
+      options.extension = extension;
+    } else if (summary) {
+      options.job = SummaryJob;
+      options.extension = ".txt";
+    } else if (archive) {
+      options.job = ArchiveJob;
+      options.context = &processing;
+      options.extension = ".tta";
+    } else if (csv) {
+      options.job = CSVJob;
+      options.context = &processing;
+      options.extension = ".csv";
+    } else {
+      options.job = DumpJob;
+      options.extension = ".txt";
+    }
+    return RunBatch(argv + optind, argc - optind, &options) == 0 ? 0 : -1;
+  }
+  if (index) {
+    return IndexFile(argv[optind]);
+  }
+  if (summary) {
+    return PrintSummary(argv[optind], stdout);
+  }
+  if (splits) {
+    return PrintSplits(argv[optind], stdout);
+  }
+  if (writer != NULL) {
+    return ExportTrack(argv[optind], writer, stdout);
+  }
+  if (zones != NULL) {
+    return PrintStats(argv[optind], zones, stdout);
+  }
+  if (filter != NULL) {
+    TTBinFilter parsed;
+    if (ParseFilter(filter, &parsed) < 0) {
+      fprintf(stderr, "Invalid filter: %s\n", filter);
+      Usage();
+      return -1;
+    }
+    return DumpFiltered(argv[optind], &parsed, stdout);
+  }
+  if (lap > 255 || (first >= 0 && last < first)) {
+    Usage();
+    return -1;
+  }
+  if (lap >= 0 || first >= 0) {
+    return DumpRange(argv[optind], lap, first, last, stdout);
+  }
+  if (archive) {
+    return ExportArchive(argv[optind], NULL, &processing, stdout);
+  }
+  if (csv && pipeline) {
+    return PipelineExportCSV(argv[optind], &processing, stdout);
+  }
+  if (csv) {
+    return ExportCSV(argv[optind], NULL, &processing, stdout);
+  }
+  return DumpFile(argv[optind], stdout);
 }
@@ -0,0 +1,299 @@
+#ifndef TTBIN_H
+#define TTBIN_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+// Header (Tag 0x20)
+typedef struct __attribute__((__packed__)) {
+  uint8_t file_format; // Currently 07, have also seen 05
+  uint8_t version[4];  // Watch software version.
+  uint16_t unkown1;
+  uint32_t timestamp;  // Seconds since 1/1/1970, watch local time
+  uint8_t unknown2[96];
+  uint32_t watch_time; // Same as timestamp?
+  int32_t local_time_offset; // Seconds, GPS time + offset = local time
+  uint8_t unknown3;
+} Header;
+
+// Record lengths (Tag 0x16)
+// This might be variable length???
+// Each entry is { uint8_t tag; uint16_t (length + 1); }
+// for example: 21 07 00
+typedef struct __attribute__((__packed__)) {
+  uint8_t entries[69];
+} RecordLengths;
+
+// Payload length of every tag, -1 when unknown.
+typedef struct {
+  int32_t length[256];
+} RecordLengthTable;
+
+// Tag 0x22
+typedef struct __attribute__((__packed__)) {
+  int32_t latitude;  // in 1e-7 degrees
+  int32_t longitude; // in 1e-7 degrees
+  uint16_t heading;  // degrees * 100, 0 = North, 9000 = East...
+  uint16_t speed;  // 100 * m/s
+  uint32_t time; // seconds since 1970
+  uint16_t calories;
+  float inc_distance;
+  float cum_distance;
+  uint8_t cycles; // Tomtom CSV calls it "cycles", maybe steps?
+} GPS;
+
+// Tag 0x22 in file format 5, handed to the visitor as a GPSSample with
+// the cumulative distance summed by the parser.
+typedef struct __attribute__((__packed__)) {
+  int32_t latitude;  // in 1e-7 degrees
+  int32_t longitude; // in 1e-7 degrees
+  uint16_t heading;  // degrees * 100, 0 = North, 9000 = East...
+  uint16_t speed;  // 100 * m/s, about 2% more than the Tomtom CSV.
+  uint16_t u1;
+  uint32_t time; // seconds since 1970, UTC unlike the other records
+  uint16_t calories;
+  uint16_t u2;
+  uint16_t u3;
+  uint16_t inc_distance; // decimeters
+  uint8_t cycles;
+} GPS5;
+
+// Tag 0x25
+typedef struct __attribute__((__packed__)) {
+  uint8_t heart_rate;
+  uint8_t u1;
+  uint32_t time;
+} HeartRate;
+
+// The GPS and heart rate records as handed to the visitors: the fields
+// of GPS (or GPS5) and HeartRate loaded to host order, naturally aligned,
+// so that the loops over them do plain loads on any target.
+typedef struct {
+  int32_t latitude;  // in 1e-7 degrees
+  int32_t longitude; // in 1e-7 degrees
+  uint16_t heading;  // degrees * 100, 0 = North, 9000 = East...
+  uint16_t speed;  // 100 * m/s
+  uint32_t time; // seconds since 1970, 0xffffffff without a lock
+  uint16_t calories;
+  float inc_distance;  // meters
+  float cum_distance;
+  uint8_t cycles;
+} GPSSample;
+
+typedef struct {
+  uint8_t heart_rate;
+  uint8_t u1;
+  uint32_t time;
+} HeartRateSample;
+
+// Tag 0x21
+typedef struct __attribute__((__packed__)) {
+  uint8_t lap;
+  uint8_t activity;
+  uint32_t time;
+} Lap;
+
+typedef struct __attribute__((__packed__)) {
+  uint8_t u[2];
+  uint32_t time;
+} UnknownAndTime;
+
+// Tag 0x27
+typedef struct __attribute__((__packed__)) {
+  uint32_t activity_type;  // 7 = treadmill?
+  uint32_t distance;  // meters.
+  uint32_t duration;  // seconds (add 1).
+  uint32_t calories;
+} Summary;
+
+// Tag 0x32
+typedef struct __attribute__((__packed__)) {
+  uint32_t time;  // seconds since 1970
+  float distance; // meters
+  uint32_t calories;
+  uint32_t steps;  // steps?
+  uint16_t u2;
+} Treadmill;
+
+// Tag 0x23 ??
+typedef struct __attribute__((__packed__)) {
+  uint16_t u1;
+  uint16_t u2;
+  uint8_t u3;
+  uint8_t u4[4];
+  uint8_t u5[4];
+  uint16_t u6;
+  uint8_t u7[4];
+} R23;
+
+typedef struct __attribute__((__packed__)) {
+  uint32_t time;  // Seconds since 1/1/1970
+  uint8_t u[14];
+  uint32_t calories;
+} Swim;
+
+// Callbacks receiving the decoded records, any of them can be NULL.
+// The records point into the parsed buffer (the GPS and heart rate ones
+// into a copy) and are only valid during the call.
+typedef struct {
+  void* context;
+  void (*header)(void* context, const Header* header);
+  void (*record_lengths)(void* context, const RecordLengths* lengths);
+  void (*lap)(void* context, const Lap* lap);
+  void (*gps)(void* context, const GPSSample* gps);
+  void (*r23)(void* context, const R23* r23);
+  void (*heart_rate)(void* context, const HeartRateSample* heart);
+  // Batched alternatives to gps and heart_rate, used instead of them when
+  // set: the records of the tag are copied into a buffer and handed over
+  // by runs of up to SPAN_RECORDS, for loops over many samples at once.
+  // Their order is kept within a tag but not with the other records, but
+  // for the header, length table, laps and summary: the buffers are
+  // emptied before those, before unknown_tag and corrupt, and at the end
+  // of each parse (or chunk of a stream).
+  void (*gps_span)(void* context, const GPSSample* gps, size_t count);
+  void (*heart_rate_span)(void* context, const HeartRateSample* hearts,
+                          size_t count);
+  void (*summary)(void* context, const Summary* summary);
+  void (*treadmill)(void* context, const Treadmill* treadmill);
+  void (*swim)(void* context, const Swim* swim);
+  void (*r35)(void* context, const UnknownAndTime* r35);
+  // Known tags without a decoded layout (0x26, 0x30, 0x37).
+  void (*raw)(void* context, uint8_t tag, const uint8_t* data, int size);
+  // Unknown tag found at offset, parsing carries on with the next byte.
+  void (*unknown_tag)(void* context, uint8_t tag, size_t offset);
+  // Called before the callback above for every complete record, wanted or
+  // not, with the offset of its tag in the file.
+  void (*record)(void* context, uint8_t tag, size_t offset);
+  // Setting it turns on recovery in the parsers working from memory: on an
+  // unknown tag (not in the length table) or a GPS time going backwards,
+  // the parser skips to the next plausible record, a run of records with
+  // known tags and GPS times in order, and reports the bytes skipped. A
+  // truncated last record is reported too instead of failing the parse.
+  void (*corrupt)(void* context, size_t offset, size_t size);
+} TTBinVisitor;
+
+// Predicates on the samples, checked in the tag loop on the raw records
+// before any conversion or callback. Only the header, the length table and
+// the GPS (0x22) and heart rate (0x25) records that match are handed over.
+// The time and lap predicates apply to both kinds of records, the speed
+// one to the GPS samples only and the heart rate one to the heart rate
+// records only: a record without the field doesn't match. GPS samples
+// without a lock never match. See filter.h for the expressions.
+typedef struct {
+  uint32_t first_time;  // GPS time window (UTC), inclusive.
+  uint32_t last_time;
+  int32_t local_time_offset;  // Of the file, the heart rate times are local.
+  int lap;                    // Lap record number, -1 = any.
+  int has_speed;
+  uint16_t min_speed;  // 100 * m/s, inclusive.
+  uint16_t max_speed;
+  int has_heart_rate;
+  uint8_t min_heart_rate;  // BPM, inclusive.
+  uint8_t max_heart_rate;
+} TTBinFilter;
+
+// A part of a file to parse on its own, see index.h. begin and end are
+// offsets of tags (or the end of the file), the other fields the parser
+// state at begin.
+typedef struct {
+  size_t begin;
+  size_t end;
+  uint8_t file_format;
+  float cum_distance;  // Distance before begin, for format 5.
+  const RecordLengthTable* lengths;  // NULL for the built-in sizes.
+  const TTBinFilter* filter;  // NULL = all the records.
+  int lap;  // Number of the last lap record before begin, -1 if none.
+} TTBinRange;
+
+#define SPAN_RECORDS 256
+
+// Internal state of the parsers.
+typedef struct {
+  RecordLengthTable lengths;
+  uint8_t wanted[256];
+  uint8_t file_format;
+  float cum_distance;
+  uint32_t last_time;  // Of the last GPS sample with a lock, for recovery.
+  uint32_t jump_time;  // Last of the samples past a jump of last_time,
+  int jump_count;      // how many, 0 if none.
+  const TTBinFilter* filter;
+  int lap;  // Number of the last lap record, for the filter.
+  // Records waiting for gps_span and heart_rate_span.
+  size_t gps_count;
+  size_t heart_count;
+  GPSSample gps[SPAN_RECORDS];
+  HeartRateSample hearts[SPAN_RECORDS];
+} ParserState;
+
+// Push parser for data arriving in chunks (sync over BLE/USB, uploads...).
+typedef struct {
+  ParserState state;
+  const TTBinVisitor* visitor;
+  size_t offset;  // Offset in the file of the next byte to parse.
+  // Record cut at the end of the previous chunk, tag included.
+  uint8_t pending[1 + 65535];
+  size_t pending_size;
+} TTBinStream;
+
+// Returns the payload size of a known tag, -1 otherwise.
+int RecordSize(uint8_t tag);
+
+// Fills the table with the built-in record sizes.
+void InitRecordLengths(RecordLengthTable* table);
+
+// Overrides the table with the entries of a 0x16 record.
+void ReadRecordLengths(RecordLengthTable* table, const RecordLengths* lengths);
+
+// Parses a whole .ttbin file held in memory.
+// The payload lengths come from the 0x16 record when the file has one, so
+// tags without a callback, including unknown ones listed in it, are skipped
+// without being decoded.
+// Returns 0 on success, -1 if the last record is truncated and there is no
+// corrupt callback.
+int ParseTTBin(const uint8_t* data, size_t size, const TTBinVisitor* visitor);
+
+// Reads only the header and the summary (0x27) of a file held in memory.
+// The watch writes the summary last, so it is looked for at the end of the
+// file first, otherwise the records are skipped with the length table.
+// Returns -1 if the file has no header or no summary.
+int ReadTTBinSummary(const uint8_t* data, size_t size, Header* header,
+                     Summary* summary);
+
+// Parses the records of a range of a file held in memory.
+// Returns 0 on success, -1 if the last record of the range is truncated,
+// as ParseTTBin().
+int ParseTTBinRange(const uint8_t* data, const TTBinRange* range,
+                    const TTBinVisitor* visitor);
+
+// Starts a streaming parse. The stream is about 75 KB, better not on the
+// stack.
+void InitTTBinStream(TTBinStream* stream, const TTBinVisitor* visitor);
+
+// Parses the next chunk of the file, of any size. Complete records are
+// handed to the visitor as they arrive, a record cut at the end of the
+// chunk is kept until the next one completes it.
+void FeedTTBinStream(TTBinStream* stream, const uint8_t* data, size_t size);
+
+// Ends the stream. Returns 0 on success, -1 if the data ended in the middle
+// of a record, as ParseTTBin().
+int FinishTTBinStream(TTBinStream* stream);
+
+// Same as ParseTTBin() but reads the records one by one from a stream, for
+// inputs that can't be mapped. Returns -1 on truncated record or read error.
+// There is no recovery, unknown tags are skipped one byte at a time.
+int ParseTTBinFile(FILE* f, const TTBinVisitor* visitor);
+
+// A whole input file in memory: mapped when it's a regular file, read
+// into a buffer otherwise (pipes...).
+typedef struct {
+  const uint8_t* data;
+  size_t size;
+  int mapped;
+} InputFile;
+
+// Returns 0 on success, -1 with errno set otherwise.
+int OpenInputFile(const char* filename, InputFile* input);
+void CloseInputFile(InputFile* input);
+
+#endif  // TTBIN_H